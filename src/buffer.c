@@ -0,0 +1,61 @@
+/**************************************************************
+        buffer - growable byte buffers for non-blocking I/O
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "buffer.h"
+
+#define BUF_MIN_SIZE 256
+
+int buf_append(buffer *b, const char *data, size_t len) {
+	char *p;
+	size_t size;
+
+	if (b->len + len > b->size) {
+		size = b->size ? b->size : BUF_MIN_SIZE;
+		while (size < b->len + len) size *= 2;
+		p = realloc(b->data, size);
+		if (p == NULL) return -1;
+		b->data = p;
+		b->size = size;
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+	return 0;
+}
+
+void buf_consume(buffer *b, size_t len) {
+	if (len >= b->len) {
+		b->len = 0;
+		return;
+	}
+	memmove(b->data, b->data + len, b->len - len);
+	b->len -= len;
+}
+
+void buf_free(buffer *b) {
+	free(b->data);
+	b->data = NULL;
+	b->len = 0;
+	b->size = 0;
+}
+
+int buf_flush(buffer *b, int fd) {
+	ssize_t r;
+
+	while (b->len) {
+		r = write(fd, b->data, b->len);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			return -1;
+		}
+		buf_consume(b, r);
+	}
+	return 0;
+}
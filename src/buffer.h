@@ -0,0 +1,19 @@
+#ifndef __BUFFER_H__
+#define __BUFFER_H__
+
+#include <stddef.h>
+
+typedef struct {
+	char *data;
+	size_t len;
+	size_t size;
+} buffer;
+
+int buf_append(buffer *b, const char *data, size_t len);
+void buf_consume(buffer *b, size_t len);
+void buf_free(buffer *b);
+
+/* write as much as possible to fd, returns -1 on error */
+int buf_flush(buffer *b, int fd);
+
+#endif /*__BUFFER_H__*/
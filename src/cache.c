@@ -0,0 +1,125 @@
+/**************************************************************
+        cache - TTL cache for replies of read-only NexStar
+        queries, answered without touching the serial line
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nexbridge.h"
+#include "nexstar.h"
+#include "evloop.h"
+#include "cache.h"
+
+static int ttl[256];  /* msec, 0 - not cached */
+
+static const struct {
+	unsigned char cmd;
+	int ttl;
+} default_ttl[] = {
+	{ 'e', 250 },
+	{ 'E', 250 },
+	{ 'z', 250 },
+	{ 'Z', 250 },
+	{ 't', 1000 },
+	{ 'L', 250 },
+	{ 'J', 5000 },
+	{ 'V', CACHE_STATIC },
+	{ 'm', CACHE_STATIC },
+	{ 0, 0 }
+};
+
+int cache_config(const char *spec, int apply) {
+	char buf[256], *tok, *save = NULL;
+	int table[256];
+	int i, msec;
+	const nex_command *c;
+
+	memset(table, 0, sizeof(table));
+	snprintf(buf, sizeof(buf), "%s", spec);
+	for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		if (!strcmp(tok, "default")) {
+			for (i = 0; default_ttl[i].cmd; i++) table[default_ttl[i].cmd] = default_ttl[i].ttl;
+			continue;
+		}
+		if (strlen(tok) < 3 || tok[1] != '=') {
+			config_error("Invalid cache entry \"%s\"", tok);
+			return -1;
+		}
+		c = nex_lookup(tok[0]);
+		/* only single byte queries, 'K' echoes its argument */
+		if (c == NULL || !(c->flags & NEX_QUERY) || c->len != 1) {
+			config_error("Command '%c' can not be cached", tok[0]);
+			return -1;
+		}
+		msec = atoi(tok + 2);
+		if (msec < CACHE_STATIC) {
+			config_error("Invalid cache TTL for '%c': %d", tok[0], msec);
+			return -1;
+		}
+		table[(unsigned char)tok[0]] = msec;
+	}
+	if (apply) memcpy(ttl, table, sizeof(ttl));
+	return 0;
+}
+
+const cache_entry *cache_lookup(cache *c, const char *cmd, int len) {
+	unsigned char k = cmd[0];
+	cache_entry *e = &c->entry[k];
+
+	if (len != 1 || ttl[k] == 0) return NULL;
+	if (e->valid && (ttl[k] == CACHE_STATIC || ev_now() - e->stored < ttl[k])) {
+		c->hits[k]++;
+		return e;
+	}
+	c->misses[k]++;
+	return NULL;
+}
+
+void cache_store(cache *c, unsigned generation, const char *cmd, int len, const char *reply, int reply_len) {
+	unsigned char k = cmd[0];
+	cache_entry *e = &c->entry[k];
+
+	if (len != 1 || ttl[k] == 0) return;
+	/* the mount may have moved while this reply was on the way */
+	if (generation != c->generation) return;
+	if (reply_len > CACHE_REPLY_MAX || !nex_reply_complete(cmd, len, reply, reply_len)) return;
+	/* a garbled 'V' would be served until the tty is reopened */
+	if (!nex_reply_valid(cmd, len, reply, reply_len)) return;
+	memcpy(e->reply, reply, reply_len);
+	e->len = reply_len;
+	e->stored = ev_now();
+	e->valid = 1;
+}
+
+void cache_invalidate(cache *c) {
+	int i;
+
+	c->generation++;
+	c->invalidations++;
+	for (i = 0; i < 256; i++) {
+		if (ttl[i] != CACHE_STATIC) c->entry[i].valid = 0;
+	}
+}
+
+void cache_reset(cache *c) {
+	int i;
+
+	c->generation++;
+	for (i = 0; i < 256; i++) c->entry[i].valid = 0;
+}
+
+void cache_dump(const char *name, cache *c) {
+	unsigned long total;
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		if (ttl[i] == 0) continue;
+		total = c->hits[i] + c->misses[i];
+		LOG("Cache %s '%c': ttl=%d hits=%lu misses=%lu hit_rate=%.1f%%", name, i, ttl[i],
+		    c->hits[i], c->misses[i], total ? 100.0 * c->hits[i] / total : 0.0);
+	}
+	LOG("Cache %s: invalidations=%lu", name, c->invalidations);
+}
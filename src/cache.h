@@ -0,0 +1,43 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdint.h>
+
+#define CACHE_REPLY_MAX 32  /* all cacheable replies are short */
+#define CACHE_STATIC -1     /* keep until the tty is reopened */
+
+typedef struct {
+	char reply[CACHE_REPLY_MAX];
+	int len;
+	uint64_t stored;        /* msec */
+	int valid;
+} cache_entry;
+
+typedef struct {
+	cache_entry entry[256];
+	unsigned long hits[256];
+	unsigned long misses[256];
+	unsigned long invalidations;
+	unsigned generation;    /* bumped on every invalidation */
+} cache;
+
+/*
+ * parse a TTL table like "default,e=100,V=-1": "default" loads the built in
+ * table, cmd=msec sets one command, -1 caches until reconnect, 0 disables.
+ * Without apply it is only checked.
+ */
+int cache_config(const char *spec, int apply);
+
+/* cached reply for cmd or NULL, counts hits and misses */
+const cache_entry *cache_lookup(cache *c, const char *cmd, int len);
+void cache_store(cache *c, unsigned generation, const char *cmd, int len, const char *reply, int reply_len);
+
+/* drop everything but the static entries */
+void cache_invalidate(cache *c);
+
+/* drop everything, used when the tty is (re)opened */
+void cache_reset(cache *c);
+
+void cache_dump(const char *name, cache *c);
+
+#endif /*__CACHE_H__*/
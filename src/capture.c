@@ -0,0 +1,132 @@
+/**************************************************************
+        capture - record session traffic with direction and
+        monotonic timestamps into an append-only file
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+
+#include "capture.h"
+
+struct capture {
+	int fd;
+	int error;              /* errno of the first failed write, then writes stop */
+	uint64_t start_ns;
+	uint64_t flushed_ns;
+	size_t len;
+	char name[PATH_MAX];
+	char buf[CAPTURE_BUF];
+};
+
+static unsigned long capture_count = 0;
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+	ssize_t r;
+	size_t done = 0;
+
+	while (done < len) {
+		r = write(fd, buf + done, len - done);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		done += r;
+	}
+	return 0;
+}
+
+static void flush(capture *c, uint64_t now) {
+	if (c->len && !c->error && write_all(c->fd, c->buf, c->len) < 0) c->error = errno;
+	c->len = 0;
+	c->flushed_ns = now;
+}
+
+capture *capture_open(const char *dir, const char *peer, const char *tty) {
+	capture_header h;
+	char stamp[32];
+	time_t t = time(NULL);
+	capture *c;
+
+	if ((c = calloc(1, sizeof(capture))) == NULL) return NULL;
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&t));
+	snprintf(c->name, sizeof(c->name), "%s/%s-%d-%lu.nbcap", dir, stamp, (int)getpid(), ++capture_count);
+	c->fd = open(c->name, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+	if (c->fd < 0) {
+		free(c);
+		return NULL;
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CAPTURE_MAGIC, sizeof(h.magic));
+	h.version = CAPTURE_VERSION;
+	h.header_size = sizeof(h);
+	h.start_ns = c->start_ns = c->flushed_ns = now_ns();
+	h.start_time = t;
+	snprintf(h.peer, sizeof(h.peer), "%s", peer);
+	snprintf(h.tty, sizeof(h.tty), "%s", tty);
+	memcpy(c->buf, &h, sizeof(h));
+	c->len = sizeof(h);
+	return c;
+}
+
+void capture_write(capture *c, int dir, const void *data, size_t len) {
+	capture_record rec;
+	uint64_t now = now_ns();
+	size_t n;
+
+	if (c == NULL || c->error || len == 0) return;
+	memset(&rec, 0, sizeof(rec));
+	rec.ns = now - c->start_ns;
+	rec.len = len;
+	rec.dir = dir;
+	if (c->len + sizeof(rec) > CAPTURE_BUF) flush(c, now);
+	memcpy(c->buf + c->len, &rec, sizeof(rec));
+	c->len += sizeof(rec);
+	while (len) {
+		if (c->len == CAPTURE_BUF) flush(c, now);
+		n = (len < CAPTURE_BUF - c->len) ? len : CAPTURE_BUF - c->len;
+		memcpy(c->buf + c->len, data, n);
+		c->len += n;
+		data = (const char *)data + n;
+		len -= n;
+	}
+	if (now - c->flushed_ns > CAPTURE_FLUSH_SEC * 1000000000ULL) flush(c, now);
+}
+
+void capture_flush(capture *c) {
+	if (c && c->len) flush(c, now_ns());
+}
+
+int capture_close(capture *c) {
+	int error;
+
+	if (c == NULL) return 0;
+	flush(c, 0);
+	if (close(c->fd) < 0 && !c->error) c->error = errno;
+	error = c->error;
+	free(c);
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+const char *capture_name(const capture *c) {
+	return c->name;
+}
@@ -0,0 +1,53 @@
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Session capture file (-w): a capture_header followed by records, each a
+ * capture_record and len bytes of data, in host byte order. Records are
+ * appended in time order and are not aligned, a reader of the mmap()ed
+ * file copies the record header out before using it.
+ */
+#define CAPTURE_MAGIC "NBCAP\0\0\0"
+#define CAPTURE_VERSION 1
+#define CAPTURE_BUF (64 * 1024)
+#define CAPTURE_FLUSH_SEC 1     /* buffered data is written at least this often */
+
+enum {
+	CAPTURE_TO_CLIENT,      /* tty -> client, the relay_state.bytes[] order */
+	CAPTURE_TO_TTY          /* client -> tty */
+};
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;   /* records start here */
+	uint64_t start_ns;      /* CLOCK_MONOTONIC at open, record times count from it */
+	int64_t start_time;     /* wall clock seconds at open */
+	char peer[64];          /* client address */
+	char tty[128];
+} capture_header;
+
+typedef struct {
+	uint64_t ns;            /* since start_ns */
+	uint32_t len;
+	uint8_t dir;
+	uint8_t pad[3];
+} capture_record;
+
+typedef struct capture capture;
+
+/* creates dir/<time>-<pid>-<n>.nbcap, NULL with errno set on error */
+capture *capture_open(const char *dir, const char *peer, const char *tty);
+/* buffered append, a capture that failed to write drops the rest quietly */
+void capture_write(capture *c, int dir, const void *data, size_t len);
+/* write out what is buffered, the owner calls it every CAPTURE_FLUSH_SEC so
+   an idle session does not keep its last records in memory */
+void capture_flush(capture *c);
+/* flush and close, -1 with errno of the first failure if data was lost */
+int capture_close(capture *c);
+const char *capture_name(const capture *c);
+
+#endif /*__CAPTURE_H__*/
@@ -0,0 +1,59 @@
+#ifndef __CHANNEL_H__
+#define __CHANNEL_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/*
+ * Channel protocol, several virtual ports over one connection. A client
+ * sends CHANNEL_HELLO as the first bytes of the session, a bridge which
+ * speaks it answers with the same line and from then on both send frames:
+ * a channel_header in network byte order and len bytes of payload. Any
+ * other answer means a plain byte stream bridge, the client falls back to
+ * a connection per port. There the hello reaches the tty, so it has none
+ * of the NexStar command bytes.
+ */
+#define CHANNEL_HELLO "~#%1%#~\n"
+#define CHANNEL_HELLO_LEN (sizeof(CHANNEL_HELLO) - 1)
+#define CHANNEL_PAYLOAD_MAX 4096
+#define CHANNELS_MAX 32         /* open channels per connection */
+
+enum {
+	CH_DATA,        /* payload for the channel */
+	CH_OPEN,        /* client: connect the channel to the device on port */
+	CH_OPENED,      /* bridge: the answer to CH_OPEN, status 0 or a CH_E* code */
+	CH_CLOSE        /* either side, the channel is gone */
+};
+
+#define CH_ENODEV 1     /* no device on the port */
+#define CH_EBUSY 2      /* over CHANNELS_MAX or the connection limit (-m) */
+
+typedef struct {
+	uint8_t type;
+	uint8_t status;
+	uint16_t channel;
+	uint16_t len;
+	uint16_t port;      /* CH_OPEN: TCP port of the device, 0 for the one connected to */
+	uint32_t stamp;     /* usec clock of the client, DATA from the bridge echoes the last one */
+} channel_header;
+
+static inline void channel_encode(char *out, const channel_header *h) {
+	channel_header n = *h;
+
+	n.channel = htons(h->channel);
+	n.len = htons(h->len);
+	n.port = htons(h->port);
+	n.stamp = htonl(h->stamp);
+	memcpy(out, &n, sizeof(n));
+}
+
+static inline void channel_decode(channel_header *h, const char *in) {
+	memcpy(h, in, sizeof(*h));
+	h->channel = ntohs(h->channel);
+	h->len = ntohs(h->len);
+	h->port = ntohs(h->port);
+	h->stamp = ntohl(h->stamp);
+}
+
+#endif /*__CHANNEL_H__*/
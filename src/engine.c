@@ -0,0 +1,659 @@
+/**************************************************************
+        engine - single process event driven bridge, one tty
+        and many client sessions served from one epoll loop
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+
+#include "nexbridge.h"
+#include "engine.h"
+#include "mux.h"
+#include "poller.h"
+#include "metrics.h"
+#include "channel.h"
+#include "rfc2217.h"
+#include "udp.h"
+#include "websocket.h"
+
+#ifdef HAVE_EVLOOP
+
+#define BUFSIZZ 1024
+#define MAX_PENDING (64 * 1024)  /* drop clients that do not read their data */
+
+static device *devices = NULL;
+static ev_timer capture_timer;  /* flushes idle captures */
+static ev_handle sigusr1;
+static ev_handle sighup;
+static ev_handle sigterm[3];
+
+int set_nonblock(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0) return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int channel_send(session *c, const channel_header *h, const char *data);
+
+void session_close(session *s) {
+	device *dev = s->dev;
+	channel_header h;
+	session **sp;
+
+	if (conf.mux) {
+		mux_session_closed(s);
+		poller_unsubscribe(s);
+	}
+	if (s->carrier) {
+		for (sp = &s->carrier->channels; *sp; sp = &(*sp)->next_channel) {
+			if (*sp == s) {
+				*sp = s->next_channel;
+				break;
+			}
+		}
+		memset(&h, 0, sizeof(h));
+		h.type = CH_CLOSE;
+		h.channel = s->channel;
+		if (s->carrier->framed) channel_send(s->carrier, &h, NULL);
+	} else {
+		s->framed = 0;  /* no CH_CLOSE for the channels */
+		while (s->channels) session_close(s->channels);
+		ev_del(&s->io);
+		close(s->io.fd);
+	}
+	ev_timer_cancel(&s->timeout);
+	if (s->telnet) rfc2217_close(s);
+	if (s->ws) ws_close(s);
+	if (s->cap && capture_close(s->cap) < 0) LOG("Capture is incomplete: %s", strerror(errno));
+	buf_free(&s->in);
+	buf_free(&s->out);
+
+	for (sp = &dev->sessions; *sp; sp = &(*sp)->next) {
+		if (*sp == s) {
+			*sp = s->next;
+			break;
+		}
+	}
+	if (dev->owner == s) {
+		dev->owner = NULL;
+		dev->owner_waiting = 0;
+		tty_update(dev);
+	}
+	dev->session_count--;
+	conn_count--;
+	if (s->carrier) {
+		LOG("Channel %d of %s closed.", s->channel, s->addr);
+	} else {
+		LOG("Connection closed.");
+	}
+	ev_free_later(s);
+}
+
+/* one frame to the client of carrier c, the payload is h->len bytes of data.
+   A failed send may have cut a frame, the carrier is shut down and closes
+   with its channels on the next event, the caller only drops its channel. */
+static int channel_send(session *c, const channel_header *h, const char *data) {
+	char frame[sizeof(channel_header) + CHANNEL_PAYLOAD_MAX];
+
+	channel_encode(frame, h);
+	if (h->len) memcpy(frame + sizeof(channel_header), data, h->len);
+	if (session_send(c, frame, sizeof(channel_header) + h->len) < 0) {
+		shutdown(c->io.fd, SHUT_RDWR);
+		return -1;
+	}
+	return 0;
+}
+
+int session_send(session *s, const char *data, size_t len) {
+	channel_header h;
+
+	if (s->carrier) {
+		capture_write(s->cap, CAPTURE_TO_CLIENT, data, len);
+		memset(&h, 0, sizeof(h));
+		h.type = CH_DATA;
+		h.channel = s->channel;
+		h.stamp = s->stamp;
+		while (len) {
+			h.len = (len < CHANNEL_PAYLOAD_MAX) ? len : CHANNEL_PAYLOAD_MAX;
+			if (channel_send(s->carrier, &h, data) < 0) return -1;
+			data += h.len;
+			len -= h.len;
+		}
+		return 0;
+	}
+	if (s->telnet) {
+		capture_write(s->cap, CAPTURE_TO_CLIENT, data, len);
+		return rfc2217_send(s, data, len);
+	}
+	if (s->ws) {
+		capture_write(s->cap, CAPTURE_TO_CLIENT, data, len);
+		return ws_send(s, data, len);
+	}
+	return session_write(s, data, len);
+}
+
+int session_write(session *s, const char *data, size_t len) {
+	ssize_t r = 0;
+
+	METRIC_ADD(bytes_to_client, len);
+	if (!s->telnet && !s->ws) capture_write(s->cap, CAPTURE_TO_CLIENT, data, len);
+	if (s->out.len == 0 && !s->suspended) {
+		r = write(s->io.fd, data, len);
+		if (r < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				LOG("write(fd1): %s", strerror(errno));
+				return -1;
+			}
+			r = 0;
+		}
+		if (r == len) return 0;
+	}
+	if (s->out.len + len - r > MAX_PENDING) {
+		LOG("Client %s is not reading, dropping it", s->addr);
+		return -1;
+	}
+	if (buf_append(&s->out, data + r, len - r) < 0) return -1;
+	if (!s->suspended) ev_modify(&s->io, EV_READ | EV_WRITE);
+	return 0;
+}
+
+/* client data of a plain session or of a channel */
+static void session_input(session *s, const char *buf, size_t len) {
+	device *dev = s->dev;
+
+	if (conf.mux) {
+		mux_session_input(s, buf, len);
+		return;
+	}
+	if (dev->tty.fd < 0) {
+		LOG("Dropped %d bytes from %s, %s is not available", (int)len, s->addr, dev->tty_port);
+		if (session_send(s, TTY_ERROR_REPLY, strlen(TTY_ERROR_REPLY)) < 0) session_close(s);
+		return;
+	}
+	if (dev->owner != s) {
+		dev->owner = s;
+		tty_update(dev);
+	}
+	dev->owner_waiting = 1;
+	if (tty_write(dev, buf, len) < 0) tty_lost(dev);
+}
+
+static device *device_by_port(int port) {
+	device *dev;
+
+	for (dev = devices; dev; dev = dev->next) {
+		if (dev->port == port) return dev;
+	}
+	return NULL;
+}
+
+/* runs every CAPTURE_FLUSH_SEC while some session is captured */
+static void capture_event(ev_timer *t) {
+	device *dev;
+	session *s;
+	int active = 0;
+
+	for (dev = devices; dev; dev = dev->next) {
+		for (s = dev->sessions; s; s = s->next) {
+			if (s->cap == NULL) continue;
+			capture_flush(s->cap);
+			active = 1;
+		}
+	}
+	if (active) ev_timer_set(t, CAPTURE_FLUSH_SEC * 1000, capture_event, NULL);
+}
+
+
+static void session_timeout(ev_timer *t) {
+	session *s = t->data;
+	LOG("Session timed out");
+	session_close(s);
+}
+
+/* -w: every session and every channel is captured to its own file */
+static void session_capture(session *s) {
+	if (!conf.capture_dir[0]) return;
+	if ((s->cap = capture_open(conf.capture_dir, s->addr, s->dev->tty_port)) == NULL) {
+		LOG("Can not capture the session in %s: %s", conf.capture_dir, strerror(errno));
+		return;
+	}
+	LOG_DBG("Capturing to %s", capture_name(s->cap));
+	if (!capture_timer.armed) ev_timer_set(&capture_timer, CAPTURE_FLUSH_SEC * 1000, capture_event, NULL);
+}
+
+/* NULL with *status set to a CH_E* code if the channel is refused */
+static session *channel_open(session *c, int channel, int port, int *status) {
+	device *dev = port ? device_by_port(port) : c->dev;
+	session *s;
+	int n = 0;
+
+	for (s = c->channels; s; s = s->next_channel) n++;
+	*status = CH_EBUSY;
+	if (n >= CHANNELS_MAX || (conf.max_conn && conn_count >= conf.max_conn)) {
+		LOG("Channel %d of %s refused, %d channels and %d connections open", channel, c->addr, n, conn_count);
+		return NULL;
+	}
+	*status = CH_ENODEV;
+	if (dev == NULL || (s = calloc(1, sizeof(session))) == NULL) return NULL;
+	*status = 0;
+	s->dev = dev;
+	s->id = ++dev->next_id;
+	strcpy(s->addr, c->addr);
+	s->io.fd = -1;
+	s->hello = CHANNEL_HELLO_LEN;
+	s->carrier = c;
+	s->channel = channel;
+	s->next_channel = c->channels;
+	c->channels = s;
+	s->next = dev->sessions;
+	dev->sessions = s;
+	dev->session_count++;
+	conn_count++;
+	LOG("Channel %d of %s opened to %s", channel, c->addr, dev->tty_port);
+	if (conf.timeout) ev_timer_set(&s->timeout, conf.timeout * 1000, session_timeout, s);
+	session_capture(s);
+	return s;
+}
+
+/* returns -1 if the carrier was closed */
+static int channel_frame(session *c, const channel_header *h, const char *data) {
+	channel_header reply;
+	session *s;
+	int status;
+
+	for (s = c->channels; s && s->channel != h->channel; s = s->next_channel);
+	switch (h->type) {
+	case CH_OPEN:
+		if (s) session_close(s);
+		s = channel_open(c, h->channel, h->port, &status);
+		memset(&reply, 0, sizeof(reply));
+		reply.type = CH_OPENED;
+		reply.channel = h->channel;
+		reply.port = h->port;
+		reply.status = status;
+		if (channel_send(c, &reply, NULL) < 0) {
+			session_close(c);
+			return -1;
+		}
+		break;
+	case CH_DATA:
+		if (s == NULL) break;  /* closed or refused, the client knows */
+		s->stamp = h->stamp;
+		capture_write(s->cap, CAPTURE_TO_TTY, data, h->len);
+		session_input(s, data, h->len);
+		break;
+	case CH_CLOSE:
+		if (s) session_close(s);
+		break;
+	}
+	return 0;
+}
+
+static void carrier_input(session *c, const char *buf, size_t len) {
+	channel_header h;
+
+	if (buf_append(&c->in, buf, len) < 0) {
+		session_close(c);
+		return;
+	}
+	while (c->in.len >= sizeof(channel_header)) {
+		channel_decode(&h, c->in.data);
+		if (h.len > CHANNEL_PAYLOAD_MAX) {
+			LOG("Client %s sent a bad frame, dropping it", c->addr);
+			session_close(c);
+			return;
+		}
+		if (c->in.len < sizeof(channel_header) + h.len) break;
+		if (channel_frame(c, &h, c->in.data + sizeof(channel_header)) < 0) return;
+		buf_consume(&c->in, sizeof(channel_header) + h.len);
+	}
+}
+
+/* -R: the commands are handled in order with the data around them */
+static void telnet_input(session *s, const char *buf, size_t len) {
+	char data[BUFSIZZ];
+	size_t n;
+	int r;
+
+	while (len) {
+		r = rfc2217_input(s, buf, len, data, &n);
+		if (r < 0) {
+			session_close(s);
+			return;
+		}
+		capture_write(s->cap, CAPTURE_TO_TTY, data, n);
+		if (n) session_input(s, data, n);
+		if (s->telnet == NULL) return;  /* closed by the input */
+		buf += r;
+		len -= r;
+	}
+}
+
+/* -W: the payload of the data frames is client data */
+static void websocket_input(session *s, const char *buf, size_t len) {
+	const char *data;
+	int n;
+
+	if (ws_input(s, buf, len) < 0) {
+		LOG("Client %s sent too much WebSocket data, dropping it", s->addr);
+		session_close(s);
+		return;
+	}
+	while ((n = ws_next(s, &data)) > 0) {
+		capture_write(s->cap, CAPTURE_TO_TTY, data, n);
+		session_input(s, data, n);
+		if (s->ws == NULL) return;  /* closed by the input */
+	}
+	if (n < 0) session_close(s);
+}
+
+static void session_event(ev_handle *h, uint32_t events) {
+	session *s = h->data;
+	/* room in front for the bytes held back as a possible prefix */
+	char buf[CHANNEL_HELLO_LEN + WS_PREFIX_LEN + BUFSIZZ], *data = buf + CHANNEL_HELLO_LEN + WS_PREFIX_LEN;
+	ssize_t r;
+	int n;
+
+	if (events & EV_WRITE) {
+		if (buf_flush(&s->out, h->fd) < 0) {
+			LOG("write(fd1): %s", strerror(errno));
+			session_close(s);
+			return;
+		}
+		if (s->out.len == 0 || s->suspended) ev_modify(h, EV_READ);
+	}
+
+	if (events & (EV_READ | EV_HUP | EV_ERR)) {
+		r = read(h->fd, data, BUFSIZZ);
+		if (r < 0 && (errno == EAGAIN || errno == EINTR)) return;
+		if (r <= 0) {
+			if (r < 0) LOG("read(fd1): %s", strerror(errno));
+			session_close(s);
+			return;
+		}
+		if (s->ws) {
+			websocket_input(s, data, r);
+			return;
+		}
+		if (s->upgrade < WS_PREFIX_LEN) {
+			/* with -W a session starting with WS_PREFIX is an HTTP upgrade */
+			n = (r < WS_PREFIX_LEN - s->upgrade) ? r : WS_PREFIX_LEN - s->upgrade;
+			if (memcmp(data, WS_PREFIX + s->upgrade, n) == 0) {
+				s->upgrade += n;
+				if (s->upgrade < WS_PREFIX_LEN) return;
+				if (s->telnet) rfc2217_close(s);
+				if ((s->ws = ws_open(s)) == NULL) {
+					LOG("No memory for the WebSocket state of %s", s->addr);
+					session_close(s);
+					return;
+				}
+				n = WS_PREFIX_LEN - n;  /* held back */
+				memcpy(data - n, WS_PREFIX, n);
+				websocket_input(s, data - n, r + n);
+				return;
+			}
+			/* it was client data after all, the bytes held back go first */
+			n = s->upgrade;
+			s->upgrade = WS_PREFIX_LEN;
+			data -= n;
+			r += n;
+			memcpy(data, WS_PREFIX, n);
+		}
+		if (s->telnet) {
+			telnet_input(s, data, r);
+			return;
+		}
+		if (s->framed) {
+			carrier_input(s, data, r);
+			return;
+		}
+		if (s->hello < CHANNEL_HELLO_LEN) {
+			/* a session starting with CHANNEL_HELLO carries channels */
+			n = (r < CHANNEL_HELLO_LEN - s->hello) ? r : CHANNEL_HELLO_LEN - s->hello;
+			if (memcmp(data, CHANNEL_HELLO + s->hello, n) == 0) {
+				s->hello += n;
+				if (s->hello < CHANNEL_HELLO_LEN) return;
+				s->framed = 1;
+				LOG_DBG("Client %s speaks the channel protocol", s->addr);
+				/* each channel has its own capture, a frame stream does not replay */
+				if (s->cap) {
+					unlink(capture_name(s->cap));
+					capture_close(s->cap);
+					s->cap = NULL;
+				}
+				if (session_send(s, CHANNEL_HELLO, CHANNEL_HELLO_LEN) < 0) {
+					session_close(s);
+					return;
+				}
+				if (r > n) carrier_input(s, data + n, r - n);
+				return;
+			}
+			/* it was client data after all, the bytes held back go first */
+			n = s->hello;
+			s->hello = CHANNEL_HELLO_LEN;
+			data -= n;
+			r += n;
+			memcpy(data, CHANNEL_HELLO, n);
+		}
+		capture_write(s->cap, CAPTURE_TO_TTY, data, r);
+		session_input(s, data, r);
+	}
+}
+
+static void accept_event(ev_handle *h, uint32_t events) {
+	device *dev = h->data;
+	struct sockaddr_storage remote_addr;
+	socklen_t addr_size;
+	char addrs[INET6_ADDRSTRLEN + 1];
+	session *s;
+	int fd, val = 1;
+
+	while (1) {
+		addr_size = sizeof remote_addr;
+		fd = accept(h->fd, (struct sockaddr *)&remote_addr, &addr_size);
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				LOG("accept(): %s", strerror(errno));
+			return;
+		}
+
+		memset(addrs, 0, sizeof(addrs));
+		addr_str((struct sockaddr *)&remote_addr, addrs, sizeof addrs);
+		if ((!conf.max_conn) || (conf.max_conn > conn_count)) {
+			LOG("accept(): got connection #%d from %s fd=%d", conn_count+1, addrs, fd);
+			METRIC_ADD(connections, 1);
+		} else {
+			close(fd);
+			METRIC_ADD(connections_dropped, 1);
+			LOG("accept(): connection from %s dropped, too many connections",
+			     addrs);
+			continue;
+		}
+
+		s = calloc(1, sizeof(session));
+		if (s == NULL) {
+			close(fd);
+			continue;
+		}
+		set_nonblock(fd);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		/* with -f every reply goes out in one write, do not let Nagle hold it */
+		if (conf.framing) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+		s->dev = dev;
+		s->id = ++dev->next_id;
+		strcpy(s->addr, addrs);
+		if (ev_add(&s->io, fd, EV_READ, session_event, s) < 0) {
+			close(fd);
+			free(s);
+			continue;
+		}
+		if (conf.timeout) ev_timer_set(&s->timeout, conf.timeout * 1000, session_timeout, s);
+		if (!conf.websocket) s->upgrade = WS_PREFIX_LEN;
+		if (conf.rfc2217) {
+			s->hello = CHANNEL_HELLO_LEN;  /* telnet, not channels */
+			if ((s->telnet = rfc2217_open(s)) == NULL) LOG("No memory for the RFC 2217 state of %s", addrs);
+		}
+		session_capture(s);
+
+		s->next = dev->sessions;
+		dev->sessions = s;
+		dev->session_count++;
+		conn_count++;
+	}
+}
+
+void engine_dump_stats() {
+	char line[128];
+	device *dev;
+	session *s;
+
+	for (dev = devices; dev; dev = dev->next) {
+		LOG("Device %s: sessions=%d available=%d reopens=%lu coalesced=%lu", dev->tty_port,
+		    dev->session_count, dev->tty.fd >= 0, dev->tty_reopens, dev->coalesced);
+		if (conf.mux) LOG("Device %s: gap=%dms response=%luus errors=%lu", dev->tty_port, dev->gap,
+		                  dev->rtt, dev->tty_errors);
+		for (s = dev->sessions; s; s = s->next) {
+			if (s->latency.count == 0) continue;
+			hist_format(line, sizeof(line), &s->latency);
+			LOG("Client #%d %s latency (usec) %s", s->id, s->addr, line);
+		}
+		if (conf.cache) cache_dump(dev->tty_port, &dev->cache);
+		if (conf.poll_interval) poller_dump(dev);
+	}
+	latency_dump();
+}
+
+static void signal_event(ev_handle *h, uint32_t events) {
+	int sig = ev_signal_get(h);
+
+	switch (sig) {
+	case SIGUSR1:
+		engine_dump_stats();
+		break;
+	case SIGHUP:
+		reload_config();
+		break;
+	case SIGTERM:
+	case SIGINT:
+	case SIGQUIT:
+		daemon_exit(sig);
+		break;
+	}
+}
+
+static void engine_cleanup() {
+	device *dev;
+	session *s;
+
+	for (dev = devices; dev; dev = dev->next) {
+		/* exit() skips session_close, do not lose the buffered capture tail */
+		for (s = dev->sessions; s; s = s->next) {
+			if (s->cap && capture_close(s->cap) < 0) LOG("Capture is incomplete: %s", strerror(errno));
+			s->cap = NULL;
+		}
+		if (dev->tty.fd >= 0) close_tty(dev->tty.fd, &dev->saved_options);
+	}
+}
+
+int engine_init() {
+	if (ev_init() < 0) return -1;
+	if (ev_signal(&sigusr1, SIGUSR1, signal_event, NULL) < 0) return -1;
+	if (ev_signal(&sighup, SIGHUP, signal_event, NULL) < 0) return -1;
+	if (ev_signal(&sigterm[0], SIGTERM, signal_event, NULL) < 0) return -1;
+	if (ev_signal(&sigterm[1], SIGINT, signal_event, NULL) < 0) return -1;
+	if (ev_signal(&sigterm[2], SIGQUIT, signal_event, NULL) < 0) return -1;
+	atexit(engine_cleanup);
+	return 0;
+}
+
+device *engine_add_device(const char *tty_port, const struct termios *options, const int *socks, int count) {
+	struct sockaddr_storage sa;
+	socklen_t addr_size;
+	device *dev;
+
+	dev = calloc(1, sizeof(device));
+	if (dev == NULL) return NULL;
+	snprintf(dev->tty_port, sizeof(dev->tty_port), "%s", tty_port);
+	dev->options = *options;
+	dev->tty.fd = -1;
+	dev->gap = conf.gap;
+	addr_size = sizeof(sa);
+	if (getsockname(socks[0], (struct sockaddr *)&sa, &addr_size) == 0) {
+		/* sin_port and sin6_port are at the same place */
+		dev->port = ntohs(((struct sockaddr_in *)&sa)->sin_port);
+	}
+
+	for (; dev->listener_count < count; dev->listener_count++) {
+		set_nonblock(socks[dev->listener_count]);
+		if (ev_add(&dev->listeners[dev->listener_count], socks[dev->listener_count], EV_READ,
+		           accept_event, dev) < 0) {
+			/* the caller closes socks */
+			while (dev->listener_count) ev_del(&dev->listeners[--dev->listener_count]);
+			free(dev);
+			return NULL;
+		}
+	}
+	dev->next = devices;
+	devices = dev;
+	tty_start(dev);
+	return dev;
+}
+
+void engine_remove_device(device *dev) {
+	device **dp;
+
+	while (dev->sessions) session_close(dev->sessions);
+	if (conf.mux) mux_fail(dev);  /* what is left belongs to the bridge itself */
+	udp_stop(dev);
+	ev_timer_cancel(&dev->poll_timer);
+	ev_timer_cancel(&dev->reopen_timer);
+	tty_close(dev);
+	while (dev->listener_count) {
+		ev_del(&dev->listeners[--dev->listener_count]);
+		close(dev->listeners[dev->listener_count].fd);
+	}
+	for (dp = &devices; *dp; dp = &(*dp)->next) {
+		if (*dp == dev) {
+			*dp = dev->next;
+			break;
+		}
+	}
+	LOG("Stopped serving %s", dev->tty_port);
+	ev_free_later(dev);
+}
+
+int engine_run() {
+	return ev_run();
+}
+
+#else /* HAVE_EVLOOP */
+
+int engine_init() {
+	LOG("Event loop engine is not supported on this platform");
+	return -1;
+}
+
+device *engine_add_device(const char *tty_port, const struct termios *options, const int *socks, int count) {
+	return NULL;
+}
+
+void engine_remove_device(device *dev) {
+}
+
+int engine_run() {
+	return -1;
+}
+
+void engine_dump_stats() {
+}
+
+#endif /* HAVE_EVLOOP */
@@ -0,0 +1,114 @@
+#ifndef __ENGINE_H__
+#define __ENGINE_H__
+
+#include <termios.h>
+#include <limits.h>
+#include <arpa/inet.h>
+
+#include "evloop.h"
+#include "buffer.h"
+#include "cache.h"
+#include "latency.h"
+#include "capture.h"
+
+#define POLL_QUERIES 4
+
+typedef struct device device;
+typedef struct session session;
+typedef struct transaction transaction;
+typedef struct telnet telnet;
+typedef struct udp_server udp_server;
+typedef struct websocket websocket;
+
+struct session {
+	ev_handle io;
+	device *dev;
+	int id;
+	char addr[INET6_ADDRSTRLEN + 1];
+	buffer in;              /* client data not yet parsed into commands (-x) */
+	buffer out;             /* data waiting to be sent to the client */
+	transaction *tr;        /* queued or running transaction of this session (-x) */
+	int subscribed;         /* gets telemetry samples (-S) */
+	histogram latency;      /* command round-trips of this client (-x) */
+	capture *cap;           /* traffic of the session (-w) */
+	int hello;              /* bytes of CHANNEL_HELLO seen at the start */
+	int framed;             /* carries channels, its input is frames */
+	session *channels;      /* the channels a framed session carries */
+	session *carrier;       /* a channel: the framed session it goes through */
+	int channel;
+	uint32_t stamp;         /* of the last frame of the channel, echoed back */
+	session *next_channel;
+	telnet *telnet;         /* RFC 2217 state (-R) */
+	int suspended;          /* the client asked to hold the data for it (-R) */
+	int upgrade;            /* bytes of WS_PREFIX seen at the start (-W) */
+	websocket *ws;          /* an upgraded session, its data comes in frames */
+	ev_timer timeout;
+	session *next;
+};
+
+struct device {
+	char tty_port[255];
+	char tty_id[PATH_MAX];  /* stable /dev/serial/by-id name of tty_port if any */
+	struct termios options;
+	struct termios saved_options;
+	ev_handle tty;          /* fd is -1 while the device is not available */
+	ev_timer reopen_timer;
+	int reopen_delay;       /* msec, doubles up to REOPEN_MAX */
+	uint64_t lost_at;
+	unsigned long tty_reopens;
+	ev_handle listeners[LISTENERS_MAX];  /* every -a address, -A times */
+	int listener_count;
+	int port;               /* of the listeners, channels name the device by it */
+	udp_server *udp;        /* datagram listener on the same port (-u) */
+	buffer out;             /* data waiting to be written to the tty */
+	session *sessions;
+	session *owner;         /* the session that last wrote to the tty */
+	int owner_waiting;      /* the owner wrote and no tty data came since (no -x) */
+	int session_count;
+	int next_id;
+	transaction *queue;     /* transactions waiting for the tty (-x) */
+	transaction *queue_tail;
+	transaction *current;   /* transaction on the wire (-x) */
+	unsigned long coalesced;  /* queries answered by another one's reply */
+	ev_timer tr_timer;
+	ev_timer pace_timer;
+	int gap;                /* msec from a reply to the next command, adapted to the mount (-x) */
+	int clean;              /* transactions without an error since the gap last changed */
+	int failed_gap;         /* the last gap which gave an error */
+	uint64_t ready_at;      /* msec, when the tty takes the next command */
+	unsigned long rtt;      /* smoothed response time of the mount, usec */
+	unsigned long tty_errors;  /* timeouts and garbled replies */
+	cache cache;            /* replies of read-only queries (-C) */
+	int subscribers;        /* telemetry poller state (-S) */
+	int poll_outstanding;
+	uint64_t poll_started;
+	unsigned long poll_samples;
+	char poll_sample[POLL_QUERIES][24];
+	ev_timer poll_timer;
+	device *next;
+};
+
+/* single process alternative to the fork per connection model */
+int engine_init();
+/* serves tty_port to the clients of the count listening sockets in socks */
+device *engine_add_device(const char *tty_port, const struct termios *options, const int *socks, int count);
+/* closes the sessions, the tty and the listeners of dev */
+void engine_remove_device(device *dev);
+int engine_run();
+void engine_dump_stats();
+
+int set_nonblock(int fd);
+int session_send(session *s, const char *data, size_t len);
+/* data as it is to the client socket, no channel frame or telnet escaping */
+int session_write(session *s, const char *data, size_t len);
+void session_close(session *s);
+
+/* device manager: the tty stays open across sessions and is reopened when lost */
+void tty_start(device *dev);
+int tty_write(device *dev, const char *data, size_t len);
+void tty_lost(device *dev);
+/* after the owner of the tty or its flow control changed */
+void tty_update(device *dev);
+void tty_close(device *dev);
+
+#endif /*__ENGINE_H__*/
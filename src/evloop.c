@@ -0,0 +1,234 @@
+/**************************************************************
+        evloop - minimal epoll based event loop with timers
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+
+#include "evloop.h"
+#include "nexbridge.h"
+
+uint64_t ev_now_usec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t ev_now() {
+	return ev_now_usec() / 1000;
+}
+
+#ifdef HAVE_EVLOOP
+
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+
+#define MAX_EVENTS 64
+
+static int epfd = -1;
+static int running = 0;
+static ev_timer *timers = NULL;  /* sorted by expiration time */
+
+typedef struct free_node {
+	void *ptr;
+	struct free_node *next;
+} free_node;
+static free_node *free_list = NULL;
+
+static uint32_t to_epoll(uint32_t events) {
+	uint32_t e = 0;
+	if (events & EV_READ) e |= EPOLLIN;
+	if (events & EV_WRITE) e |= EPOLLOUT;
+	return e;
+}
+
+static uint32_t from_epoll(uint32_t e) {
+	uint32_t events = 0;
+	if (e & EPOLLIN) events |= EV_READ;
+	if (e & EPOLLOUT) events |= EV_WRITE;
+	if (e & EPOLLHUP) events |= EV_HUP;
+	if (e & EPOLLERR) events |= EV_ERR;
+	return events;
+}
+
+int ev_init() {
+	if (epfd >= 0) return 0;
+	epfd = epoll_create(MAX_EVENTS);
+	if (epfd < 0) {
+		LOG("epoll_create(): %s", strerror(errno));
+		return -1;
+	}
+	fcntl(epfd, F_SETFD, FD_CLOEXEC);
+	return 0;
+}
+
+int ev_add(ev_handle *h, int fd, uint32_t events, ev_callback cb, void *data) {
+	struct epoll_event ee;
+
+	h->fd = fd;
+	h->events = events;
+	h->cb = cb;
+	h->data = data;
+
+	memset(&ee, 0, sizeof(ee));
+	ee.events = to_epoll(events);
+	ee.data.ptr = h;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ee) < 0) {
+		LOG("epoll_ctl(ADD, %d): %s", fd, strerror(errno));
+		h->cb = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+int ev_modify(ev_handle *h, uint32_t events) {
+	struct epoll_event ee;
+
+	if (h->cb == NULL) return -1;
+	if (h->events == events) return 0;
+
+	memset(&ee, 0, sizeof(ee));
+	ee.events = to_epoll(events);
+	ee.data.ptr = h;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, h->fd, &ee) < 0) {
+		LOG("epoll_ctl(MOD, %d): %s", h->fd, strerror(errno));
+		return -1;
+	}
+	h->events = events;
+	return 0;
+}
+
+int ev_del(ev_handle *h) {
+	if (h->cb == NULL) return 0;
+	/* the handle may still be in the current batch, ev_run() skips it */
+	h->cb = NULL;
+	if (epoll_ctl(epfd, EPOLL_CTL_DEL, h->fd, NULL) < 0) {
+		LOG("epoll_ctl(DEL, %d): %s", h->fd, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int ev_signal(ev_handle *h, int sig, ev_callback cb, void *data) {
+	sigset_t mask;
+	int fd;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, sig);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+		LOG("sigprocmask(): %s", strerror(errno));
+		return -1;
+	}
+	fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0) {
+		LOG("signalfd(): %s", strerror(errno));
+		return -1;
+	}
+	return ev_add(h, fd, EV_READ, cb, data);
+}
+
+int ev_signal_get(ev_handle *h) {
+	struct signalfd_siginfo si;
+
+	if (read(h->fd, &si, sizeof(si)) != sizeof(si)) return -1;
+	return si.ssi_signo;
+}
+
+void ev_timer_cancel(ev_timer *t) {
+	ev_timer **tp;
+
+	if (!t->armed) return;
+	for (tp = &timers; *tp; tp = &(*tp)->next) {
+		if (*tp == t) {
+			*tp = t->next;
+			break;
+		}
+	}
+	t->armed = 0;
+	t->next = NULL;
+}
+
+void ev_timer_set(ev_timer *t, uint64_t msec, ev_timer_callback cb, void *data) {
+	ev_timer **tp;
+
+	ev_timer_cancel(t);
+	t->when = ev_now() + msec;
+	t->cb = cb;
+	t->data = data;
+	for (tp = &timers; *tp && (*tp)->when <= t->when; tp = &(*tp)->next);
+	t->next = *tp;
+	*tp = t;
+	t->armed = 1;
+}
+
+void ev_free_later(void *ptr) {
+	free_node *n = malloc(sizeof(free_node));
+	if (n == NULL) return; /* leak rather than risk a dangling handle */
+	n->ptr = ptr;
+	n->next = free_list;
+	free_list = n;
+}
+
+static void run_free_list() {
+	free_node *n;
+	while ((n = free_list)) {
+		free_list = n->next;
+		free(n->ptr);
+		free(n);
+	}
+}
+
+static void run_timers() {
+	ev_timer *t;
+	uint64_t now = ev_now();
+
+	while ((t = timers) && t->when <= now) {
+		timers = t->next;
+		t->armed = 0;
+		t->next = NULL;
+		t->cb(t);
+	}
+}
+
+int ev_run() {
+	struct epoll_event events[MAX_EVENTS];
+	ev_handle *h;
+	int n, i, timeout;
+	uint64_t now;
+
+	running = 1;
+	while (running) {
+		timeout = -1;
+		if (timers) {
+			now = ev_now();
+			timeout = (timers->when > now) ? (int)(timers->when - now) : 0;
+		}
+
+		n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			LOG("epoll_wait(): %s", strerror(errno));
+			return -1;
+		}
+
+		for (i = 0; i < n; i++) {
+			h = events[i].data.ptr;
+			if (h->cb) h->cb(h, from_epoll(events[i].events));
+		}
+		run_timers();
+		run_free_list();
+	}
+	return 0;
+}
+
+void ev_stop() {
+	running = 0;
+}
+
+#endif /* HAVE_EVLOOP */
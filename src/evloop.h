@@ -0,0 +1,59 @@
+#ifndef __EVLOOP_H__
+#define __EVLOOP_H__
+
+#include <stdint.h>
+#include "config.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+	#define HAVE_EVLOOP 1
+#endif
+
+#define EV_READ  0x01
+#define EV_WRITE 0x02
+#define EV_HUP   0x04
+#define EV_ERR   0x08
+
+typedef struct ev_handle ev_handle;
+typedef void (*ev_callback)(ev_handle *h, uint32_t events);
+
+struct ev_handle {
+	int fd;
+	uint32_t events;
+	ev_callback cb;
+	void *data;
+};
+
+typedef struct ev_timer ev_timer;
+typedef void (*ev_timer_callback)(ev_timer *t);
+
+struct ev_timer {
+	uint64_t when;          /* monotonic time in msec */
+	ev_timer_callback cb;
+	void *data;
+	int armed;
+	ev_timer *next;
+};
+
+uint64_t ev_now();
+uint64_t ev_now_usec();
+
+int ev_init();
+int ev_add(ev_handle *h, int fd, uint32_t events, ev_callback cb, void *data);
+int ev_modify(ev_handle *h, uint32_t events);
+int ev_del(ev_handle *h);
+
+/* fire cb after msec milliseconds, rearming an armed timer moves it */
+void ev_timer_set(ev_timer *t, uint64_t msec, ev_timer_callback cb, void *data);
+void ev_timer_cancel(ev_timer *t);
+
+/* deliver sig through the loop, cb should call ev_signal_get() to consume it */
+int ev_signal(ev_handle *h, int sig, ev_callback cb, void *data);
+int ev_signal_get(ev_handle *h);
+
+/* free ptr after all events of the current batch are dispatched */
+void ev_free_later(void *ptr);
+
+int ev_run();
+void ev_stop();
+
+#endif /*__EVLOOP_H__*/
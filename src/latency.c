@@ -0,0 +1,123 @@
+/**************************************************************
+        latency - per command and per client latency histograms
+        of the NexStar command round-trip
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "nexbridge.h"
+#include "latency.h"
+#include "nexstar.h"
+
+static histogram (*stats)[LAT_PHASES] = NULL;  /* [256][LAT_PHASES] */
+static histogram *queue_stats = NULL;          /* [NEX_PRIOS] */
+
+static const char *phase_name[LAT_PHASES] = { "queue", "tty", "total" };
+
+int latency_init() {
+	void *p;
+
+	/* shared, so the children of the fork model count in the same place */
+	p = mmap(NULL, 256 * sizeof(*stats) + NEX_PRIOS * sizeof(histogram), PROT_READ | PROT_WRITE,
+	         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) return -1;
+	stats = p;
+	queue_stats = (histogram *)(stats + 256);
+	return 0;
+}
+
+static int bucket_of(uint64_t v) {
+	int o = 0;
+
+	if (v < 4) return v;
+	while ((v >> o) > 7) o++;
+	if (o + 1 >= LAT_BUCKETS / 4) return LAT_BUCKETS - 1;
+	return 4 * (o + 1) + (int)((v >> o) & 3);
+}
+
+/* middle of the values counted in bucket i */
+static uint64_t bucket_value(int i) {
+	int o = i / 4 - 1;
+
+	if (i < 4) return i;
+	return ((uint64_t)(4 + i % 4) << o) + ((1ULL << o) >> 1);
+}
+
+void hist_add(histogram *h, uint64_t usec) {
+	__sync_fetch_and_add(&h->bucket[bucket_of(usec)], 1);
+	__sync_fetch_and_add(&h->count, 1);
+}
+
+uint64_t hist_percentile(const histogram *h, double p) {
+	unsigned long n = 0, want;
+	int i;
+
+	if (h->count == 0) return 0;
+	want = (unsigned long)(p * h->count / 100.0 + 0.5);
+	if (want < 1) want = 1;
+	for (i = 0; i < LAT_BUCKETS; i++) {
+		n += h->bucket[i];
+		if (n >= want) return bucket_value(i);
+	}
+	return bucket_value(LAT_BUCKETS - 1);
+}
+
+int hist_format(char *buf, size_t size, const histogram *h) {
+	return snprintf(buf, size, "n=%lu p50=%llu p90=%llu p99=%llu", h->count,
+	                (unsigned long long)hist_percentile(h, 50),
+	                (unsigned long long)hist_percentile(h, 90),
+	                (unsigned long long)hist_percentile(h, 99));
+}
+
+void latency_record(histogram *client, unsigned char cmd, const latency_stamp stamp) {
+	if (client) hist_add(client, stamp[2] - stamp[0]);
+	if (stats == NULL) return;
+	hist_add(&stats[cmd][LAT_QUEUE], stamp[1] - stamp[0]);
+	hist_add(&stats[cmd][LAT_TTY], stamp[2] - stamp[1]);
+	hist_add(&stats[cmd][LAT_TOTAL], stamp[2] - stamp[0]);
+}
+
+int latency_format(char *buf, size_t size, unsigned char cmd) {
+	int i, len = 0;
+
+	if (stats == NULL || stats[cmd][LAT_TOTAL].count == 0) return -1;
+	for (i = 0; i < LAT_PHASES && len < size; i++) {
+		len += snprintf(buf + len, size - len, "%s%s: ", i ? " " : "", phase_name[i]);
+		if (len < size) len += hist_format(buf + len, size - len, &stats[cmd][i]);
+	}
+	return len;
+}
+
+const histogram *latency_hist(unsigned char cmd, int phase) {
+	if (stats == NULL || stats[cmd][phase].count == 0) return NULL;
+	return &stats[cmd][phase];
+}
+
+void latency_record_queue(int prio, uint64_t usec) {
+	if (queue_stats) hist_add(&queue_stats[prio], usec);
+}
+
+const histogram *latency_queue_hist(int prio) {
+	if (queue_stats == NULL || queue_stats[prio].count == 0) return NULL;
+	return &queue_stats[prio];
+}
+
+void latency_dump() {
+	char line[256];
+	const histogram *h;
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		if (latency_format(line, sizeof(line), i) < 0) continue;
+		LOG("Latency '%c' (usec) %s", i, line);
+	}
+	for (i = 0; i < NEX_PRIOS; i++) {
+		if ((h = latency_queue_hist(i)) == NULL) continue;
+		hist_format(line, sizeof(line), h);
+		LOG("Queue delay of %s commands (usec) %s", nex_priority_name(i), line);
+	}
+}
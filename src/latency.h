@@ -0,0 +1,48 @@
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Log-linear histogram of usec values: 4 buckets per power of two, so a
+ * percentile is off by less than 25%. Updates are atomic adds, the counters
+ * live in shared memory so fork model children can record too.
+ */
+#define LAT_BUCKETS 104     /* up to ~67 s */
+
+typedef struct {
+	unsigned long count;
+	unsigned long bucket[LAT_BUCKETS];
+} histogram;
+
+enum {
+	LAT_QUEUE,  /* command complete from the client -> written to the tty */
+	LAT_TTY,    /* written to the tty -> reply complete */
+	LAT_TOTAL,
+	LAT_PHASES
+};
+
+/* stamp[] of one command: arrived, written to the tty, reply complete, usec */
+typedef uint64_t latency_stamp[3];
+
+int latency_init();
+void hist_add(histogram *h, uint64_t usec);
+uint64_t hist_percentile(const histogram *h, double p);
+/* "n=12 p50=4100 p90=4600 p99=5200", returns the snprintf() length */
+int hist_format(char *buf, size_t size, const histogram *h);
+
+/* count a finished command in the per command histograms and in client if not NULL */
+void latency_record(histogram *client, unsigned char cmd, const latency_stamp stamp);
+/* all phases of cmd in one line, -1 if it has no samples */
+int latency_format(char *buf, size_t size, unsigned char cmd);
+void latency_dump();
+/* histogram of cmd for phase, NULL if there are no samples */
+const histogram *latency_hist(unsigned char cmd, int phase);
+
+/* queueing delay of a transaction of scheduling class prio (NEX_PRIO_*, -x) */
+void latency_record_queue(int prio, uint64_t usec);
+/* NULL if there are no samples */
+const histogram *latency_queue_hist(int prio);
+
+#endif /*__LATENCY_H__*/
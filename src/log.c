@@ -0,0 +1,261 @@
+/**************************************************************
+        log - asynchronous logger, records go through a lock-free
+        ring to a writer thread
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "nexbridge.h"
+#include "metrics.h"
+#include "log.h"
+
+#define RING_MASK (LOG_RING_SIZE - 1)
+#define REPORT_INTERVAL 1   /* seconds between overflow reports */
+
+/*
+ * A slot is free for position pos when seq == lap, the position rounded
+ * down to LOG_RING_SIZE, holds a record when seq == lap + 1 and is free for
+ * the next lap when the writer sets it to lap + LOG_RING_SIZE. Zeroed
+ * slots are free for the first lap.
+ */
+typedef struct {
+	unsigned long seq;
+	int level;
+	char text[LOG_RECORD_SIZE];
+} log_record;
+
+static log_record ring[LOG_RING_SIZE];
+static unsigned long head = 0;          /* next position for the producers */
+static unsigned long tail = 0;          /* next position for the writer */
+static int started = 0;
+static int registered = 0;
+static int wake_fd = -1;
+static volatile int sleeping = 0;       /* the writer waits on wake_fd */
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int mask = LOG_UPTO(LOG_DEBUG);
+static int rate = 0;
+static time_t window = 0;
+static unsigned long window_count = 0;
+
+static unsigned long dropped = 0;       /* the ring was full */
+static unsigned long limited = 0;       /* over the rate */
+static unsigned long reported_dropped = 0;
+static unsigned long reported_limited = 0;
+static time_t reported = 0;
+static int opened = 0;
+
+static void emit(int level, const char *text) {
+	if (conf.is_daemon) {
+		if (!opened) {
+			openlog("nexbridge", LOG_PID, LOG_DAEMON);
+			opened = 1;
+		}
+		syslog(level, "%s", text);
+	} else {
+		fprintf(stderr, "%s: %s\n", (level == LOG_DEBUG) ? "DBG" : "LOG", text);
+	}
+}
+
+static int over_rate() {
+	struct timespec now;
+
+	if (rate <= 0) return 0;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	if (now.tv_sec != window) {
+		/* racy reset, the limit is approximate at the turn of a second */
+		window = now.tv_sec;
+		window_count = 0;
+	}
+	return __sync_add_and_fetch(&window_count, 1) > rate;
+}
+
+static int ring_put(int level, const char *fmt, va_list ap) {
+	unsigned long pos, lap, seq;
+	log_record *r;
+
+	while (1) {
+		pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+		r = &ring[pos & RING_MASK];
+		lap = pos & ~(unsigned long)RING_MASK;
+		seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+		if (seq == lap) {
+			if (__sync_bool_compare_and_swap(&head, pos, pos + 1)) break;
+		} else if ((long)(seq - lap) < 0) {
+			return -1;      /* still holds a record of the last lap */
+		}
+	}
+	r->level = level;
+	vsnprintf(r->text, LOG_RECORD_SIZE, fmt, ap);
+	__atomic_store_n(&r->seq, lap + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static log_record *ring_peek() {
+	log_record *r = &ring[tail & RING_MASK];
+	unsigned long lap = tail & ~(unsigned long)RING_MASK;
+
+	if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != lap + 1) return NULL;
+	return r;
+}
+
+static void ring_pop(log_record *r) {
+	unsigned long lap = tail & ~(unsigned long)RING_MASK;
+
+	__atomic_store_n(&r->seq, lap + LOG_RING_SIZE, __ATOMIC_RELEASE);
+	tail++;
+}
+
+static void report(int force) {
+	char text[LOG_RECORD_SIZE];
+	unsigned long d = dropped, l = limited;
+	time_t now = time(NULL);
+
+	if (d == reported_dropped && l == reported_limited) return;
+	if (!force && now - reported < REPORT_INTERVAL) return;
+	snprintf(text, sizeof(text), "Log: %lu messages dropped (ring full), %lu over the rate limit",
+	         d - reported_dropped, l - reported_limited);
+	emit(LOG_INFO, text);
+	reported_dropped = d;
+	reported_limited = l;
+	reported = now;
+}
+
+static void drain(int force) {
+	log_record *r;
+
+	while ((r = ring_peek())) {
+		emit(r->level, r->text);
+		ring_pop(r);
+	}
+	report(force);
+}
+
+void log_write(int level, const char *fmt, ...) {
+	char text[LOG_RECORD_SIZE];
+	uint64_t one = 1;
+	va_list ap;
+
+	if (conf.is_daemon && !(LOG_MASK(level) & mask)) return;
+	if (over_rate()) {
+		__sync_add_and_fetch(&limited, 1);
+		METRIC_ADD(log_limited, 1);
+		return;
+	}
+	va_start(ap, fmt);
+	if (!started) {
+		vsnprintf(text, sizeof(text), fmt, ap);
+		emit(level, text);
+	} else if (ring_put(level, fmt, ap) < 0) {
+		__sync_add_and_fetch(&dropped, 1);
+		METRIC_ADD(log_dropped, 1);
+	} else if (__sync_lock_test_and_set(&sleeping, 0)) {
+		if (write(wake_fd, &one, sizeof(one)) < 0) {
+			/* the writer wakes up on its own within a second */
+		}
+	}
+	va_end(ap);
+}
+
+int log_mask(int m) {
+	int old = mask;
+	mask = m;
+	setlogmask(m);
+	return old;
+}
+
+void log_rate(int per_sec) {
+	rate = per_sec;
+}
+
+void log_flush() {
+	int tries = 0;
+
+	/* do not wait forever for a writer stuck in syslog() */
+	while (pthread_mutex_trylock(&drain_mutex)) {
+		if (++tries == 100) return;
+		usleep(1000);
+	}
+	drain(1);
+	pthread_mutex_unlock(&drain_mutex);
+}
+
+static void *writer(void *data) {
+	struct pollfd pfd = { wake_fd, POLLIN, 0 };
+	sigset_t sigs;
+	uint64_t n;
+
+	sigfillset(&sigs);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+	while (1) {
+		pthread_mutex_lock(&drain_mutex);
+		drain(0);
+		pthread_mutex_unlock(&drain_mutex);
+
+		sleeping = 1;
+		__sync_synchronize();
+		if (ring_peek()) {
+			sleeping = 0;
+			continue;
+		}
+		if (poll(&pfd, 1, 1000) > 0 && read(wake_fd, &n, sizeof(n)) < 0) {
+			/* nothing to do, drain again */
+		}
+	}
+	return NULL;
+}
+
+/* the writer may be inside syslog() or stdio, a child would inherit their
+   locks taken, so fork() waits until it is done draining */
+static void log_before_fork() {
+	pthread_mutex_lock(&drain_mutex);
+}
+
+static void log_parent_fork() {
+	pthread_mutex_unlock(&drain_mutex);
+}
+
+/* the writer thread does not survive fork(), records the parent has not
+   written yet are its own */
+static void log_after_fork() {
+	memset(ring, 0, sizeof(ring));
+	head = tail = 0;
+	sleeping = 0;
+	started = 0;
+	if (wake_fd >= 0) close(wake_fd);
+	wake_fd = -1;
+	pthread_mutex_unlock(&drain_mutex);
+	dropped = reported_dropped = 0;
+	limited = reported_limited = 0;
+}
+
+int log_start() {
+	pthread_t tid;
+
+	if (started) return 0;
+	if ((wake_fd = eventfd(0, EFD_CLOEXEC)) < 0) return -1;
+	if (!registered) {
+		pthread_atfork(log_before_fork, log_parent_fork, log_after_fork);
+		atexit(log_flush);
+		registered = 1;
+	}
+	if (pthread_create(&tid, NULL, writer, NULL)) {
+		close(wake_fd);
+		wake_fd = -1;
+		return -1;
+	}
+	pthread_detach(tid);
+	started = 1;
+	return 0;
+}
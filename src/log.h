@@ -0,0 +1,24 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <syslog.h>
+
+/*
+ * LOG() and LOG_DBG() format into a lock-free ring of fixed size records
+ * and a writer thread of the process sends them to syslog or stderr, so a
+ * relay never waits for the syslog socket. Before log_start() and in a
+ * fork child until it calls log_start() the caller writes them itself.
+ */
+#define LOG_RECORD_SIZE 256
+#define LOG_RING_SIZE 256       /* records, a power of two */
+
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+/* setlogmask() which also filters before a record is formatted, returns the old mask */
+int log_mask(int mask);
+/* at most per_sec messages per second and process, 0 for no limit */
+void log_rate(int per_sec);
+int log_start();
+/* write out what is in the ring, call it before _exit() */
+void log_flush();
+
+#endif /*__LOG_H__*/
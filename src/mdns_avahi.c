@@ -23,17 +23,28 @@
 static AvahiEntryGroup *group = NULL;
 static AvahiSimplePoll *simple_poll = NULL;
 static AvahiClient *client = NULL;
-static char *name = NULL;
 
-static char svc_name[255];
-static char svc_text[255];
-static char svc_type[255];
-static int svc_port;
+typedef struct {
+	char *name;             /* current name, changes on collisions */
+	char svc_name[255];
+	char svc_text[255];
+	char svc_type[255];
+	int svc_port;
+} mdns_service;
+
+/* services are what the avahi thread publishes, wanted is set by the others */
+static mdns_service services[MDNS_SERVICES_MAX];
+static int service_count = 0;
+static mdns_service wanted[MDNS_SERVICES_MAX];
+static int wanted_count = 0;
+static volatile int republish = 0;
+static pthread_mutex_t services_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 pthread_mutex_t sleep_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t sleep_cond = PTHREAD_COND_INITIALIZER;
 
 static pthread_t tid;
+static int started = 0;
 
 static void create_services(AvahiClient *c);
 
@@ -54,7 +65,27 @@ int thread_sleep(int seconds) {
 }
 
 
+static void load_services() {
+	int i;
+
+	pthread_mutex_lock(&services_mutex);
+	for (i = 0; i < service_count; i++) avahi_free(services[i].name);
+	memcpy(services, wanted, wanted_count * sizeof(mdns_service));
+	service_count = wanted_count;
+	for (i = 0; i < service_count; i++) services[i].name = avahi_strdup(services[i].svc_name);
+	republish = 0;
+	pthread_mutex_unlock(&services_mutex);
+}
+
+static void rename_service(mdns_service *svc) {
+	char *n = avahi_alternative_service_name(svc->name);
+	avahi_free(svc->name);
+	svc->name = n;
+}
+
 static void entry_group_callback(AvahiEntryGroup *g, AvahiEntryGroupState state, AVAHI_GCC_UNUSED void *userdata) {
+	int i;
+
 	assert(g == group || group == NULL);
 	group = g;
 
@@ -62,18 +93,19 @@ static void entry_group_callback(AvahiEntryGroup *g, AvahiEntryGroupState state,
 	switch (state) {
 		case AVAHI_ENTRY_GROUP_ESTABLISHED :
 			/* The entry group has been established successfully */
-			LOG_DBG("avahi cleint: Service '%s' of type %s successfully established.", name, svc_type);
+			for (i = 0; i < service_count; i++)
+				LOG_DBG("avahi cleint: Service '%s' of type %s successfully established.", services[i].name, services[i].svc_type);
 			break;
 
 		case AVAHI_ENTRY_GROUP_COLLISION : {
-			char *n;
-			/* A service name collision with a remote service. */
-			n = avahi_alternative_service_name(name);
-			avahi_free(name);
-			name = n;
-			LOG("avahi_client: Service name collision, renaming service to '%s'", name);
+			/* A service name collision with a remote service, the group does not tell which one */
+			for (i = 0; i < service_count; i++) {
+				rename_service(&services[i]);
+				LOG("avahi_client: Service name collision, renaming service to '%s'", services[i].name);
+			}
 
 			/* And recreate the services */
+			avahi_entry_group_reset(g);
 			create_services(avahi_entry_group_get_client(g));
 			break;
 		}
@@ -92,9 +124,10 @@ static void entry_group_callback(AvahiEntryGroup *g, AvahiEntryGroupState state,
 }
 
 static void create_services(AvahiClient *c) {
-	char *n;
-	int ret;
+	mdns_service *svc = NULL;
+	int i, ret;
 	assert(c);
+	if (service_count == 0) return;
 
 	/* If this is the first time we're called, let's create a new
 	 * entry group if necessary */
@@ -105,12 +138,15 @@ static void create_services(AvahiClient *c) {
 		}
 
 	if (avahi_entry_group_is_empty(group)) {
-		LOG_DBG("avahi cleint: Adding service '%s' of type '%s'", name, svc_type);
-
-		if ((ret = avahi_entry_group_add_service(group, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, 0, name, svc_type, NULL, NULL, svc_port, svc_text, NULL)) < 0) {
-			if (ret == AVAHI_ERR_COLLISION) goto collision;
-			LOG("avahi client: Failed to add service: %s", avahi_strerror(ret));
-			goto fail;
+		for (i = 0; i < service_count; i++) {
+			svc = &services[i];
+			LOG_DBG("avahi cleint: Adding service '%s' of type '%s'", svc->name, svc->svc_type);
+
+			if ((ret = avahi_entry_group_add_service(group, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, 0, svc->name, svc->svc_type, NULL, NULL, svc->svc_port, svc->svc_text, NULL)) < 0) {
+				if (ret == AVAHI_ERR_COLLISION) goto collision;
+				LOG("avahi client: Failed to add service: %s", avahi_strerror(ret));
+				goto fail;
+			}
 		}
 
 		/* Tell the server to register the service */
@@ -123,10 +159,8 @@ static void create_services(AvahiClient *c) {
 
 collision:
 	/* A service name collision with a local service happened. */
-	n = avahi_alternative_service_name(name);
-	avahi_free(name);
-	name = n;
-	LOG("avahi client: Service name collision, renaming to '%s'", name);
+	rename_service(svc);
+	LOG("avahi client: Service name collision, renaming to '%s'", svc->name);
 	avahi_entry_group_reset(group);
 	create_services(c);
 	return;
@@ -160,7 +194,7 @@ static void client_callback(AvahiClient *c, AvahiClientState state, AVAHI_GCC_UN
 }
 
 void *avahi_thread(void *data) {
-	int error;
+	int error, i;
 	int ret = 1;
 	int retrys = 4;
 
@@ -170,7 +204,7 @@ void *avahi_thread(void *data) {
 		goto fail;
 	}
 
-	name = avahi_strdup(svc_name);
+	load_services();
 
 	/* Allocate a new client */
 retry:
@@ -190,8 +224,13 @@ retry:
 		}
 	}
 
-	/* Run the main loop */
-	avahi_simple_poll_loop(simple_poll);
+	/* Run the main loop, mdns_update() wakes it up to publish a new list */
+	while (avahi_simple_poll_iterate(simple_poll, -1) == 0) {
+		if (!republish) continue;
+		load_services();
+		if (group) avahi_entry_group_reset(group);
+		if (avahi_client_get_state(client) == AVAHI_CLIENT_S_RUNNING) create_services(client);
+	}
 
 	ret = 0;
 
@@ -200,28 +239,62 @@ fail:
 
 	if (simple_poll) avahi_simple_poll_free(simple_poll);
 
-	avahi_free(name);
+	for (i = 0; i < service_count; i++) {
+		avahi_free(services[i].name);
+		services[i].name = NULL;
+	}
 	pthread_exit(&ret);
 }
 
-int mdns_init(char *name, char *type, char *text, int port) {
-	strncpy(svc_name, name, 255);
-	strncpy(svc_type, type, 255);
-	if (text != NULL) strncpy(svc_text, text, 255);
-	else svc_text[0] = '\0';
-	svc_port = port;
+int mdns_add(char *name, char *type, char *text, int port) {
+	mdns_service *svc;
+
+	pthread_mutex_lock(&services_mutex);
+	if (wanted_count == MDNS_SERVICES_MAX) {
+		pthread_mutex_unlock(&services_mutex);
+		return -1;
+	}
+	svc = &wanted[wanted_count++];
+	memset(svc, 0, sizeof(mdns_service));
+	strncpy(svc->svc_name, name, 254);
+	strncpy(svc->svc_type, type, 254);
+	if (text != NULL) strncpy(svc->svc_text, text, 254);
+	svc->svc_port = port;
+	pthread_mutex_unlock(&services_mutex);
 	return 0;
 }
 
+void mdns_clear() {
+	pthread_mutex_lock(&services_mutex);
+	wanted_count = 0;
+	pthread_mutex_unlock(&services_mutex);
+}
+
+int mdns_init(char *name, char *type, char *text, int port) {
+	mdns_clear();
+	return mdns_add(name, type, text, port);
+}
+
 int mdns_start() {
 	int rc = pthread_create(&tid, NULL, avahi_thread, NULL);
 	if (rc) return rc;
+	started = 1;
 	rc = pthread_detach(tid);
 	return rc;
 }
 
+int mdns_update() {
+	if (!started) return wanted_count ? mdns_start() : 0;
+	republish = 1;
+	if (simple_poll) avahi_simple_poll_wakeup(simple_poll);
+	return 0;
+}
+
 int mdns_stop() {
-	int rc = pthread_cancel(tid);
+	int rc;
+
+	if (!started) return 0;
+	rc = pthread_cancel(tid);
 	if(rc) return rc;
 	rc = pthread_join(tid, NULL);
 	return rc;
@@ -233,10 +306,21 @@ int mdns_init(char *name, char *type, char *text, int port) {
         return 0;
 }
 
+int mdns_add(char *name, char *type, char *text, int port) {
+        return 0;
+}
+
+void mdns_clear() {
+}
+
 int mdns_start() {
 	return 0;
 }
 
+int mdns_update() {
+	return 0;
+}
+
 int mdns_stop() {
         return 0;
 }
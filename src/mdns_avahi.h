@@ -2,8 +2,15 @@
 #define __MDNS_AVAHI_H__
 #include "config.h"
 
+#define MDNS_SERVICES_MAX 32
+
+/* mdns_init() publishes one service, mdns_add() more, all from one avahi client */
 int mdns_init(char *name, char *type, char *text, int port);
+int mdns_add(char *name, char *type, char *text, int port);
+void mdns_clear();
 int mdns_start();
+/* publish the current service list, starts the client if it is not running */
+int mdns_update();
 int mdns_stop();
 
 #ifdef HAVE_LIBAVAHI_CLIENT
@@ -0,0 +1,193 @@
+/**************************************************************
+        metrics - bridge counters and latency summaries for
+        Prometheus, served over HTTP on a separate port
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "nexbridge.h"
+#include "latency.h"
+#include "metrics.h"
+#include "nexstar.h"
+
+#define REQUEST_MAX 1024
+#define BODY_MAX (64 * 1024)
+
+metrics_counters *metrics = NULL;
+
+static const double quantiles[] = { 0.5, 0.9, 0.99 };
+
+int metrics_init() {
+	void *p;
+
+	p = mmap(NULL, sizeof(metrics_counters), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) return -1;
+	metrics = p;
+	return 0;
+}
+
+/*
+ * ListenOverflows and ListenDrops of TcpExt in /proc/net/netstat, they count
+ * for the whole host, not only the bridge. -1 if they can not be read.
+ */
+static int listen_overflows(unsigned long *overflows, unsigned long *drops) {
+	char names[8192], values[8192], *n, *v, *ns, *vs;
+	int found = 0;
+	FILE *f;
+
+	if ((f = fopen("/proc/net/netstat", "r")) == NULL) return -1;
+	while (fgets(names, sizeof(names), f) && fgets(values, sizeof(values), f)) {
+		if (strncmp(names, "TcpExt:", 7) || strncmp(values, "TcpExt:", 7)) continue;
+		n = strtok_r(names + 7, " \n", &ns);
+		v = strtok_r(values + 7, " \n", &vs);
+		for (; n && v; n = strtok_r(NULL, " \n", &ns), v = strtok_r(NULL, " \n", &vs)) {
+			if (!strcmp(n, "ListenOverflows")) {
+				*overflows = strtoul(v, NULL, 10);
+				found++;
+			} else if (!strcmp(n, "ListenDrops")) {
+				*drops = strtoul(v, NULL, 10);
+				found++;
+			}
+		}
+		break;
+	}
+	fclose(f);
+	return (found == 2) ? 0 : -1;
+}
+
+static int format_metrics(char *buf, size_t size) {
+	const histogram *h;
+	unsigned long overflows = 0, drops = 0;
+	int i, q, len = 0;
+
+#define OUT(...) { if (len < size) len += snprintf(buf + len, size - len, __VA_ARGS__); }
+	OUT("# TYPE nexbridge_bytes_total counter\n");
+	OUT("nexbridge_bytes_total{direction=\"to_client\"} %llu\n", metrics->bytes_to_client);
+	OUT("nexbridge_bytes_total{direction=\"to_tty\"} %llu\n", metrics->bytes_to_tty);
+	OUT("# TYPE nexbridge_sessions gauge\n");
+	OUT("nexbridge_sessions %d\n", conn_count);
+	OUT("# TYPE nexbridge_connections_total counter\n");
+	OUT("nexbridge_connections_total %lu\n", metrics->connections);
+	OUT("# TYPE nexbridge_connections_dropped_total counter\n");
+	OUT("nexbridge_connections_dropped_total %lu\n", metrics->connections_dropped);
+	OUT("# TYPE nexbridge_tty_lost_total counter\n");
+	OUT("nexbridge_tty_lost_total %lu\n", metrics->tty_lost);
+	OUT("# TYPE nexbridge_tty_reopens_total counter\n");
+	OUT("nexbridge_tty_reopens_total %lu\n", metrics->tty_reopens);
+	OUT("# TYPE nexbridge_log_dropped_total counter\n");
+	OUT("nexbridge_log_dropped_total{reason=\"ring_full\"} %lu\n", metrics->log_dropped);
+	OUT("nexbridge_log_dropped_total{reason=\"rate_limit\"} %lu\n", metrics->log_limited);
+	OUT("# TYPE nexbridge_udp_datagrams_total counter\n");
+	OUT("nexbridge_udp_datagrams_total{result=\"command\"} %lu\n", metrics->udp_commands);
+	OUT("nexbridge_udp_datagrams_total{result=\"duplicate\"} %lu\n", metrics->udp_duplicates);
+	OUT("nexbridge_udp_datagrams_total{result=\"dropped\"} %lu\n", metrics->udp_dropped);
+	OUT("# TYPE nexbridge_tty_errors_total counter\n");
+	OUT("nexbridge_tty_errors_total{reason=\"timeout\"} %lu\n", metrics->tty_timeouts);
+	OUT("nexbridge_tty_errors_total{reason=\"garbled\"} %lu\n", metrics->tty_garbled);
+	OUT("# TYPE nexbridge_coalesced_total counter\n");
+	OUT("nexbridge_coalesced_total %lu\n", metrics->coalesced);
+	if (listen_overflows(&overflows, &drops) == 0) {
+		/* host wide, the kernel does not count them per socket */
+		OUT("# TYPE nexbridge_listen_overflows_total counter\n");
+		OUT("nexbridge_listen_overflows_total{reason=\"overflow\"} %lu\n", overflows);
+		OUT("nexbridge_listen_overflows_total{reason=\"drop\"} %lu\n", drops);
+	}
+	OUT("# TYPE nexbridge_command_latency_usec summary\n");
+	for (i = 0; i < 256; i++) {
+		if ((h = latency_hist(i, LAT_TOTAL)) == NULL) continue;
+		for (q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+			OUT("nexbridge_command_latency_usec{cmd=\"%c\",quantile=\"%g\"} %llu\n", i, quantiles[q],
+			    (unsigned long long)hist_percentile(h, quantiles[q] * 100));
+		}
+		OUT("nexbridge_command_latency_usec_count{cmd=\"%c\"} %lu\n", i, h->count);
+	}
+	OUT("# TYPE nexbridge_queue_delay_usec summary\n");
+	for (i = 0; i < NEX_PRIOS; i++) {
+		if ((h = latency_queue_hist(i)) == NULL) continue;
+		for (q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+			OUT("nexbridge_queue_delay_usec{class=\"%s\",quantile=\"%g\"} %llu\n", nex_priority_name(i),
+			    quantiles[q], (unsigned long long)hist_percentile(h, quantiles[q] * 100));
+		}
+		OUT("nexbridge_queue_delay_usec_count{class=\"%s\"} %lu\n", nex_priority_name(i), h->count);
+	}
+#undef OUT
+	return (len < size) ? len : size - 1;
+}
+
+static void serve(int fd, char *body) {
+	char req[REQUEST_MAX + 1], head[256];
+	struct timeval tv = { 2, 0 };
+	int r, len = 0, body_len;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	while (len < REQUEST_MAX) {
+		r = read(fd, req + len, REQUEST_MAX - len);
+		if (r <= 0) return;
+		len += r;
+		req[len] = '\0';
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) break;
+	}
+	req[len] = '\0';
+	if (strncmp(req, "GET /metrics ", 13) && strncmp(req, "GET / ", 6)) {
+		r = snprintf(head, sizeof(head), "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+		r = write(fd, head, r);
+		return;
+	}
+	body_len = format_metrics(body, BODY_MAX);
+	r = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+	             "Content-Type: text/plain; version=0.0.4\r\n"
+	             "Content-Length: %d\r\n\r\n", body_len);
+	if (write(fd, head, r) == r) r = write(fd, body, body_len);
+}
+
+static void *metrics_thread(void *arg) {
+	int sock = (int)(long)arg;
+	char *body;
+	int fd;
+
+	if ((body = malloc(BODY_MAX)) == NULL) return NULL;
+	while (1) {
+		fd = accept(sock, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			LOG("metrics accept(): %s", strerror(errno));
+			/* out of descriptors, give the sessions time to close some */
+			poll(NULL, 0, 100);
+			continue;
+		}
+		serve(fd, body);
+		close(fd);
+	}
+	return NULL;
+}
+
+int metrics_start(int sock) {
+	pthread_t thread;
+	sigset_t all, old;
+	int r;
+
+	if (metrics == NULL) return -1;
+	/* signals stay with the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	r = pthread_create(&thread, NULL, metrics_thread, (void *)(long)sock);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (r) {
+		errno = r;
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
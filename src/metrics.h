@@ -0,0 +1,34 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+/*
+ * Bridge counters, kept in shared memory so the children of the fork model
+ * count in the same place, and served in Prometheus text format over HTTP.
+ */
+typedef struct {
+	unsigned long long bytes_to_client;
+	unsigned long long bytes_to_tty;
+	unsigned long connections;
+	unsigned long connections_dropped;  /* refused by the -m limit */
+	unsigned long tty_lost;
+	unsigned long tty_reopens;
+	unsigned long log_dropped;          /* the log ring was full */
+	unsigned long log_limited;          /* over the -r rate */
+	unsigned long udp_commands;         /* datagrams run as commands (-u) */
+	unsigned long udp_duplicates;       /* retransmits answered from the history */
+	unsigned long udp_dropped;          /* not one command, or too many in flight */
+	unsigned long coalesced;            /* queries answered by an identical one in flight (-x) */
+	unsigned long tty_timeouts;         /* transactions without a complete reply (-x) */
+	unsigned long tty_garbled;          /* complete replies which can not be the answer (-x) */
+} metrics_counters;
+
+extern metrics_counters *metrics;
+
+#define METRIC_ADD(field, n) \
+	{ if (metrics) (void)__sync_add_and_fetch(&metrics->field, (n)); }
+
+int metrics_init();
+/* serve GET /metrics on sock from a thread of its own */
+int metrics_start(int sock);
+
+#endif /*__METRICS_H__*/
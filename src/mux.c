@@ -0,0 +1,419 @@
+/**************************************************************
+        mux - share one tty between many sessions by running
+        NexStar commands as whole request/response transactions
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+
+#include "nexbridge.h"
+#include "mux.h"
+#include "poller.h"
+#include "metrics.h"
+
+#ifdef HAVE_EVLOOP
+
+#define TRANSACTION_TIMEOUT 3000 /* msec, slow hand controllers need ~1s for some queries */
+#define GAP_MAX 250         /* msec */
+#define CLEAN_RUN 32        /* transactions without an error before the gap shrinks */
+#define PROBE_RUN 512       /* before it shrinks to a gap which gave an error */
+
+static void mux_kick(device *dev);
+static void session_dispatch(session *s);
+
+static const cache_entry tty_error = { TTY_ERROR_REPLY, sizeof(TTY_ERROR_REPLY) - 1, 0, 1 };
+
+/* give the reply of t to whoever asked for it and free t. A timed out
+   command is answered with TTY_ERROR_REPLY, not with what came of it. */
+static void transaction_reply(device *dev, transaction *t) {
+	session *s = t->s;
+	int complete = nex_reply_complete(t->cmd, t->cmd_len, t->reply, t->reply_len);
+	int r;
+
+	if (complete) latency_record(s ? &s->latency : NULL, t->cmd[0], t->stamp);
+	if (t->done) {
+		t->done(dev, t);
+	} else if (s) {
+		s->tr = NULL;
+		if (complete) r = session_send(s, t->reply, t->reply_len);
+		else r = session_send(s, TTY_ERROR_REPLY, strlen(TTY_ERROR_REPLY));
+		if (r < 0) {
+			session_close(s);
+			s = NULL;
+		}
+	}
+	free(t);
+	if (s) session_dispatch(s);
+}
+
+/*
+ * Hand controllers drop or garble commands which come too close after the
+ * last reply. A timeout or a garbled reply doubles the gap, at least to half
+ * the response time of the mount, a run of clean transactions takes an 1/8
+ * off it again, not below -g. It stops above the last gap which failed and
+ * tries that one again only after a long clean run, so a mount which needs
+ * 30 msec settles just above it instead of failing every few dozen commands.
+ */
+static void pace(device *dev, transaction *t) {
+	int complete = nex_reply_complete(t->cmd, t->cmd_len, t->reply, t->reply_len);
+	unsigned long rtt = t->stamp[2] - t->stamp[1];
+	int gap = dev->gap;
+
+	dev->ready_at = ev_now() + dev->gap;
+	if (nex_lookup(t->cmd[0]) == NULL) return;  /* no telling what the answer is */
+	if (complete && nex_reply_valid(t->cmd, t->cmd_len, t->reply, t->reply_len)) {
+		dev->rtt = dev->rtt ? dev->rtt + ((long)rtt - (long)dev->rtt) / 8 : rtt;
+		if (++dev->clean < CLEAN_RUN) return;
+		gap -= (gap - conf.gap + 7) / 8;
+		if (gap <= dev->failed_gap) {
+			if (dev->clean < PROBE_RUN) {
+				if (dev->gap > dev->failed_gap + 1) gap = dev->failed_gap + 1;
+				else return;
+			} else {
+				gap = dev->failed_gap;
+				dev->failed_gap = 0;
+			}
+		}
+	} else {
+		dev->tty_errors++;
+		dev->failed_gap = gap;
+		if (complete) {
+			METRIC_ADD(tty_garbled, 1);
+		} else {
+			METRIC_ADD(tty_timeouts, 1);
+		}
+		gap = (gap * 2 > dev->rtt / 2000) ? gap * 2 : dev->rtt / 2000;
+		if (gap < 1) gap = 1;
+		if (gap > GAP_MAX) gap = GAP_MAX;
+	}
+	if (gap < conf.gap) gap = conf.gap;
+	dev->clean = 0;
+	if (gap == dev->gap) return;
+	if (gap > dev->gap) {
+		LOG("%s on %s, %d msec between commands now", complete ? "Garbled reply" : "Timeout", dev->tty_port, gap);
+	} else {
+		LOG_DBG("No errors on %s, %d msec between commands now", dev->tty_port, gap);
+	}
+	dev->gap = gap;
+	dev->ready_at = ev_now() + gap;
+}
+
+static void transaction_done(device *dev) {
+	transaction *t = dev->current;
+	transaction *w, *waiters = t->waiters;
+
+	ev_timer_cancel(&dev->tr_timer);
+	dev->current = NULL;
+	t->stamp[2] = ev_now_usec();
+	pace(dev, t);
+	if (conf.cache) {
+		if (nex_is_query(t->cmd, t->cmd_len))
+			cache_store(&dev->cache, t->generation, t->cmd, t->cmd_len, t->reply, t->reply_len);
+		else
+			cache_invalidate(&dev->cache); /* the motion has started now */
+	}
+	for (w = waiters; w; w = w->next) {
+		memcpy(w->reply, t->reply, t->reply_len);
+		w->reply_len = t->reply_len;
+		w->stamp[1] = (w->stamp[0] > t->stamp[1]) ? w->stamp[0] : t->stamp[1];
+		w->stamp[2] = t->stamp[2];
+		latency_record_queue(w->prio, w->stamp[1] - w->stamp[0]);
+	}
+	transaction_reply(dev, t);
+	while ((w = waiters)) {
+		waiters = w->next;
+		transaction_reply(dev, w);
+	}
+	mux_kick(dev);
+}
+
+static void transaction_timeout(ev_timer *timer) {
+	device *dev = timer->data;
+	transaction *t = dev->current;
+
+	LOG("Command '%c' timed out on %s, got %d reply bytes", t->cmd[0], dev->tty_port, t->reply_len);
+	/* do not let a late reply end up in the next transaction */
+	tcflush(dev->tty.fd, TCIFLUSH);
+	transaction_done(dev);
+}
+
+static void pace_timeout(ev_timer *timer) {
+	mux_kick(timer->data);
+}
+
+/* put the next transaction on the wire if the tty is idle */
+static void mux_kick(device *dev) {
+	transaction *t;
+	uint64_t now;
+
+	if (dev->current || dev->queue == NULL || dev->tty.fd < 0) return;
+	if (dev->gap && (now = ev_now()) < dev->ready_at) {
+		ev_timer_set(&dev->pace_timer, dev->ready_at - now, pace_timeout, dev);
+		return;
+	}
+
+	t = dev->queue;
+	dev->queue = t->next;
+	if (dev->queue == NULL) dev->queue_tail = NULL;
+	t->next = NULL;
+	dev->current = t;
+
+	ev_timer_set(&dev->tr_timer, TRANSACTION_TIMEOUT, transaction_timeout, dev);
+	t->stamp[1] = ev_now_usec();
+	latency_record_queue(t->prio, t->stamp[1] - t->stamp[0]);
+	if (tty_write(dev, t->cmd, t->cmd_len) < 0) tty_lost(dev);
+}
+
+static int same_command(const transaction *a, const transaction *b) {
+	return a->cmd_len == b->cmd_len && !memcmp(a->cmd, b->cmd, a->cmd_len);
+}
+
+/*
+ * a query identical to t which will still answer it, NULL if there is none.
+ * Queued commands which are not queries run before any queued query, but
+ * after the one on the wire.
+ */
+static transaction *find_leader(device *dev, const transaction *t) {
+	transaction *q;
+
+	if (t->prio != NEX_PRIO_QUERY) return NULL;
+	for (q = dev->queue; q; q = q->next) {
+		if (same_command(q, t)) return q;
+	}
+	if (dev->current && same_command(dev->current, t) &&
+	    (dev->queue == NULL || dev->queue->prio == NEX_PRIO_QUERY)) return dev->current;
+	return NULL;
+}
+
+/*
+ * queue t after the transactions of its class and the classes before it.
+ * A stop does not pass a motion command queued before it, that motion
+ * would start after the stop.
+ */
+static void queue_insert(device *dev, transaction *t) {
+	transaction **tp;
+	int prio = (t->prio == NEX_PRIO_STOP) ? NEX_PRIO_MOTION : t->prio;
+
+	for (tp = &dev->queue; *tp && (*tp)->prio <= prio; tp = &(*tp)->next);
+	t->next = *tp;
+	*tp = t;
+	if (t->next == NULL) dev->queue_tail = t;
+	else LOG_DBG("Command '%c' (%s) goes ahead of '%c' on %s", t->cmd[0], nex_priority_name(t->prio),
+	             t->next->cmd[0], dev->tty_port);
+}
+
+static void enqueue(device *dev, transaction *t) {
+	transaction *l;
+
+	if (conf.cache && !nex_is_query(t->cmd, t->cmd_len)) cache_invalidate(&dev->cache);
+	t->queued = ev_now();
+	if (t->stamp[0] == 0) t->stamp[0] = ev_now_usec();
+	t->generation = dev->cache.generation;
+	t->prio = nex_priority(t->cmd, t->cmd_len);
+	if ((l = find_leader(dev, t))) {
+		t->leader = l;
+		t->next = l->waiters;
+		l->waiters = t;
+		dev->coalesced++;
+		METRIC_ADD(coalesced, 1);
+		return;
+	}
+	queue_insert(dev, t);
+	mux_kick(dev);
+}
+
+int mux_submit(device *dev, const char *cmd, int len, transaction_cb done, void *data) {
+	transaction *t;
+
+	if (dev->tty.fd < 0) return -1;
+	if (len > NEX_CMD_MAX || (t = calloc(1, sizeof(transaction))) == NULL) return -1;
+	memcpy(t->cmd, cmd, len);
+	t->cmd_len = len;
+	t->done = done;
+	t->data = data;
+	enqueue(dev, t);
+	return 0;
+}
+
+static int control_reply(session *s, const char *msg) {
+	return (session_send(s, msg, strlen(msg)) < 0) ? -1 : 1;
+}
+
+/* "!stats <cmd> queue: ... tty: ... total: ..." per command, then this client */
+static int control_stats(session *s) {
+	char line[320];
+	int i, len;
+
+	for (i = 0; i < 256; i++) {
+		len = snprintf(line, sizeof(line), "!stats %c ", i);
+		if (latency_format(line + len, sizeof(line) - len - 1, i) < 0) continue;
+		if (control_reply(s, strcat(line, "\n")) < 0) return -1;
+	}
+	len = snprintf(line, sizeof(line), "!stats client ");
+	hist_format(line + len, sizeof(line) - len - 1, &s->latency);
+	if (control_reply(s, strcat(line, "\n")) < 0) return -1;
+	return control_reply(s, "!ok\n");
+}
+
+/* handle one "!command" line, returns 0 if the line is not complete yet */
+static int session_control(session *s) {
+	char line[CONTROL_MAX + 1];
+	char *nl;
+	int len;
+
+	nl = memchr(s->in.data, '\n', s->in.len);
+	if (nl == NULL) {
+		if (s->in.len > CONTROL_MAX) {
+			LOG("Control line from %s is too long", s->addr);
+			return -1;
+		}
+		return 0;
+	}
+	len = nl - s->in.data;
+	if (len > CONTROL_MAX) len = CONTROL_MAX;
+	memcpy(line, s->in.data, len);
+	line[len] = '\0';
+	if (len && line[len - 1] == '\r') line[len - 1] = '\0';
+	buf_consume(&s->in, nl - s->in.data + 1);
+
+	LOG_DBG("Control '%s' from %s", line, s->addr);
+	if (!strcmp(line, "!subscribe")) {
+		if (!conf.poll_interval) return control_reply(s, "!error polling is disabled\n");
+		poller_subscribe(s);
+		return control_reply(s, "!ok\n");
+	}
+	if (!strcmp(line, "!stats")) return control_stats(s);
+	if (!strcmp(line, "!unsubscribe")) {
+		poller_unsubscribe(s);
+		return control_reply(s, "!ok\n");
+	}
+	return control_reply(s, "!error unknown command\n");
+}
+
+/* turn the next complete command of the session into a transaction */
+static void session_dispatch(session *s) {
+	device *dev = s->dev;
+	const cache_entry *e;
+	transaction *t;
+	int len, r;
+
+	if (s->tr) return;
+	while (1) {
+		if (s->in.len && s->in.data[0] == CONTROL_PREFIX) {
+			r = session_control(s);
+			if (r < 0) session_close(s);
+			if (r <= 0) return;
+			continue;
+		}
+		len = nex_command_len(s->in.data, s->in.len);
+		if (len == 0) return;
+		if (dev->tty.fd < 0) {
+			/* static answers like 'V' are still good, the rest fails right away */
+			if (!conf.cache || (e = cache_lookup(&dev->cache, s->in.data, len)) == NULL)
+				e = &tty_error;
+		} else if (!conf.cache || (e = cache_lookup(&dev->cache, s->in.data, len)) == NULL) {
+			break;
+		}
+		buf_consume(&s->in, len);
+		if (session_send(s, e->reply, e->len) < 0) {
+			session_close(s);
+			return;
+		}
+	}
+	t = calloc(1, sizeof(transaction));
+	if (t == NULL) {
+		session_close(s);
+		return;
+	}
+	memcpy(t->cmd, s->in.data, len);
+	t->cmd_len = len;
+	t->s = s;
+	t->stamp[0] = ev_now_usec();
+	buf_consume(&s->in, len);
+
+	s->tr = t;
+	enqueue(dev, t);
+}
+
+void mux_session_input(session *s, const char *data, size_t len) {
+	if (buf_append(&s->in, data, len) < 0) {
+		session_close(s);
+		return;
+	}
+	session_dispatch(s);
+}
+
+void mux_session_closed(session *s) {
+	device *dev = s->dev;
+	transaction **tp, *prev = NULL;
+	transaction *t = s->tr;
+
+	s->tr = NULL;
+	if (t == NULL) return;
+	if (t == dev->current || t->leader || t->waiters) {
+		t->s = NULL; /* let it finish, the reply is dropped */
+		return;
+	}
+	for (tp = &dev->queue; *tp; prev = *tp, tp = &(*tp)->next) {
+		if (*tp == t) {
+			*tp = t->next;
+			if (dev->queue_tail == t) dev->queue_tail = prev;
+			break;
+		}
+	}
+	free(t);
+}
+
+void mux_tty_input(device *dev, const char *data, size_t len) {
+	transaction *t;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		t = dev->current;
+		if (t == NULL) {
+			LOG_DBG("Dropped %d bytes from %s, no transaction is running", (int)(len - i), dev->tty_port);
+			return;
+		}
+		if (t->reply_len < NEX_REPLY_MAX) t->reply[t->reply_len++] = data[i];
+		if (nex_reply_complete(t->cmd, t->cmd_len, t->reply, t->reply_len)) transaction_done(dev);
+	}
+}
+
+static void transaction_fail(device *dev, transaction *t) {
+	session *s;
+
+	t->reply_len = 0;
+	if (t->done) {
+		t->done(dev, t);
+	} else if ((s = t->s)) {
+		s->tr = NULL;
+		if (session_send(s, TTY_ERROR_REPLY, strlen(TTY_ERROR_REPLY)) < 0) session_close(s);
+		else session_dispatch(s);
+	}
+	free(t);
+}
+
+void mux_fail(device *dev) {
+	transaction *t, *w, *failed;
+
+	ev_timer_cancel(&dev->tr_timer);
+	ev_timer_cancel(&dev->pace_timer);
+	failed = dev->current;
+	if (failed) failed->next = dev->queue;
+	else failed = dev->queue;
+	dev->current = NULL;
+	dev->queue = dev->queue_tail = NULL;
+
+	while ((t = failed)) {
+		failed = t->next;
+		while ((w = t->waiters)) {
+			t->waiters = w->next;
+			transaction_fail(dev, w);
+		}
+		transaction_fail(dev, t);
+	}
+}
+
+#endif /* HAVE_EVLOOP */
@@ -0,0 +1,54 @@
+#ifndef __MUX_H__
+#define __MUX_H__
+
+#include <stdint.h>
+
+#include "engine.h"
+#include "nexstar.h"
+
+/*
+ * Serial port multiplexer: client bytes are cut into NexStar commands and
+ * every command runs as one request/response transaction on the tty, the
+ * reply goes back only to the session which asked. A session has at most
+ * one transaction outstanding, so its commands keep their order. Stops and
+ * motion commands go to the tty before queued configuration commands and
+ * those before queued queries, in arrival order within the class. A query
+ * identical to one queued or on the wire waits for that reply instead of
+ * going to the tty again.
+ */
+typedef void (*transaction_cb)(device *dev, transaction *t);
+
+struct transaction {
+	session *s;             /* NULL if the session went away */
+	transaction_cb done;    /* internal transactions get the reply here */
+	void *data;
+	char cmd[NEX_CMD_MAX];
+	int cmd_len;
+	char reply[NEX_REPLY_MAX];
+	int reply_len;
+	int prio;               /* NEX_PRIO_* scheduling class */
+	uint64_t queued;        /* msec */
+	latency_stamp stamp;    /* arrived, written to the tty, reply complete (usec) */
+	unsigned generation;    /* cache generation when queued */
+	transaction *leader;    /* the identical query this one waits for */
+	transaction *waiters;   /* get a copy of the reply, linked by next */
+	transaction *next;
+};
+
+#define CONTROL_PREFIX '!'  /* "!command\n" lines are for the bridge, not the mount */
+#define CONTROL_MAX 128
+
+void mux_session_input(session *s, const char *data, size_t len);
+/* queue a transaction on behalf of the bridge itself, -1 if the tty is not available */
+int mux_submit(device *dev, const char *cmd, int len, transaction_cb done, void *data);
+void mux_session_closed(session *s);
+void mux_tty_input(device *dev, const char *data, size_t len);
+/* the tty is gone, answer everything in flight or queued with TTY_ERROR_REPLY */
+void mux_fail(device *dev);
+
+/* what the hand controller answers to a command it can not run, clients
+   which read replies by length do not lose their place */
+#define TTY_ERROR_REPLY "#"
+
+
+#endif /*__MUX_H__*/
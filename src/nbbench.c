@@ -0,0 +1,751 @@
+/**************************************************************
+    nbbench - nexbridge benchmarks, runs nexbridge against a
+    pty backed mount stand-in and measures it from outside
+
+    (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <termios.h>
+#include "config.h"
+#include "relay.h"
+
+#define NAME_SIZZ 1024
+#define ARGS_MAX 32
+
+typedef struct {
+	char nexbridge[NAME_SIZZ];
+	char nexsim[NAME_SIZZ];
+	char ttynet[NAME_SIZZ];
+	char bridge_args[NAME_SIZZ];  /* extra nexbridge options, space separated */
+	char sim_args[NAME_SIZZ];     /* extra nexsim options */
+	int port;
+	int count;
+	int conns;
+	int engine;
+	int megabytes;
+	int use_pty;
+	int duration;
+	int chain_ttynet;
+} config;
+config conf;
+
+static uint64_t now_usec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/* value at percentile p (0-100) of a sorted array */
+static uint64_t percentile(uint64_t *v, int n, double p) {
+	int i = (int)(p / 100.0 * (n - 1) + 0.5);
+	return v[i];
+}
+
+/* pty master side of the stand-in mount: answers 'V' with version 4.10 */
+static void *mount_thread(void *arg) {
+	int fd = *(int *)arg;
+	char buf[256];
+	int r, i;
+
+	while ((r = read(fd, buf, sizeof(buf))) != 0) {
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EIO) { usleep(1000); continue; } /* no slave open */
+			break;
+		}
+		for (i = 0; i < r; i++) {
+			if (buf[i] == 'V') write(fd, "\x04\x0a#", 3);
+		}
+	}
+	return NULL;
+}
+
+static int open_mount(char *slave_name, int size, pthread_t *tid, int *master) {
+	char *pname;
+
+	*master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (*master < 0) return -1;
+	if (grantpt(*master) < 0 || unlockpt(*master) < 0 || (pname = ptsname(*master)) == NULL) {
+		close(*master);
+		return -1;
+	}
+	snprintf(slave_name, size, "%s", pname);
+	/* keep the slave open, so the master never sees a hangup between sessions */
+	if (open(slave_name, O_RDWR | O_NOCTTY) < 0) return -1;
+	return pthread_create(tid, NULL, mount_thread, master);
+}
+
+/* fork and exec argv[0] with stdout and stderr on /dev/null, extra is split at spaces */
+static pid_t spawn(char **argv, int argc, const char *extra) {
+	char buf[NAME_SIZZ], *tok, *save = NULL;
+	pid_t pid;
+	int fd;
+
+	snprintf(buf, sizeof(buf), "%s", extra);
+	for (tok = strtok_r(buf, " ", &save); tok && argc < ARGS_MAX - 1; tok = strtok_r(NULL, " ", &save))
+		argv[argc++] = tok;
+	argv[argc] = NULL;
+	pid = fork();
+	if (pid == 0) {
+		fd = open("/dev/null", O_WRONLY);
+		if (fd >= 0) {
+			dup2(fd, 1);
+			dup2(fd, 2);
+		}
+		execv(argv[0], argv);
+		_exit(127);
+	}
+	return pid;
+}
+
+static pid_t start_nexbridge(const char *tty) {
+	char port[16];
+	char *argv[ARGS_MAX];
+	int argc = 0;
+
+	snprintf(port, sizeof(port), "%d", conf.port);
+	argv[argc++] = conf.nexbridge;
+	argv[argc++] = "-n";
+	if (conf.engine) argv[argc++] = "-e";
+	argv[argc++] = "-m";
+	argv[argc++] = "1000";
+	argv[argc++] = "-P";
+	argv[argc++] = (char *)tty;
+	argv[argc++] = "-p";
+	argv[argc++] = port;
+	return spawn(argv, argc, conf.bridge_args);
+}
+
+/* -x, -C and -S imply the engine in nexbridge */
+static int engine_args() {
+	char buf[NAME_SIZZ], *tok, *save = NULL;
+
+	if (conf.engine) return 1;
+	snprintf(buf, sizeof(buf), "%s", conf.bridge_args);
+	for (tok = strtok_r(buf, " ", &save); tok; tok = strtok_r(NULL, " ", &save)) {
+		if (tok[0] == '-' && strpbrk(tok + 1, "exCS")) return 1;
+	}
+	return 0;
+}
+
+/* wait up to 5s for path to appear, nexsim and ttynet create their links late */
+static int wait_path(const char *path) {
+	int i;
+
+	for (i = 0; i < 250; i++) {
+		if (access(path, F_OK) == 0) return 0;
+		usleep(20000);
+	}
+	return -1;
+}
+
+static int tcp_connect(int port) {
+	struct sockaddr_in sin;
+	struct timeval tv = { 2, 0 };
+	int sock;
+
+	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) return -1;
+	/* in the fork model a lingering child may eat the reply, do not hang on it */
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(sock, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/* send cmd and read until the '#' terminator */
+static int transaction(int sock, const char *cmd, int len) {
+	char c;
+	int r;
+
+	if (write(sock, cmd, len) != len) return -1;
+	do {
+		r = read(sock, &c, 1);
+		if (r <= 0) return -1;
+	} while (c != '#');
+	return 0;
+}
+
+static int wait_ready() {
+	int i, sock;
+
+	for (i = 0; i < 250; i++) {
+		if ((sock = tcp_connect(conf.port)) >= 0) {
+			close(sock);
+			return 0;
+		}
+		usleep(20000);
+	}
+	return -1;
+}
+
+static long proc_rss_kb(pid_t pid) {
+	char path[64], line[256];
+	long kb = 0;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	if ((f = fopen(path, "r")) == NULL) return 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "VmRSS: %ld", &kb) == 1) break;
+	}
+	fclose(f);
+	return kb;
+}
+
+static pid_t proc_ppid(pid_t pid) {
+	char path[64];
+	int ppid = 0;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	if ((f = fopen(path, "r")) == NULL) return 0;
+	if (fscanf(f, "%*d %*s %*c %d", &ppid) != 1) ppid = 0;
+	fclose(f);
+	return ppid;
+}
+
+/* RSS of a process and all of its children in KB */
+static long tree_rss_kb(pid_t pid, int *procs) {
+	struct dirent *de;
+	long kb = proc_rss_kb(pid);
+	pid_t p;
+	DIR *d;
+
+	*procs = 1;
+	if ((d = opendir("/proc")) == NULL) return kb;
+	while ((de = readdir(d))) {
+		p = atoi(de->d_name);
+		if (p > 0 && proc_ppid(p) == pid) {
+			kb += proc_rss_kb(p);
+			(*procs)++;
+		}
+	}
+	closedir(d);
+	return kb;
+}
+
+/* user + system CPU time of a process and its reaped children in msec */
+static double proc_cpu_ms(pid_t pid) {
+	unsigned long long ut, st, cut, cst;
+	char path[64];
+	FILE *f;
+	int r;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	if ((f = fopen(path, "r")) == NULL) return 0;
+	r = fscanf(f, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %llu %llu",
+	           &ut, &st, &cut, &cst);
+	fclose(f);
+	if (r != 4) return 0;
+	return (ut + st + cut + cst) * 1000.0 / sysconf(_SC_CLK_TCK);
+}
+
+static int bench_connect(pid_t pid) {
+	uint64_t *lat, t0, sum = 0;
+	int *socks;
+	int i, n = 0, procs;
+	long rss;
+
+	lat = calloc(conf.count, sizeof(uint64_t));
+	socks = calloc(conf.conns, sizeof(int));
+	if (lat == NULL || socks == NULL) return -1;
+
+	/* accept-to-first-byte: connect, one 'V' round trip, disconnect */
+	for (i = 0; i < conf.count; i++) {
+		t0 = now_usec();
+		socks[0] = tcp_connect(conf.port);
+		if (socks[0] < 0) continue;
+		if (transaction(socks[0], "V", 1) == 0) {
+			lat[n] = now_usec() - t0;
+			sum += lat[n++];
+		}
+		close(socks[0]);
+	}
+	if (n == 0) {
+		printf("error=no successful connections\n");
+		return -1;
+	}
+	qsort(lat, n, sizeof(uint64_t), cmp_u64);
+
+	/* memory with conns sessions open at the same time */
+	for (i = 0; i < conf.conns; i++) {
+		socks[i] = tcp_connect(conf.port);
+		if (socks[i] >= 0) transaction(socks[i], "V", 1);
+	}
+	usleep(100000);
+	rss = tree_rss_kb(pid, &procs);
+	for (i = 0; i < conf.conns; i++) {
+		if (socks[i] >= 0) close(socks[i]);
+	}
+
+	printf("model=%s\n", conf.engine ? "engine" : "fork");
+	printf("connects=%d\n", n);
+	printf("failed=%d\n", conf.count - n);
+	printf("latency_us_min=%llu\n", (unsigned long long)lat[0]);
+	printf("latency_us_avg=%llu\n", (unsigned long long)(sum / n));
+	printf("latency_us_p50=%llu\n", (unsigned long long)percentile(lat, n, 50));
+	printf("latency_us_p99=%llu\n", (unsigned long long)percentile(lat, n, 99));
+	printf("latency_us_max=%llu\n", (unsigned long long)lat[n - 1]);
+	printf("sessions=%d\n", conf.conns);
+	printf("processes=%d\n", procs);
+	printf("rss_kb=%ld\n", rss);
+	free(lat);
+	free(socks);
+	return 0;
+}
+
+/* what a guiding / planetarium client sends, weights out of 100 */
+static const struct {
+	const char *cmd;
+	int len;
+	int weight;
+} load_mix[] = {
+	{ "e", 1, 60 },                                   /* precise RA/Dec polling */
+	{ "z", 1, 10 },                                   /* precise Azm/Alt */
+	{ "L", 1, 10 },                                   /* goto in progress? */
+	{ "t", 1, 5 },                                    /* tracking mode */
+	{ "P\x02\x10\x24\x02\x00\x00\x00", 8, 5 },       /* slew azimuth at rate 2 */
+	{ "P\x02\x10\x24\x00\x00\x00\x00", 8, 5 },       /* stop the slew */
+	{ "r34AB0500,12CE0500", 18, 3 },                  /* goto */
+	{ "M", 1, 2 },                                    /* cancel goto */
+	{ NULL, 0, 0 }
+};
+
+typedef struct {
+	int fd;
+	uint64_t *lat;
+	int n, size;
+	int errors;
+	unsigned seed;
+	uint64_t until;
+} load_arg;
+
+static void *load_client(void *arg) {
+	load_arg *a = arg;
+	uint64_t t0, *p;
+	int i, w;
+
+	while (now_usec() < a->until) {
+		w = rand_r(&a->seed) % 100;
+		for (i = 0; load_mix[i + 1].cmd && w >= load_mix[i].weight; i++) w -= load_mix[i].weight;
+		t0 = now_usec();
+		if (transaction(a->fd, load_mix[i].cmd, load_mix[i].len) < 0) {
+			if (++a->errors > 10) break;
+			continue;
+		}
+		if (a->n == a->size) {
+			a->size = a->size ? a->size * 2 : 4096;
+			if ((p = realloc(a->lat, a->size * sizeof(uint64_t))) == NULL) break;
+			a->lat = p;
+		}
+		a->lat[a->n++] = now_usec() - t0;
+	}
+	return NULL;
+}
+
+/* a client through ttynet sees a tty, make it raw with a 2s read timeout */
+static int open_client_tty(const char *path) {
+	struct termios raw;
+	int fd;
+
+	if ((fd = open(path, O_RDWR | O_NOCTTY)) < 0) return -1;
+	tcgetattr(fd, &raw);
+	cfmakeraw(&raw);
+	raw.c_cc[VMIN] = 0;
+	raw.c_cc[VTIME] = 20;
+	tcsetattr(fd, TCSANOW, &raw);
+	return fd;
+}
+
+static void print_component(const char *name, pid_t pid) {
+	int procs;
+
+	printf("%s_cpu_ms=%.0f\n", name, proc_cpu_ms(pid));
+	printf("%s_rss_kb=%ld\n", name, tree_rss_kb(pid, &procs));
+	printf("%s_processes=%d\n", name, procs);
+}
+
+/*
+ * conns clients run load_mix for conf.duration seconds against nexbridge on
+ * a nexsim mount, with -y the (single) client talks through ttynet
+ */
+static int bench_load(pid_t bridge, pid_t sim, pid_t net, const char *net_tty) {
+	load_arg *args;
+	pthread_t *tids;
+	uint64_t *lat, t0, t1;
+	double cpu0[3], cpu1[3];
+	int i, n = 0, errors = 0, clients = net ? 1 : conf.conns;
+	pid_t pids[3] = { bridge, sim, net };
+
+	args = calloc(clients, sizeof(load_arg));
+	tids = calloc(clients, sizeof(pthread_t));
+	if (args == NULL || tids == NULL) return -1;
+	for (i = 0; i < 3; i++) cpu0[i] = pids[i] ? proc_cpu_ms(pids[i]) : 0;
+
+	t0 = now_usec();
+	for (i = 0; i < clients; i++) {
+		args[i].fd = net ? open_client_tty(net_tty) : tcp_connect(conf.port);
+		args[i].seed = i + 1;
+		args[i].until = t0 + conf.duration * 1000000ULL;
+		if (args[i].fd < 0 || pthread_create(&tids[i], NULL, load_client, &args[i]) != 0) {
+			printf("error=can not start client %d\n", i);
+			return -1;
+		}
+	}
+	for (i = 0; i < clients; i++) {
+		pthread_join(tids[i], NULL);
+		n += args[i].n;
+		errors += args[i].errors;
+	}
+	t1 = now_usec();
+	for (i = 0; i < 3; i++) cpu1[i] = pids[i] ? proc_cpu_ms(pids[i]) : 0;
+
+	if ((lat = calloc(n ? n : 1, sizeof(uint64_t))) == NULL) return -1;
+	for (n = 0, i = 0; i < clients; i++) {
+		memcpy(lat + n, args[i].lat, args[i].n * sizeof(uint64_t));
+		n += args[i].n;
+	}
+	if (n == 0) {
+		printf("error=no successful commands\n");
+		return -1;
+	}
+	qsort(lat, n, sizeof(uint64_t), cmp_u64);
+
+	printf("model=%s%s\n", engine_args() ? "engine" : "fork", net ? "+ttynet" : "");
+	printf("bridge_args=%s\n", conf.bridge_args);
+	printf("clients=%d\n", clients);
+	printf("seconds=%.3f\n", (t1 - t0) / 1e6);
+	printf("commands=%d\n", n);
+	printf("errors=%d\n", errors);
+	printf("commands_per_s=%.1f\n", n / ((t1 - t0) / 1e6));
+	printf("latency_us_p50=%llu\n", (unsigned long long)percentile(lat, n, 50));
+	printf("latency_us_p99=%llu\n", (unsigned long long)percentile(lat, n, 99));
+	printf("latency_us_p999=%llu\n", (unsigned long long)percentile(lat, n, 99.9));
+	printf("latency_us_max=%llu\n", (unsigned long long)lat[n - 1]);
+	print_component("nexbridge", bridge);
+	printf("nexbridge_cpu_ms_load=%.0f\n", cpu1[0] - cpu0[0]);
+	print_component("nexsim", sim);
+	printf("nexsim_cpu_ms_load=%.0f\n", cpu1[1] - cpu0[1]);
+	if (net) {
+		print_component("ttynet", net);
+		printf("ttynet_cpu_ms_load=%.0f\n", cpu1[2] - cpu0[2]);
+	}
+
+	for (i = 0; i < clients; i++) {
+		close(args[i].fd);
+		free(args[i].lat);
+	}
+	free(lat);
+	free(args);
+	free(tids);
+	return 0;
+}
+
+static int run_load() {
+	char sim_tty[NAME_SIZZ], net_tty[NAME_SIZZ], port[16];
+	char *argv[ARGS_MAX];
+	pid_t bridge = 0, sim, net = 0;
+	int res = -1;
+
+	snprintf(sim_tty, sizeof(sim_tty), "/tmp/nbbench-sim.%d", getpid());
+	snprintf(net_tty, sizeof(net_tty), "/tmp/nbbench-net.%d", getpid());
+	argv[0] = conf.nexsim;
+	argv[1] = "-T";
+	argv[2] = sim_tty;
+	sim = spawn(argv, 3, conf.sim_args);
+	if (sim < 0 || wait_path(sim_tty) < 0) {
+		printf("Can not start %s.\n", conf.nexsim);
+		goto out;
+	}
+	bridge = start_nexbridge(sim_tty);
+	if (bridge < 0 || wait_ready() < 0 || waitpid(bridge, NULL, WNOHANG) != 0) {
+		printf("Can not start %s.\n", conf.nexbridge);
+		goto out;
+	}
+	if (conf.chain_ttynet) {
+		snprintf(port, sizeof(port), "%d", conf.port);
+		argv[0] = conf.ttynet;
+		argv[1] = "-a";
+		argv[2] = "127.0.0.1";
+		argv[3] = "-p";
+		argv[4] = port;
+		argv[5] = "-T";
+		argv[6] = net_tty;
+		net = spawn(argv, 7, "");
+		if (net < 0 || wait_path(net_tty) < 0) {
+			printf("Can not start %s.\n", conf.ttynet);
+			goto out;
+		}
+	}
+	res = bench_load(bridge, sim, net, net_tty);
+out:
+	if (net > 0) kill(net, SIGTERM);
+	if (bridge > 0) kill(bridge, SIGTERM);
+	if (sim > 0) kill(sim, SIGTERM);
+	while (wait(NULL) > 0);
+	return res;
+}
+
+typedef struct {
+	int fd;
+	long long total;
+} pump_arg;
+
+static void *producer_thread(void *arg) {
+	pump_arg *p = arg;
+	static char buf[65536];
+	long long left = p->total;
+	int r;
+
+	memset(buf, 'e', sizeof(buf));
+	while (left > 0) {
+		r = write(p->fd, buf, (left < (long long)sizeof(buf)) ? left : (long long)sizeof(buf));
+		if (r <= 0) break;
+		left -= r;
+	}
+	shutdown(p->fd, SHUT_WR);
+	return NULL;
+}
+
+static double tv_ms(struct timeval *tv) {
+	return tv->tv_sec * 1000.0 + tv->tv_usec / 1000.0;
+}
+
+/*
+ * push conf.megabytes through one direction of the relay running in a child:
+ * producer -> socket (fd2) -> relay -> socket or pty (fd1) -> consumer
+ */
+static int bench_relay(int use_splice) {
+	static char buf[65536];
+	int in[2], out[2];
+	pthread_t tid;
+	pump_arg p;
+	struct rusage ru0, ru1;
+	struct termios raw;
+	uint64_t t0, t1;
+	long long got = 0;
+	int r, status;
+	char *pname;
+	pid_t pid;
+	relay_state st;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, in) < 0) return -1;
+	if (conf.use_pty) {
+		if ((out[1] = posix_openpt(O_RDWR | O_NOCTTY)) < 0) return -1;
+		if (grantpt(out[1]) < 0 || unlockpt(out[1]) < 0 || (pname = ptsname(out[1])) == NULL) return -1;
+		if ((out[0] = open(pname, O_RDWR | O_NOCTTY)) < 0) return -1;
+		tcgetattr(out[0], &raw);
+		cfmakeraw(&raw);
+		tcsetattr(out[0], TCSANOW, &raw);
+	} else if (socketpair(AF_UNIX, SOCK_STREAM, 0, out) < 0) {
+		return -1;
+	}
+
+	getrusage(RUSAGE_CHILDREN, &ru0);
+	t0 = now_usec();
+	if ((pid = fork()) == 0) {
+		close(in[0]);
+		close(out[1]);
+		memset(&st, 0, sizeof(st));
+		r = RELAY_UNSUPPORTED;
+		if (use_splice) r = relay_splice(out[0], in[1], &st);
+		if (r == RELAY_UNSUPPORTED) r = relay_copy(out[0], in[1], &st);
+		_exit(st.spliced[1] ? 10 : 0);
+	}
+	close(in[1]);
+	close(out[0]);
+
+	p.fd = in[0];
+	p.total = (long long)conf.megabytes * 1024 * 1024;
+	pthread_create(&tid, NULL, producer_thread, &p);
+	while (got < p.total && (r = read(out[1], buf, sizeof(buf))) > 0) got += r;
+	t1 = now_usec();
+	close(out[1]);
+	pthread_join(tid, NULL);
+	close(in[0]);
+	waitpid(pid, &status, 0);
+	getrusage(RUSAGE_CHILDREN, &ru1);
+
+	printf("path=%s\n", use_splice ? "splice" : "copy");
+	printf("tty_side=%s\n", conf.use_pty ? "pty" : "socket");
+	printf("spliced=%d\n", WIFEXITED(status) && WEXITSTATUS(status) == 10);
+	printf("bytes=%lld\n", got);
+	printf("seconds=%.3f\n", (t1 - t0) / 1e6);
+	printf("mb_per_s=%.1f\n", got / 1048576.0 / ((t1 - t0) / 1e6));
+	printf("cpu_user_ms=%.1f\n", tv_ms(&ru1.ru_utime) - tv_ms(&ru0.ru_utime));
+	printf("cpu_sys_ms=%.1f\n", tv_ms(&ru1.ru_stime) - tv_ms(&ru0.ru_stime));
+	return (got == p.total) ? 0 : -1;
+}
+
+void print_usage(char *name) {
+	printf( "%s version %s\n"
+		"Benchmarks nexbridge against a pty backed stand-in of the mount.\n\n", name, VERSION);
+	printf( "usage: %s [-ety] [-b nexbridge] [-A args] [-M args] [-p port] [-n count] [-c conns] [-d sec] [-s MB]\n"
+		"       connect|relay|load\n"
+		"    -b  nexbridge binary to test [default: ./bin/nexbridge]\n"
+		"    -A  extra nexbridge options, e.g. \"-x -C default\"\n"
+		"    -M  extra nexsim options, e.g. \"-d 5 -b 0\" (load)\n"
+		"    -e  run nexbridge with the event loop engine (-e)\n"
+		"    -y  talk to nexbridge through ttynet, one client (load)\n"
+		"    -d  duration of the load in seconds [default: 5]\n"
+		"    -p  TCP port to use [default: 19999]\n"
+		"    -n  number of connect/disconnect cycles [default: 200]\n"
+		"    -c  concurrent sessions for the memory measurement and clients of the\n"
+		"        load [default: 16]\n"
+		"    -s  megabytes to push through the relay [default: 256]\n"
+		"    -t  relay to a pty instead of a socket, like a real tty\n"
+		"    -h  print this help message\n\n"
+		" connect - accept-to-first-byte latency and RSS per connection model\n"
+		" relay   - throughput and CPU time of the copy and the splice relay paths\n"
+		" load    - commands/s, round-trip percentiles, CPU and RSS per component with\n"
+		"           clients polling, slewing and going to targets on a nexsim mount\n"
+		"           (nexsim and ttynet are taken from the directory of nexbridge)\n\n", name);
+}
+
+void config_defaults() {
+	strcpy(conf.nexbridge, "./bin/nexbridge");
+	conf.port = 19999;
+	conf.count = 200;
+	conf.conns = 16;
+	conf.engine = 0;
+	conf.megabytes = 256;
+	conf.use_pty = 0;
+	conf.duration = 5;
+	conf.chain_ttynet = 0;
+	conf.bridge_args[0] = '\0';
+	conf.sim_args[0] = '\0';
+}
+
+/* nexsim and ttynet are built next to nexbridge */
+static void sibling(char *path, const char *name) {
+	char *slash = strrchr(conf.nexbridge, '/');
+
+	if (slash) snprintf(path, NAME_SIZZ, "%.*s/%s", (int)(slash - conf.nexbridge), conf.nexbridge, name);
+	else snprintf(path, NAME_SIZZ, "%s", name);
+}
+
+int main(int argc, char **argv) {
+	char tty_name[NAME_SIZZ];
+	pthread_t tid;
+	pid_t pid;
+	int c, master, res;
+
+	config_defaults();
+	while((c=getopt(argc,argv,"hetyA:b:c:d:M:n:p:s:"))!=-1){
+		switch(c){
+		case 'b':
+			snprintf(conf.nexbridge, NAME_SIZZ, "%s", optarg);
+			break;
+		case 'A':
+			snprintf(conf.bridge_args, NAME_SIZZ, "%s", optarg);
+			break;
+		case 'c':
+			conf.conns = atoi(optarg);
+			break;
+		case 'd':
+			conf.duration = atoi(optarg);
+			break;
+		case 'M':
+			snprintf(conf.sim_args, NAME_SIZZ, "%s", optarg);
+			break;
+		case 'y':
+			conf.chain_ttynet = 1;
+			break;
+		case 'e':
+			conf.engine = 1;
+			break;
+		case 'n':
+			conf.count = atoi(optarg);
+			break;
+		case 'p':
+			conf.port = atoi(optarg);
+			break;
+		case 's':
+			conf.megabytes = atoi(optarg);
+			break;
+		case 't':
+			conf.use_pty = 1;
+			break;
+		case 'h':
+			print_usage(argv[0]);
+			exit(0);
+		case '?':
+		default:
+			printf("for help: %s -h\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	if ((conf.count < 1) || (conf.conns < 1) || (conf.megabytes < 1) || (conf.duration < 1)) {
+		printf("Count, connections, duration and size should be positive numbers.\n");
+		exit(1);
+	}
+	sibling(conf.nexsim, "nexsim");
+	sibling(conf.ttynet, "ttynet");
+
+	signal(SIGPIPE, SIG_IGN);
+	if ((optind < argc) && !strcmp(argv[optind], "relay")) {
+		res = bench_relay(0);
+		printf("\n");
+		res |= bench_relay(1);
+		return res ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if ((optind < argc) && !strcmp(argv[optind], "load")) {
+		return run_load() ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if ((optind >= argc) || strcmp(argv[optind], "connect")) {
+		printf("Please specify a benchmark, for help: %s -h\n", argv[0]);
+		exit(1);
+	}
+
+	if (open_mount(tty_name, NAME_SIZZ, &tid, &master) != 0) {
+		printf("Can not allocate virtual tty.\n");
+		exit(1);
+	}
+
+	pid = start_nexbridge(tty_name);
+	/* make sure we do not measure someone else listening on the port */
+	if (pid < 0 || wait_ready() < 0 || waitpid(pid, NULL, WNOHANG) != 0) {
+		printf("Can not start %s.\n", conf.nexbridge);
+		if (pid > 0) kill(pid, SIGTERM);
+		exit(1);
+	}
+
+	res = bench_connect(pid);
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	return res ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,348 @@
+/**************************************************************
+    nbreplay - plays the client side of a nexbridge session
+    capture (-w) against a tty or pty with the recorded timing
+
+    (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#define _DEFAULT_SOURCE  /* cfmakeraw(), cfsetspeed() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <termios.h>
+#include "config.h"
+#include "capture.h"
+
+typedef struct {
+	int dump;
+	double scale;       /* of the recorded timing, 0 waits for each reply instead */
+	int baudrate;
+	int wait;           /* msec for the replies after the last command */
+} config;
+config conf;
+
+typedef struct {
+	const char *map;
+	size_t size;
+	const capture_header *h;
+} capture_file;
+
+static const struct {
+	int rate;
+	speed_t speed;
+} speeds[] = {
+	{ 1200, B1200 }, { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 },
+	{ 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 },
+	{ 230400, B230400 }, { 460800, B460800 }, { 0, 0 }
+};
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/* value at percentile p (0-100) of a sorted array */
+static uint64_t percentile(uint64_t *v, int n, double p) {
+	int i;
+
+	if (n == 0) return 0;
+	i = (int)(p / 100.0 * (n - 1) + 0.5);
+	return v[i];
+}
+
+static int map_capture(const char *path, capture_file *cf) {
+	struct stat st;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) return -1;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	cf->size = st.st_size;
+	cf->map = (cf->size >= sizeof(capture_header)) ?
+		mmap(NULL, cf->size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (cf->map == MAP_FAILED) {
+		errno = EINVAL;
+		return -1;
+	}
+	cf->h = (const capture_header *)cf->map;
+	if (memcmp(cf->h->magic, CAPTURE_MAGIC, sizeof(cf->h->magic)) ||
+	    cf->h->version != CAPTURE_VERSION || cf->h->header_size > cf->size) {
+		munmap((void *)cf->map, cf->size);
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/* record at *off, its data or NULL at the end or at a truncated record */
+static const char *next_record(const capture_file *cf, size_t *off, capture_record *rec) {
+	const char *data;
+
+	if (*off + sizeof(capture_record) > cf->size) return NULL;
+	memcpy(rec, cf->map + *off, sizeof(capture_record));
+	if (rec->len > cf->size - *off - sizeof(capture_record)) return NULL;
+	data = cf->map + *off + sizeof(capture_record);
+	*off += sizeof(capture_record) + rec->len;
+	return data;
+}
+
+static int dump(const capture_file *cf) {
+	capture_record rec;
+	size_t off = cf->h->header_size;
+	const char *data;
+	int i;
+
+	printf("# peer %s tty %s started %lld\n", cf->h->peer, cf->h->tty, (long long)cf->h->start_time);
+	while ((data = next_record(cf, &off, &rec))) {
+		printf("%12.6f %c %4u ", rec.ns / 1e9, (rec.dir == CAPTURE_TO_TTY) ? '>' : '<', rec.len);
+		for (i = 0; i < rec.len; i++) {
+			if (isprint((unsigned char)data[i]) && data[i] != '\\') putchar(data[i]);
+			else printf("\\x%02x", (unsigned char)data[i]);
+		}
+		putchar('\n');
+	}
+	if (off != cf->size) printf("# truncated at %zu of %zu bytes\n", off, cf->size);
+	return 0;
+}
+
+static int open_tty(const char *path) {
+	struct termios options;
+	int fd, i;
+
+	for (i = 0; speeds[i].rate && speeds[i].rate != conf.baudrate; i++);
+	if (speeds[i].rate == 0) {
+		printf("Baudrate is not valid: %d\n", conf.baudrate);
+		errno = EINVAL;
+		return -1;
+	}
+	if ((fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0) return -1;
+	tcgetattr(fd, &options);
+	cfmakeraw(&options);
+	cfsetspeed(&options, speeds[i].speed);
+	tcsetattr(fd, TCSANOW, &options);
+	tcflush(fd, TCIOFLUSH);
+	return fd;
+}
+
+typedef struct {
+	int fd;
+	char *rx;
+	size_t rx_len, rx_size;
+	uint64_t sent_at;
+	int awaiting;       /* the last command has a recorded reply not seen yet */
+	uint64_t *lat;
+	int lat_count;
+} replay_state;
+
+static int write_all(int fd, const char *buf, int len) {
+	struct pollfd pfd = { fd, POLLOUT, 0 };
+	int r, done = 0;
+
+	while (done < len) {
+		r = write(fd, buf + done, len - done);
+		if (r < 0 && (errno == EAGAIN || errno == EINTR)) {
+			poll(&pfd, 1, 100);
+			continue;
+		}
+		if (r < 0) return -1;
+		done += r;
+	}
+	return done;
+}
+
+/* read replies until the deadline or until want bytes are in */
+static int pump(replay_state *rs, uint64_t until, size_t want) {
+	struct pollfd pfd = { rs->fd, POLLIN, 0 };
+	uint64_t now;
+	int r, msec;
+
+	while ((now = now_ns()) < until && rs->rx_len < want) {
+		msec = (until - now + 999999) / 1000000;
+		r = poll(&pfd, 1, msec);
+		if (r < 0 && errno != EINTR) return -1;
+		if (r <= 0) continue;
+		if (rs->rx_len == rs->rx_size) {
+			rs->rx_size *= 2;
+			if ((rs->rx = realloc(rs->rx, rs->rx_size)) == NULL) return -1;
+		}
+		r = read(rs->fd, rs->rx + rs->rx_len, rs->rx_size - rs->rx_len);
+		if (r < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+		if (r <= 0) return -1;
+		if (rs->awaiting) {
+			rs->lat[rs->lat_count++] = (now_ns() - rs->sent_at) / 1000;
+			rs->awaiting = 0;
+		}
+		rs->rx_len += r;
+	}
+	return 0;
+}
+
+static int replay(const capture_file *cf, const char *tty) {
+	capture_record rec, next;
+	replay_state rs;
+	size_t off = cf->h->header_size, look, expected = 0, before, matching = 0, i;
+	const char *data;
+	uint64_t *rec_lat, t0, wait_ns = (uint64_t)conf.wait * 1000000;
+	long first_mismatch = -1;
+	int commands = 0, rec_count = 0, replied, res = 0;
+	char *expected_rx;
+
+	/* the replies the session got, to compare with */
+	if ((expected_rx = malloc(cf->size)) == NULL) return -1;
+	while ((data = next_record(cf, &off, &rec))) {
+		if (rec.dir == CAPTURE_TO_CLIENT) {
+			memcpy(expected_rx + expected, data, rec.len);
+			expected += rec.len;
+		} else {
+			commands++;
+		}
+	}
+
+	memset(&rs, 0, sizeof(rs));
+	rs.rx_size = expected + 4096;
+	rs.rx = malloc(rs.rx_size);
+	rs.lat = calloc(commands + 1, sizeof(uint64_t));
+	rec_lat = calloc(commands + 1, sizeof(uint64_t));
+	if (rs.rx == NULL || rs.lat == NULL || rec_lat == NULL) return -1;
+	if ((rs.fd = open_tty(tty)) < 0) {
+		printf("Can not open %s: %s\n", tty, strerror(errno));
+		return -1;
+	}
+
+	off = cf->h->header_size;
+	before = 0;
+	t0 = now_ns();
+	while ((data = next_record(cf, &off, &rec))) {
+		if (rec.dir == CAPTURE_TO_CLIENT) {
+			before += rec.len;
+			continue;
+		}
+		/* the recorded round-trip, if a reply came before the next command */
+		look = off;
+		replied = next_record(cf, &look, &next) && next.dir == CAPTURE_TO_CLIENT;
+		if (replied) rec_lat[rec_count++] = (next.ns - rec.ns) / 1000;
+
+		if (conf.scale > 0) res = pump(&rs, t0 + (uint64_t)(rec.ns * conf.scale), (size_t)-1);
+		else res = pump(&rs, now_ns() + wait_ns, before);
+		if (res < 0 || write_all(rs.fd, data, rec.len) < 0) break;
+		rs.sent_at = now_ns();
+		rs.awaiting = replied;
+	}
+	if (data) res = -1;
+	if (res == 0) res = pump(&rs, now_ns() + wait_ns, expected);
+	if (res < 0) printf("Replay stopped: %s\n", strerror(errno));
+
+	for (i = 0; i < rs.rx_len && i < expected; i++) {
+		if (rs.rx[i] == expected_rx[i]) matching++;
+		else if (first_mismatch < 0) first_mismatch = i;
+	}
+	if (first_mismatch < 0 && rs.rx_len != expected) first_mismatch = i;
+
+	qsort(rec_lat, rec_count, sizeof(uint64_t), cmp_u64);
+	qsort(rs.lat, rs.lat_count, sizeof(uint64_t), cmp_u64);
+	printf("capture_peer=%s\n", cf->h->peer);
+	printf("capture_tty=%s\n", cf->h->tty);
+	printf("scale=%g\n", conf.scale);
+	printf("commands=%d\n", commands);
+	printf("expected_bytes=%zu\n", expected);
+	printf("received_bytes=%zu\n", rs.rx_len);
+	printf("matching_bytes=%zu\n", matching);
+	printf("first_mismatch=%ld\n", first_mismatch);
+	printf("recorded_replies=%d\n", rec_count);
+	printf("replayed_replies=%d\n", rs.lat_count);
+	printf("recorded_latency_us_p50=%llu\n", (unsigned long long)percentile(rec_lat, rec_count, 50));
+	printf("recorded_latency_us_p99=%llu\n", (unsigned long long)percentile(rec_lat, rec_count, 99));
+	printf("replayed_latency_us_p50=%llu\n", (unsigned long long)percentile(rs.lat, rs.lat_count, 50));
+	printf("replayed_latency_us_p99=%llu\n", (unsigned long long)percentile(rs.lat, rs.lat_count, 99));
+	printf("replay_s=%.3f\n", (now_ns() - t0) / 1e9);
+
+	close(rs.fd);
+	free(rs.rx);
+	free(rs.lat);
+	free(rec_lat);
+	free(expected_rx);
+	return res;
+}
+
+void print_usage(char *name) {
+	printf( "%s version %s\n"
+		"Plays the client side of a nexbridge session capture (-w) against a tty\n"
+		"or pty and compares the replies and their timing with the recording.\n\n", name, VERSION);
+	printf( "usage: %s [-d] [-x scale] [-b baudrate] [-w msec] capture [tty]\n"
+		"    -d  print the records of the capture instead, '>' to the tty, '<' to the client\n"
+		"    -x  timing scale, 0.5 plays twice as fast, 0 sends each command when the\n"
+		"        reply to the previous one is in [default: 1]\n"
+		"    -b  baudrate of the tty [default: 9600]\n"
+		"    -w  msec to wait for a reply (-x 0) and for the last replies [default: 1000]\n"
+		"    -h  print this help message\n\n", name);
+}
+
+void config_defaults() {
+	conf.dump = 0;
+	conf.scale = 1;
+	conf.baudrate = 9600;
+	conf.wait = 1000;
+}
+
+int main(int argc, char **argv) {
+	capture_file cf;
+	int c;
+
+	config_defaults();
+	while((c=getopt(argc,argv,"hdb:w:x:"))!=-1){
+		switch(c){
+		case 'd':
+			conf.dump = 1;
+			break;
+		case 'b':
+			conf.baudrate = atoi(optarg);
+			break;
+		case 'w':
+			conf.wait = atoi(optarg);
+			break;
+		case 'x':
+			conf.scale = atof(optarg);
+			break;
+		case 'h':
+			print_usage(argv[0]);
+			exit(0);
+		case '?':
+		default:
+			printf("for help: %s -h\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	if ((conf.scale < 0) || (conf.wait < 0)) {
+		printf("Scale and wait should be positive numbers.\n");
+		exit(1);
+	}
+	if ((optind >= argc) || (!conf.dump && optind + 1 >= argc)) {
+		print_usage(argv[0]);
+		exit(1);
+	}
+	if (map_capture(argv[optind], &cf) < 0) {
+		printf("Can not read capture %s: %s\n", argv[optind], strerror(errno));
+		exit(1);
+	}
+	if (conf.dump) exit(dump(&cf) < 0);
+	exit(replay(&cf, argv[optind + 1]) < 0);
+}
@@ -15,20 +15,49 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <termios.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
 
-#include "nexbridge.h"
-#include "mdns_avahi.h"
 #include "config.h"
+#ifdef HAVE_LINUX_SERIAL_H
+#include <linux/serial.h>
+#endif
 
-#define BUFSIZZ 1024
+#include "nexbridge.h"
+#include "mdns_avahi.h"
+#include "engine.h"
+#include "udp.h"
+#include "cache.h"
+#include "relay.h"
+#include "latency.h"
+#include "metrics.h"
+#include "capture.h"
+#include "options.h"
 
 volatile int conn_count=0;
 
 config conf;
 
+static volatile sig_atomic_t reload_pending = 0;
+static int reloading = 0;               /* config_error() goes to the log */
+static volatile sig_atomic_t dump_pending = 0;  /* SIGUSR1, dumped from accept_loop() */
+static volatile sig_atomic_t stop_pending = 0;  /* the signal which ends the daemon or the session */
+static bind_list binds;                 /* the -a addresses */
+static int server_socks[LISTENERS_MAX]; /* the fork model listeners, shard by shard */
+static int server_count = 0;
+static int metrics_socks[ADDRS_MAX];
+static int metrics_count = 0;
+static device *served[DEVICES_MAX];     /* engine devices, same index as conf.devices */
+/* reload_config() rewrites conf while the -A workers fork children from it */
+static pthread_rwlock_t conf_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+#define ATOMIC_INC_FETCH(i) __sync_add_and_fetch(i,1)
 #define ATOMIC_INC(i) ((void)__sync_add_and_fetch(i,1))
 #define ATOMIC_DEC(i) ((void)__sync_sub_and_fetch(i,1))
 
@@ -79,6 +108,15 @@ inline int map_str_baudrate(const char *baudrate) {
 	return brp->value;
 }
 
+int map_speed_baudrate(int speed) {
+	sbaud_rate *brp;
+
+	for (brp = br; brp->str[0] != '\0'; brp++) {
+		if (brp->value == speed) return atoi(brp->str);
+	}
+	return 0;
+}
+
 /* get sockaddr, IPv4 or IPv6: */
 void *get_in_addr(struct sockaddr *sa) {
 	if (sa->sa_family == AF_INET) {
@@ -87,32 +125,35 @@ void *get_in_addr(struct sockaddr *sa) {
 	return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
+/* IPv4 clients of a dual-stack listener come as ::ffff:a.b.c.d, print a.b.c.d */
+void addr_str(struct sockaddr *sa, char *buf, size_t size) {
+	struct in6_addr *a6 = &((struct sockaddr_in6 *)sa)->sin6_addr;
+
+	if (sa->sa_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(a6)) {
+		inet_ntop(AF_INET, &a6->s6_addr[12], buf, size);
+		return;
+	}
+	inet_ntop(sa->sa_family, get_in_addr(sa), buf, size);
+}
+
+/* the handlers only set flags, LOG and exit() are not async-signal-safe */
 void sig_handler(int sig) {
-	pid_t pgrp;
+	int leader = (getpgrp() == getpid());
 
-	#ifdef SIG_DEBUG
-	LOG_DBG("SIG: pid=%d, signal=%d", getpid(), sig);
-	#endif
 	switch (sig) {
 	case SIGHUP:
+		if (leader) reload_pending = 1;
 		break;
 	case SIGPIPE:
 		break;
+	case SIGUSR1:
+		if (leader) dump_pending = 1;
+		break;
 	case SIGTERM:
 	case SIGINT:
 	case SIGQUIT:
-		pgrp = getpgrp();
-		if (pgrp==getpid()) {
-			LOG("Daemon dieing with signal=%d", sig);
-			if (conf.svc_name[0]) mdns_stop();
-			killpg(pgrp,SIGINT);
-			exit(0);
-		} else {
-			#ifdef SIG_DEBUG
-			LOG_DBG("Signal %d caught by child", sig);
-			#endif
-			_exit(0);
-		}
+		/* the daemon leaves from accept_loop(), a session from its relay */
+		stop_pending = sig;
 		break;
 	case SIGCHLD:
 		while(waitpid(-1, NULL, WNOHANG) > 0) {
@@ -123,100 +164,61 @@ void sig_handler(int sig) {
 }
 
 void session_timeout(int sig) {
-	LOG("Session timed out");
-	_exit(0);
+	stop_pending = sig;
 }
 
-int configure_tty_options(struct termios *options, const char *baudrate, const char *mode) {
-	int cbits=CS8, cpar=0, ipar=IGNPAR, bstop=0;
-	int baudr=0;
-
-	baudr = map_str_baudrate(baudrate);
-	if (baudr == -1) {
-		printf("Baudrate is not valid: %s\n", baudrate);
-		return -1;
-	}
-
-	if(strlen(mode) != 3) {
-		printf("Invalid data frmat \"%s\"\n", mode);
-		return -1;
-	}
-
-	switch(mode[0]) {
-		case '8': cbits = CS8; break;
-		case '7': cbits = CS7; break;
-		case '6': cbits = CS6; break;
-		case '5': cbits = CS5; break;
-		default :
-			printf("Invalid number of data bits '%c'\n", mode[0]);
-			return -1;
-			break;
-	}
-
-	switch(mode[1]) {
-		case 'N':
-		case 'n':
-			cpar = 0;
-			ipar = IGNPAR;
-			break;
-		case 'E':
-		case 'e':
-			cpar = PARENB;
-			ipar = INPCK;
-			break;
-		case 'O':
-		case 'o':
-			cpar = (PARENB | PARODD);
-			ipar = INPCK;
-			break;
-		default :
-			printf("Invalid parity '%c'\n", mode[1]);
-			return -1;
-            break;
-	}
-
-	switch(mode[2]) {
-		case '1': bstop = 0; break;
-		case '2': bstop = CSTOPB; break;
-		default :
-			printf("Invalid number of stop bits '%c'\n", mode[2]);
-			return -1;
-			break;
-	}
-
-	memset(options, 0, sizeof(*options));  /* clear options struct */
+/* SIGTERM, SIGINT or SIGQUIT to the daemon, the sessions get SIGINT */
+void daemon_exit(int sig) {
+	LOG("Daemon dieing with signal=%d", sig);
+	if (conf.svc_name[0] || conf.device_count) mdns_stop();
+	killpg(getpgrp(), SIGINT);
+	exit(0);
+}
 
-	options->c_cflag = cbits | cpar | bstop | CLOCAL | CREAD;
-	options->c_iflag = ipar;
-	options->c_oflag = 0;
-	options->c_lflag = 0;
-	options->c_cc[VMIN] = 0;       /* block untill n bytes are received */
-	options->c_cc[VTIME] = 50;     /* block untill a timer expires (n * 100 mSec.) */
+void config_error(const char *fmt, ...) {
+	char text[LOG_RECORD_SIZE];
+	va_list ap;
 
-	cfsetispeed(options, baudr);
-	cfsetospeed(options, baudr);
+	va_start(ap, fmt);
+	vsnprintf(text, sizeof(text), fmt, ap);
+	va_end(ap);
+	if (reloading) LOG("%s", text);
+	else printf("%s\n", text);
+}
 
-	return 0;
+/* FTDI style adapters batch replies for latency_timer msec (16 by default) */
+static int set_latency_timer(const char *tty_name, int msec) {
+	char real[PATH_MAX], path[PATH_MAX + 64];
+	char *name;
+	FILE *f;
+
+	if (realpath(tty_name, real) == NULL) return -1;
+	name = strrchr(real, '/');
+	snprintf(path, sizeof(path), "/sys/class/tty/%s/device/latency_timer", name ? name + 1 : real);
+	if ((f = fopen(path, "w")) == NULL) return -1;
+	fprintf(f, "%d\n", msec);
+	return fclose(f);
 }
 
-void config_defaults() {
-	conf.is_daemon = 1;
-	conf.server_port = PORT;
-	conf.address[0] = '\0';
-	conf.svc_name[0] = '\0';
-	sprintf(conf.svc_type, "%s.%s", SVC_TYPE, SVC_PROTO);
-	strcpy(conf.tty_port, TTY_PORT);
-	strcpy(conf.dataformat, DATA_FORMAT);
-	strcpy(conf.baudrate, BAUDRATE);
-	conf.timeout = SESS_TIMEOUT;
-	conf.max_conn = MAXCON;
-	configure_tty_options(&conf.options, conf.baudrate, conf.dataformat);
+static int set_serial_low_latency(int tty_fd, int on) {
+#if defined(TIOCGSERIAL) && defined(ASYNC_LOW_LATENCY)
+	struct serial_struct ss;
+
+	if (ioctl(tty_fd, TIOCGSERIAL, &ss) < 0) return -1;
+	if (on) ss.flags |= ASYNC_LOW_LATENCY;
+	else ss.flags &= ~ASYNC_LOW_LATENCY;
+	return ioctl(tty_fd, TIOCSSERIAL, &ss);
+#else
+	errno = ENOTSUP;
+	return -1;
+#endif
 }
 
 int open_tty(const char *tty_name, const struct termios *options, struct termios *old_options) {
 	int tty_fd;
 
-	tty_fd = open(tty_name, O_RDWR | O_NOCTTY | O_SYNC);
+	/* O_SYNC buys nothing on a tty, but some drivers wait for the UART to drain */
+	tty_fd = open(tty_name, O_RDWR | O_NOCTTY | (conf.low_latency ? 0 : O_SYNC));
 	if (tty_fd == -1) {
 		LOG("open(tty_name): %s",strerror(errno));
 		return -1;
@@ -245,9 +247,68 @@ int open_tty(const char *tty_name, const struct termios *options, struct termios
 		return -1;
 	}
 
+	if (conf.low_latency) {
+		if (set_serial_low_latency(tty_fd, 1) < 0)
+			LOG_DBG("ASYNC_LOW_LATENCY on %s: %s", tty_name, strerror(errno));
+		if (conf.latency_timer && set_latency_timer(tty_name, conf.latency_timer) < 0)
+			LOG_DBG("latency_timer of %s: %s", tty_name, strerror(errno));
+	}
+
 	return tty_fd;
 }
 
+/* median round-trip of the 'K' echo command in usec, -1 if the mount does not answer */
+static long probe_rtt(int tty_fd) {
+	struct pollfd pfd = { tty_fd, POLLIN, 0 };
+	struct timespec t0, t1;
+	long rtt[5], tmp;
+	char c;
+	int i, j, got;
+
+	tcflush(tty_fd, TCIOFLUSH);
+	for (i = 0; i < 5; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (write(tty_fd, "Kx", 2) != 2) return -1;
+		got = 0;
+		while (got < 2) {
+			if (poll(&pfd, 1, 500) <= 0) return -1;
+			if (read(tty_fd, &c, 1) == 1) got++;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		rtt[i] = (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000;
+		for (j = i; j > 0 && rtt[j - 1] > rtt[j]; j--) {
+			tmp = rtt[j]; rtt[j] = rtt[j - 1]; rtt[j - 1] = tmp;
+		}
+	}
+	return rtt[2];
+}
+
+/* measure the command round-trip with the stock and with the low latency serial setup */
+void report_low_latency() {
+	struct termios saved;
+	long before = -1, after = -1;
+	int fd;
+
+	conf.low_latency = 0;
+	if ((fd = open_tty(conf.tty_port, &conf.stock_options, &saved)) >= 0) {
+		set_serial_low_latency(fd, 0);
+		if (conf.latency_timer) set_latency_timer(conf.tty_port, 16);
+		before = probe_rtt(fd);
+		close_tty(fd, &saved);
+	}
+	conf.low_latency = 1;
+	if ((fd = open_tty(conf.tty_port, &conf.options, &saved)) >= 0) {
+		after = probe_rtt(fd);
+		close_tty(fd, &saved);
+	}
+	if (before < 0 || after < 0) {
+		LOG("Low latency: %s did not answer the echo command, round-trip not measured", conf.tty_port);
+	} else {
+		LOG("Low latency: command round-trip %ld us -> %ld us (vmin=%d vtime=%d)",
+		    before, after, conf.vmin, conf.vtime);
+	}
+}
+
 void close_tty(int tty_fd, struct termios *old_options) {
 	int status;
 
@@ -258,50 +319,57 @@ void close_tty(int tty_fd, struct termios *old_options) {
 	// flock(tty_fd, LOCK_UN); /* free the port so that others can use it. */
 }
 
-void handle_client(int fd1, int fd2) {
-	char buf[BUFSIZZ];
-	int r;
-	int max;
-	int end=0;
-	fd_set readset;
-
-	do {
-		do {
-			FD_ZERO(&readset);
-			FD_SET(fd1, &readset);
-			FD_SET(fd2, &readset);
-			max = (fd1 > fd2) ? fd1 : fd2;
-			r = select(max + 1, &readset, NULL, NULL, NULL);
-		} while (r == -1 && errno == EINTR);
-
-		if ( r<0 ) return;
-
-		if(FD_ISSET(fd1,&readset)) {
-			r = read(fd1,buf,BUFSIZZ-1);
-			if (r <= 0) {
-				if(r<0) LOG("read(fd1): %s",strerror(errno));
-				end=1; break;
-			}
-			r = write(fd2,buf,r);
-			if (r <= 0) {
-				if(r<0) LOG("write(fd2): %s",strerror(errno));
-				end=1; break;
-			}
-		}
+static void reply_done(unsigned char cmd, const uint64_t stamp[3], void *data) {
+	latency_record(data, cmd, stamp);
+}
 
-		if(FD_ISSET(fd2,&readset)) {
-			r = read(fd2,buf,BUFSIZZ-1);
-			if (r <= 0) {
-				if(r<0) LOG("read(fd2): %s",strerror(errno));
-				end=1; break;
-			}
-			r = write(fd1,buf,r);
-			if (r <= 0) {
-				if(r<0) LOG("write(fd1): %s",strerror(errno));
-				end=1; break;
-			}
-		}
-	} while (!end);
+/* -w: the capture of a fork model session, named after the peer of fd */
+static capture *open_capture(int fd) {
+	struct sockaddr_storage remote_addr;
+	socklen_t addr_size = sizeof(remote_addr);
+	char addrs[INET6_ADDRSTRLEN + 1] = "";
+	capture *cap;
+
+	if (getpeername(fd, (struct sockaddr *)&remote_addr, &addr_size) == 0) {
+		addr_str((struct sockaddr *)&remote_addr, addrs, sizeof addrs);
+	}
+	if ((cap = capture_open(conf.capture_dir, addrs, conf.tty_port)) == NULL) {
+		LOG("Can not capture the session in %s: %s", conf.capture_dir, strerror(errno));
+		return NULL;
+	}
+	LOG_DBG("Capturing to %s", capture_name(cap));
+	return cap;
+}
+
+void handle_client(int fd1, int fd2) {
+	relay_state st;
+	histogram client;
+	char line[128];
+	int r = RELAY_UNSUPPORTED;
+
+	memset(&st, 0, sizeof(st));
+	memset(&client, 0, sizeof(client));
+	st.reply_done = reply_done;
+	st.data = &client;
+	st.stop = &stop_pending;
+	if (conf.capture_dir[0]) st.cap = open_capture(fd2);
+	if (conf.framing) r = relay_framed(fd1, fd2, &st);
+	else if (conf.splice && st.cap == NULL) r = relay_splice(fd1, fd2, &st);
+	if (r == RELAY_UNSUPPORTED) r = relay_copy(fd1, fd2, &st);
+	if (r < 0 && st.error) LOG("%s: %s", st.error, strerror(errno));
+	if (st.cap && capture_close(st.cap) < 0) LOG("Capture is incomplete: %s", strerror(errno));
+	METRIC_ADD(bytes_to_client, st.bytes[0]);
+	METRIC_ADD(bytes_to_tty, st.bytes[1]);
+	if (conf.framing) {
+		LOG_DBG("Relayed %lu commands (%llu bytes) and %lu replies (%llu bytes, %lu incomplete)",
+		        st.frames[1], st.bytes[1], st.frames[0], st.bytes[0], st.partial);
+		hist_format(line, sizeof(line), &client);
+		LOG_DBG("Client latency (usec) %s", line);
+	} else {
+		LOG_DBG("Relayed %llu bytes to the client (%s), %llu bytes to the tty (%s)",
+		        st.bytes[0], st.spliced[0] ? "splice" : "copy",
+		        st.bytes[1], st.spliced[1] ? "splice" : "copy");
+	}
 }
 
 void serve_client(int socket) {
@@ -311,45 +379,92 @@ void serve_client(int socket) {
 	if ( device < 0) {
 		LOG("open_tty(): %s", strerror(errno));
 		close(socket);
+		log_flush();
 		_exit(1);
 	}
 
 	handle_client(device, socket);
 	close_tty(device, &saved_options);
 	close(socket);
+	if (stop_pending == SIGALRM) LOG("Session timed out");
 	LOG("Connection closed.");
+	log_flush();
 	_exit(0);
 }
 
-int tcp_listen(in_addr_t addr, int port) {
+/* a socket of type on entry i of the -a list and port (network order), -1 on failure */
+static int open_socket(int i, int type, int port, int reuseport) {
+	struct sockaddr_storage sa = binds.addr[i];
 	int sock;
-	struct sockaddr_in sin;
 	int val=1;
 
-	if((sock=socket(AF_INET,SOCK_STREAM,0))<0) {
+	if((sock=socket(sa.ss_family,type,0))<0) {
 		LOG("socket(): %s",strerror(errno));
-		exit(1);
+		return -1;
 	}
 
-	memset(&sin,0,sizeof(sin));
-	sin.sin_addr.s_addr = addr;
-	sin.sin_family=AF_INET;
-	sin.sin_port = port;
+	((struct sockaddr_in *)&sa)->sin_port = port;  /* sin6_port is at the same place */
 	setsockopt(sock,SOL_SOCKET,SO_REUSEADDR, &val,sizeof(val));
-
-	if(bind(sock,(struct sockaddr *)&sin, sizeof(sin))<0) {
-		LOG("bind(): %s",strerror(errno));
-		exit(1);
+	if (sa.ss_family == AF_INET6) {
+		/* "::" alone takes IPv4 too */
+		val = binds.v6only;
+		setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &val, sizeof(val));
+	}
+#ifdef SO_REUSEPORT
+	val = 1;
+	if (reuseport) setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+#endif
+
+	if(bind(sock,(struct sockaddr *)&sa, binds.len[i])<0) {
+		LOG("bind(%s): %s", (type == SOCK_DGRAM) ? "udp" : "tcp", strerror(errno));
+		close(sock);
+		return -1;
 	}
 
-	if(listen(sock,5)<0) {
+	if(type == SOCK_STREAM && listen(sock,conf.backlog)<0) {
 		LOG("listen(): %s",strerror(errno));
-		exit(1);
+		close(sock);
+		return -1;
 	}
 
 	return(sock);
 }
 
+/*
+ * listeners on every -a address, shards times with SO_REUSEPORT, shard by
+ * shard in socks. Returns how many, -1 if one of them failed.
+ */
+int open_listeners(int port, int shards, int *socks) {
+	int i, n = 0;
+
+	for (; n < shards * binds.count; n++) {
+		if ((socks[n] = open_socket(n % binds.count, SOCK_STREAM, port, shards > 1)) < 0) {
+			for (i = 0; i < n; i++) close(socks[i]);
+			return -1;
+		}
+	}
+	return n;
+}
+
+/* the datagram sockets next to the listeners of a device (-u) */
+int open_udp(int port, int *socks) {
+	int i, n = 0;
+
+	for (; n < binds.count; n++) {
+		if ((socks[n] = open_socket(n, SOCK_DGRAM, port, 0)) < 0) {
+			for (i = 0; i < n; i++) close(socks[i]);
+			return -1;
+		}
+	}
+	return n;
+}
+
+int tcp_listen(int port, int shards, int *socks) {
+	int n = open_listeners(port, shards, socks);
+	if (n < 0) exit(1);
+	return(n);
+}
+
 void daemonize() {
 	int res;
 
@@ -361,134 +476,276 @@ void daemonize() {
 	if (res>0) exit(0); /* parent exits */
 }
 
-void print_usage(char *name) {
-	printf( "Nexstar TCP to Serial Daemon version %s\n", VERSION);
-	printf( "This software is intended to be used with libnexstar and NexStarCtl\n"
-		"but it proved to be very useful for exporting all kinds of telescope\n"
-		"mounts on the network like Sky-Watcher, Meade etc. Nexbridge can be\n"
-		"used directly with software like SkySafari or through ttynet or other\n"
-		"serial port emulator with software like Stellarium, to control the\n"
-		"network exported telescopes. (see ttynet)\n\n" );
-	printf( "usage: %s [-dn] [-a address] [-p port] [-m conns] [-P ttydev] [-B baudrate] [-t timeout]\n"
-		"    -d  log debug information\n"
-		"    -n  do not daemonize, log to stderr\n"
-		"    -a  IP address to bind to [default: any]\n"
-		"    -m  maximum simultaneous connections [default: 1]\n"
-		"        Allowing More than one connection is not advisable!\n"
-		"    -p  TCP port to bind to [default: %d]\n"
-		#ifdef HAVE_MDNS
-		"    -s  Bonjour service name, if not specified no service will published\n"
-		"    -T  Bonjour service type [default: '_nexbridge'}\n"
-		#endif
-		"    -P  Serial port to connect to telescope [default: %s]\n"
-		"    -B  baudrate (1200, 2400, 4800, 460800 etc) [default: %s]\n"
-		"    -F  serial data format, databits/parity/stopbits (8N1, 7E2 etc) [default: %s]\n"
-		"    -t  session timeout in seconds (0 for no timeout) [default: %d]\n"
-		"    -v  print version\n"
-		"    -h  print this help message\n\n",
-		name, PORT, TTY_PORT, BAUDRATE, DATA_FORMAT, SESS_TIMEOUT);
-	printf( " Copyright (c)2014-2016 by Rumen Bogdanovski\n\n");
+static device *start_device(device_conf *dc) {
+	int socks[LISTENERS_MAX];
+	device *dev;
+	int i, n;
+
+	if ((n = open_listeners(htons(dc->server_port), conf.shards, socks)) < 0) return NULL;
+	if ((dev = engine_add_device(dc->tty_port, &dc->options, socks, n)) == NULL) {
+		for (i = 0; i < n; i++) close(socks[i]);
+		return NULL;
+	}
+	if (conf.udp) {
+		if ((n = open_udp(htons(dc->server_port), socks)) < 0 || udp_start(dev, socks, n) < 0) {
+			for (i = 0; i < n; i++) close(socks[i]);
+			engine_remove_device(dev);
+			return NULL;
+		}
+	}
+	LOG("Forwarding %s:%d <-> %s at %s %s", conf.address, dc->server_port, dc->tty_port,
+	    dc->baudrate, dc->dataformat);
+	return dev;
 }
 
+/* replace the published services with the named devices */
+static void publish_devices() {
+	device_conf *dc;
+	int i;
+
+	mdns_clear();
+	for (i = 0; i < conf.device_count; i++) {
+		dc = &conf.devices[i];
+		if (dc->svc_name[0] == '\0' || served[i] == NULL) continue;
+		if (mdns_add(dc->svc_name, conf.svc_type, dc->tty_port, dc->server_port) < 0) {
+			LOG("Can not publish %s, too many services", dc->svc_name);
+		}
+	}
+	mdns_update();
+}
 
-int main(int argc, char **argv) {
-	int sock,s;
-	int c;
-	int baud;
-	pid_t pid, pgrp;
-	struct sockaddr_storage remote_addr;
-	socklen_t addr_size;
-	struct sigaction sa;
-	char addrs[INET6_ADDRSTRLEN + 1]; // for zero termination
-	in_addr_t addr;
+/* all devices from one event loop and one mDNS client, does not return */
+void serve_devices() {
+	int i;
 
-	config_defaults();
-	setlogmask(LOG_UPTO (LOG_INFO));
-	while((c=getopt(argc, argv, "dhnva:B:F:m:p:P:s:T:t:"))!=-1){
-		switch(c){
-		case 'B':
-			snprintf(conf.baudrate,15,"%s", optarg);
-			LOG_DBG("baudrate = %s", conf.baudrate);
-			break;
-		case 'F':
-			snprintf(conf.dataformat,15,"%s", optarg);
-			LOG_DBG("dataformat = %s", conf.dataformat);
-			break;
-		case 'a':
-			snprintf(conf.address,255,"%s", optarg);
-			LOG_DBG("address = %s", conf.address);
-			break;
-		case 'p':
-			conf.server_port = atoi(optarg);
-			LOG_DBG("server_port = %d", conf.server_port);
-			break;
-		case 'P':
-			snprintf(conf.tty_port,255,"%s", optarg);
-			LOG_DBG("tty_port = %s", conf.tty_port);
-			break;
-		case 's':
-			snprintf(conf.svc_name,255,"%s", optarg);
-			LOG_DBG("svc_name = %s", conf.svc_name);
-			break;
-		case 'T':
-			if (optarg[0] == '_')  // service type should start with '_' if not given add it
-				snprintf(conf.svc_type,255,"%s.%s", optarg,SVC_PROTO);
-			else
-				snprintf(conf.svc_type,255,"_%s.%s", optarg,SVC_PROTO);
-			LOG_DBG("svc_type = %s", conf.svc_type);
-			break;
-		case 't':
-			conf.timeout = atoi(optarg);
-			LOG_DBG("timeout = %d", conf.timeout);
-			break;
-		case 'm':
-			conf.max_conn = atoi(optarg);
-			LOG_DBG("max_conn = %d", conf.max_conn);
-			break;
-		case 'd':
-			setlogmask(LOG_UPTO (LOG_DEBUG));
-			break;
-		case 'n':
-			conf.is_daemon=0;
-			break;
-		case 'h':
-			print_usage(argv[0]);
-			exit(1);
-		case 'v':
-			printf("%s version %s\n", argv[0], VERSION);
-			exit(1);
-		case '?':
-		default:
-			printf("for help: %s -h\n", argv[0]);
-			exit(1);
-		}
+	if (engine_init() < 0) exit(1);
+	for (i = 0; i < conf.device_count; i++) {
+		if ((served[i] = start_device(&conf.devices[i])) == NULL) exit(1);
 	}
+	publish_devices();
+	exit(engine_run() < 0);
+}
 
-	if (((addr = inet_addr(conf.address)) == -1) && (conf.address[0]!='\0')) {
-		printf("Bad address: %s\n", conf.address);
-		exit(1);
-	} else if(conf.address[0]=='\0') {
-		addr = INADDR_ANY;
+static int same_device(const device_conf *a, const device_conf *b) {
+	return !strcmp(a->tty_port, b->tty_port) && a->server_port == b->server_port &&
+	       !memcmp(&a->options, &b->options, sizeof(struct termios));
+}
+
+/* stop the devices which are gone or changed, the others keep their sessions */
+static void reload_devices(const config *old) {
+	device *kept[DEVICES_MAX] = { NULL };
+	int i, j;
+
+	for (i = 0; i < old->device_count; i++) {
+		if (served[i] == NULL) continue;
+		for (j = 0; j < conf.device_count; j++) {
+			if (kept[j] == NULL && same_device(&old->devices[i], &conf.devices[j])) break;
+		}
+		if (j < conf.device_count) kept[j] = served[i];
+		else engine_remove_device(served[i]);
+	}
+	for (j = 0; j < conf.device_count; j++) {
+		if (kept[j]) {
+			/* listen() again only changes the backlog */
+			for (i = 0; conf.backlog != old->backlog && i < kept[j]->listener_count; i++)
+				listen(kept[j]->listeners[i].fd, conf.backlog);
+		} else if ((kept[j] = start_device(&conf.devices[j])) == NULL) {
+			LOG("Can not serve %s on port %d", conf.devices[j].tty_port, conf.devices[j].server_port);
+		}
 	}
+	memcpy(served, kept, sizeof(served));
+	publish_devices();
+}
 
-	if (conf.max_conn < 1) {
-		printf("Number of connections should be a positive number.\n");
-		exit(1);
+/* the fork model listeners, new sessions pick up the rest from conf */
+static void reload_listener(const config *old) {
+	int socks[LISTENERS_MAX];
+	int i, n;
+
+	if (conf.server_port != old->server_port && conf.shards > 1) {
+		/* the accept workers poll the old listeners */
+		LOG("Changing port needs a restart with accept_workers");
+		conf.server_port = old->server_port;
+	}
+	if (conf.server_port != old->server_port) {
+		if ((n = open_listeners(htons(conf.server_port), 1, socks)) < 0) {
+			LOG("Keeping port %d", old->server_port);
+			conf.server_port = old->server_port;
+		} else {
+			for (i = 0; i < server_count; i++) close(server_socks[i]);
+			for (i = 0; i < n; i++) fcntl(socks[i], F_SETFL, O_NONBLOCK);
+			memcpy(server_socks, socks, n * sizeof(int));
+			server_count = n;
+		}
+	} else if (conf.backlog != old->backlog) {
+		/* listen() again only changes the backlog */
+		for (i = 0; i < server_count; i++) listen(server_socks[i], conf.backlog);
 	}
+	if (strcmp(conf.svc_name, old->svc_name) || strcmp(conf.svc_type, old->svc_type) ||
+	    strcmp(conf.tty_port, old->tty_port) || conf.server_port != old->server_port) {
+		mdns_clear();
+		if (conf.svc_name[0]) mdns_add(conf.svc_name, conf.svc_type, conf.tty_port, conf.server_port);
+		mdns_update();
+	}
+	LOG("Forwarding %s:%d <-> %s at %s %s", conf.address, conf.server_port, conf.tty_port, conf.baudrate, conf.dataformat);
+}
 
-	if (conf.timeout < 0) {
-		printf("Timeout should be a positive number, use 0 for no timeout.\n");
-		exit(1);
+void reload_config() {
+	static config old;
+	bind_list bl;           /* the address needs a restart, bl is only checked */
+	int old_mask, r;
+
+	if (config_file[0] == '\0') {
+		LOG("No config file to reload, use -c");
+		return;
 	}
+	LOG("Reloading %s", config_file);
+	pthread_rwlock_wrlock(&conf_lock);
+	old = conf;
+	old_mask = log_mask(LOG_UPTO (LOG_INFO));
+	config_defaults();
+	reloading = 1;
+	r = read_config() < 0 || check_config(&bl) < 0;
+	reloading = 0;
+	if (r) {
+		conf = old;
+		pthread_rwlock_unlock(&conf_lock);
+		log_mask(old_mask);
+		LOG("Reload of %s failed, the old settings are kept", config_file);
+		return;
+	}
+	/* only now that all of it is good */
+	keep_restart_settings(&old);
+	if (conf.cache_ttl[0]) cache_config(conf.cache_ttl, 1);
+	log_rate(conf.log_rate);
+	if (conf.engine) reload_devices(&old);
+	else reload_listener(&old);
+	pthread_rwlock_unlock(&conf_lock);
+}
 
-	if ((conf.server_port < 0) || (conf.server_port > 65535)) {
-		printf("Server port is out of range.\n");
-		exit(1);
+/* the fork model: a child for every connection to the listeners of shard */
+static void accept_loop(int shard) {
+	struct pollfd pfd[ADDRS_MAX];
+	struct sockaddr_storage remote_addr;
+	socklen_t addr_size;
+	char addrs[INET6_ADDRSTRLEN + 1]; // for zero termination
+	sigset_t none;
+	pid_t pid;
+	int i, s, n;
+
+	while(1) {
+		/* reload_listener() may have replaced the listeners of shard 0 */
+		for (i = 0; i < binds.count; i++) {
+			pfd[i].fd = server_socks[shard * binds.count + i];
+			pfd[i].events = POLLIN;
+		}
+		if (poll(pfd, binds.count, -1) < 0) {
+			if (errno != EINTR) LOG("poll(): %s", strerror(errno));
+			/* the signal handlers only set flags, the work is done here */
+			if (reload_pending && shard == 0) {
+				reload_pending = 0;
+				reload_config();
+			}
+			if (dump_pending && shard == 0) {
+				dump_pending = 0;
+				latency_dump();
+			}
+			if (stop_pending && shard == 0) daemon_exit(stop_pending);
+			continue;
+		}
+		for (i = 0; i < binds.count; i++) {
+			if (!(pfd[i].revents & POLLIN)) continue;
+			addr_size = sizeof remote_addr;
+			if ((s=accept(pfd[i].fd,(struct sockaddr *)&remote_addr, &addr_size))<0) {
+				if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+					LOG("accept(): %s", strerror(errno));
+				continue;
+			}
+			/* some systems pass O_NONBLOCK of the listener on */
+			fcntl(s, F_SETFL, fcntl(s, F_GETFL) & ~O_NONBLOCK);
+
+			memset(addrs, 0, sizeof(addrs));
+			addr_str((struct sockaddr *)&remote_addr, addrs, sizeof addrs);
+			/* the child gets a conf no reload is halfway through */
+			pthread_rwlock_rdlock(&conf_lock);
+			/* the slot is taken before the check, the other shards count too */
+			n = ATOMIC_INC_FETCH(&conn_count);
+			if ((!conf.max_conn) || (n <= conf.max_conn)) {
+				LOG("accept(): got connection #%d from %s fd=%d", n, addrs, s);
+				METRIC_ADD(connections, 1);
+			} else {
+				ATOMIC_DEC(&conn_count);
+				pthread_rwlock_unlock(&conf_lock);
+				close(s);
+				METRIC_ADD(connections_dropped, 1);
+				LOG("accept(): connection from %s dropped, too many connections",
+				     addrs);
+				continue;
+			}
+			if ((pid=fork())) {
+				pthread_rwlock_unlock(&conf_lock);
+				if (pid < 0) {
+					ATOMIC_DEC(&conn_count);
+					LOG("fork(): %s", strerror(errno));
+				}
+				close(s);
+			} else {
+				pthread_rwlock_unlock(&conf_lock);
+				log_start();
+				/* a worker's child inherits its mask, which blocks everything */
+				sigemptyset(&none);
+				sigprocmask(SIG_SETMASK, &none, NULL);
+				signal(SIGALRM, session_timeout);
+				alarm(conf.timeout);
+				for (i = 0; i < metrics_count; i++) close(metrics_socks[i]);
+				for (i = 0; i < server_count; i++) close(server_socks[i]);
+				serve_client(s);
+				_exit(0);
+			}
+		}
 	}
+}
 
-	if (configure_tty_options(&conf.options, conf.baudrate, conf.dataformat) == -1) {
-		exit(1);
+static void *accept_worker(void *arg) {
+	accept_loop((int)(long)arg);
+	return NULL;
+}
+
+/* -A: a thread for every shard but the first, which is the main thread's */
+static void start_accept_workers() {
+	pthread_t thread;
+	sigset_t all, old;
+	int shard, r;
+
+	/* signals stay with the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (shard = 1; shard < conf.shards; shard++) {
+		if ((r = pthread_create(&thread, NULL, accept_worker, (void *)(long)shard))) {
+			LOG("pthread_create(): %s", strerror(r));
+			exit(1);
+		}
+		pthread_detach(thread);
 	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+int main(int argc, char **argv) {
+	int i;
+	int single;
+	pid_t pgrp;
+	struct sigaction sa;
+
+	config_defaults();
+	log_mask(LOG_UPTO (LOG_INFO));
+	config_args(argc, argv);
+	if (read_config() < 0) exit(1);
+	single = (conf.device_count == 0);
+	if (check_config(&binds) < 0) exit(1);
+	if (conf.cache_ttl[0]) cache_config(conf.cache_ttl, 1);
+	/* the probe writes NexStar commands, it is no use with other devices */
+	if (conf.low_latency && single && (conf.latency_probe || conf.mux)) report_low_latency();
+	log_rate(conf.log_rate);
 
 	if (conf.is_daemon) daemonize();
 
@@ -499,10 +756,17 @@ int main(int argc, char **argv) {
 		LOG("sigaction(): %s",strerror(errno));
 		exit(1);
 	}
+	/* no SA_RESTART, poll() returns to reload the config or dump the latency */
+	sa.sa_flags = 0;
 	if (sigaction(SIGHUP, &sa, NULL) == -1) {
 		LOG("sigaction(): %s",strerror(errno));
 		exit(1);
 	}
+	if (!conf.engine && sigaction(SIGUSR1, &sa, NULL) == -1) {
+		LOG("sigaction(): %s",strerror(errno));
+		exit(1);
+	}
+	sa.sa_flags = SA_RESTART;
 	if (sigaction(SIGPIPE, &sa, NULL) == -1) {
 		LOG("sigaction(): %s",strerror(errno));
 		exit(1);
@@ -526,9 +790,32 @@ int main(int argc, char **argv) {
 		LOG("setpgrp(): %s",strerror(errno));
 		exit(1);
 	}
+	if (log_start() < 0) LOG("Logging synchronously: %s", strerror(errno));
+
+	if (latency_init() < 0) LOG("Latency statistics are disabled: %s", strerror(errno));
+	if (metrics_init() < 0) LOG("Metrics are disabled: %s", strerror(errno));
+	if (conf.metrics_port) {
+		metrics_count = tcp_listen(htons(conf.metrics_port), 1, metrics_socks);
+		for (i = 0; i < metrics_count; i++) {
+			if (metrics_start(metrics_socks[i]) < 0) {
+				LOG("metrics_start(): %s", strerror(errno));
+				exit(1);
+			}
+		}
+		LOG("Metrics on %s:%d/metrics", conf.address, conf.metrics_port);
+	}
 
-	sock=tcp_listen(addr,htons(conf.server_port));
+	if (conf.engine) {
+		if (single) {
+			LOG("Version %s started on %s:%d ",VERSION, conf.address, conf.server_port);
+		} else {
+			LOG("Version %s started with %d devices", VERSION, conf.device_count);
+		}
+		serve_devices();
+	}
 
+	server_count = tcp_listen(htons(conf.server_port), conf.shards, server_socks);
+	for (i = 0; i < server_count; i++) fcntl(server_socks[i], F_SETFL, O_NONBLOCK);
 	if (conf.svc_name[0]) {
 		mdns_init(conf.svc_name, conf.svc_type, conf.tty_port, conf.server_port);
 		mdns_start();
@@ -537,35 +824,7 @@ int main(int argc, char **argv) {
 	LOG("Version %s started on %s:%d ",VERSION, conf.address, conf.server_port);
 	LOG("Forwarding %s:%d <-> %s at %s %s", conf.address, conf.server_port, conf.tty_port, conf.baudrate, conf.dataformat);
 
-	while(1) {
-		addr_size = sizeof remote_addr;
-		if ((s=accept(sock,(struct sockaddr *)&remote_addr, &addr_size))<0) {
-			LOG("accept(): %s", strerror(errno));
-			/* exit(1); */ /* Which is the correct exit() or cntinue?! */
-			continue;
-		}
-
-		memset(addrs, 0, sizeof(addrs));
-		inet_ntop(remote_addr.ss_family, get_in_addr((struct sockaddr *)&remote_addr),
-			addrs, sizeof addrs);
-		if ((!conf.max_conn) || (conf.max_conn > conn_count)) {
-			LOG("accept(): got connection #%d from %s fd=%d", conn_count+1, addrs, s);
-		} else {
-			close(s);
-			LOG("accept(): connection from %s dropped, too many connections",
-			     addrs);
-			continue;
-		}
-		if ((pid=fork())) {
-			if(pid > 0) ATOMIC_INC(&conn_count);
-			else LOG("fork(): %s", strerror(errno));
-			close(s);
-		} else {
-			signal(SIGALRM, session_timeout);
-			alarm(conf.timeout);
-			serve_client(s);
-			_exit(0);
-		}
-	}
+	start_accept_workers();
+	accept_loop(0);
 	exit(0);
 }
@@ -1,24 +1,76 @@
 #ifndef __NEXBRIDGE_H__
 #define __NEXBRIDGE_H__
 
+#include <sys/socket.h>
 #include <syslog.h>
 #include <termios.h>
 #include <stdio.h>
 
+#include "log.h"
+
+#define DEVICES_MAX 32
+#define ADDRS_MAX 4             /* -a addresses */
+#define SHARDS_MAX 8            /* -A SO_REUSEPORT listeners per address */
+#define LISTENERS_MAX (ADDRS_MAX * SHARDS_MAX)
+
+/* one serial port served by a multi-device daemon (-D) */
+typedef struct {
+	char tty_port[255];
+	char baudrate[15];
+	char dataformat[15];
+	int server_port;
+	char svc_name[255];
+	struct termios options;
+} device_conf;
+
 typedef struct {
 	int is_daemon;
 	int server_port;
 	char tty_port[255];
-	char address[255];
+	char address[255];      /* comma separated, empty for any IPv4 or IPv6 */
 	char svc_name[255];
 	char svc_type[255];
 	char dataformat[15];
 	char baudrate[15];
 	int timeout;
 	int max_conn;
+	int backlog;
+	int shards;             /* SO_REUSEPORT listeners of every address (-A) */
+	int engine;
+	int mux;
+	int cache;
+	char cache_ttl[256];    /* the -C table, put in use once the whole config is good */
+	int poll_interval;
+	int gap;                /* msec, the least the mux waits after a reply (-x) */
+	int splice;
+	int framing;
+	int metrics_port;
+	int low_latency;
+	int vmin;
+	int vtime;
+	int latency_timer;
+	int latency_probe;      /* measure the round-trip with 'Kx', the tty is a NexStar mount */
+	int log_rate;
+	int rfc2217;
+	int udp;
+	int websocket;
+	char ws_origins[256];   /* -O, the page origins browsers may connect from */
+	char capture_dir[255];
 	struct termios options;
+	struct termios stock_options;   /* options without the low latency profile */
+	device_conf devices[DEVICES_MAX];
+	int device_count;
 } config;
 extern config conf;
+extern volatile int conn_count;
+
+/* the parsed -a list */
+typedef struct {
+	struct sockaddr_storage addr[ADDRS_MAX];
+	socklen_t len[ADDRS_MAX];
+	int count;
+	int v6only;             /* IPv4 addresses are listed too, do not take them on IPv6 */
+} bind_list;
 
 typedef struct {
 	int value;
@@ -27,27 +79,24 @@ typedef struct {
 } sbaud_rate;
 #define BR(str,val) { val, sizeof(str), str }
 
-#define LOG(msg, ...) \
-	{ if(conf.is_daemon) { \
-		openlog("nexbridge",LOG_PID,LOG_DAEMON);\
-		syslog(LOG_INFO,msg, ## __VA_ARGS__);\
-		closelog();\
-	} else { \
-		fprintf(stderr,"LOG: ");\
-		fprintf(stderr, msg,  ## __VA_ARGS__);\
-		fprintf(stderr,"\n");\
-	}}\
-
-
-#define LOG_DBG(msg, ...) \
-	{ if(conf.is_daemon) { \
-		openlog("nexbridge",LOG_PID,LOG_DAEMON); \
-		syslog(LOG_DEBUG,msg, ## __VA_ARGS__); \
-		closelog(); \
-	} else { \
-		fprintf(stderr,"DBG: ");\
-		fprintf(stderr, msg,  ## __VA_ARGS__);\
-		fprintf(stderr,"\n");\
-	}}\
-	
+/* "9600" to B9600, -1 if not supported */
+int map_str_baudrate(const char *baudrate);
+/* B9600 to 9600, 0 if not in the table */
+int map_speed_baudrate(int speed);
+
+struct sockaddr;
+void *get_in_addr(struct sockaddr *sa);
+void addr_str(struct sockaddr *sa, char *buf, size_t size);
+int open_tty(const char *tty_name, const struct termios *options, struct termios *old_options);
+void close_tty(int tty_fd, struct termios *old_options);
+/* logs the signal, stops mDNS and the sessions and exits */
+void daemon_exit(int sig);
+/* re-read the config file (-c) and apply what changed, on SIGHUP */
+void reload_config();
+/* a bad setting, to the terminal at startup and to the log on a reload */
+void config_error(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+#define LOG(msg, ...) log_write(LOG_INFO, msg, ## __VA_ARGS__)
+#define LOG_DBG(msg, ...) log_write(LOG_DEBUG, msg, ## __VA_ARGS__)
+
 #endif /*__NEXBRIDGE_H__*/
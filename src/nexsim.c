@@ -0,0 +1,371 @@
+/**************************************************************
+    nexsim - NexStar hand control emulator on a virtual tty,
+    a stand-in mount for testing nexbridge without hardware
+
+    (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE  /* cfmakeraw() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <termios.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "nexstar.h"
+
+#define NAME_SIZZ 1024
+#define BUFSIZZ 1024
+#define REV 4294967296.0          /* one revolution in 32 bit NexStar units */
+#define SIDEREAL_DAY 86164.0905   /* sec */
+#define unlink_tty(tty_name) if ((tty_name[0]) != '\0') unlink(tty_name)
+
+typedef struct {
+	char tty_name[NAME_SIZZ];
+	int baudrate;          /* sets the byte timing, 0 for none */
+	int delay;             /* hand control processing time, msec */
+	double slew_rate;      /* deg/sec */
+	int verbose;
+} config;
+config conf;
+
+/* positions and targets as fractions of a revolution */
+typedef struct {
+	double axis[4];        /* RA, Dec, Azm, Alt */
+	double target[4];
+	int slewing;           /* 0, 1 - RA/Dec goto, 2 - Azm/Alt goto */
+	int tracking;          /* 0 off, 1 alt-az, 2 EQ north, 3 EQ south */
+	unsigned char location[8];
+	unsigned char time[8];
+	uint64_t updated;      /* usec */
+} mount;
+mount m;
+
+static uint64_t now_usec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t byte_time() {
+	/* start bit + 8 data bits + stop bit */
+	return conf.baudrate ? 10000000ULL / conf.baudrate : 0;
+}
+
+int open_pts(char *pts_name, int pts_name_size) {
+	struct termios options;
+	char *pname;
+	int fd;
+
+	fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (fd < 0)
+		return -1;
+	if (grantpt(fd) < 0 || unlockpt(fd) < 0 || (pname = ptsname(fd)) == NULL) {
+		close(fd);
+		return -1;
+	}
+	strncpy(pts_name, pname, pts_name_size);
+
+	/* raw, so nothing is echoed before the bridge configures the port */
+	if (tcgetattr(fd, &options) == 0) {
+		cfmakeraw(&options);
+		tcsetattr(fd, TCSANOW, &options);
+	}
+	return fd;
+}
+
+static double wrap(double x) {
+	x = fmod(x, 1.0);
+	return (x < 0) ? x + 1.0 : x;
+}
+
+/* advance the slew and the sky rotation to now */
+static void mount_update() {
+	uint64_t now = now_usec();
+	double dt = (now - m.updated) / 1000000.0;
+	double step = conf.slew_rate / 360.0 * dt;
+	double d;
+	int i, first, moving = 0;
+
+	m.updated = now;
+	/* with tracking off the sky moves under a fixed mount */
+	if (m.tracking == 0) m.axis[0] = wrap(m.axis[0] + dt / SIDEREAL_DAY);
+	if (!m.slewing) return;
+	first = (m.slewing == 1) ? 0 : 2;
+	for (i = first; i < first + 2; i++) {
+		d = wrap(m.target[i] - m.axis[i] + 0.5) - 0.5;  /* the shorter way */
+		if (fabs(d) <= step) {
+			m.axis[i] = m.target[i];
+		} else {
+			m.axis[i] = wrap(m.axis[i] + (d > 0 ? step : -step));
+			moving = 1;
+		}
+	}
+	if (!moving) {
+		m.slewing = 0;
+		if (conf.verbose) printf("Goto done\n");
+	}
+}
+
+static int parse_pair(const char *s, int digits, double *a, double *b) {
+	unsigned long x, y;
+	char fmt[16];
+
+	snprintf(fmt, sizeof(fmt), "%%%dlx,%%%dlx", digits, digits);
+	if (sscanf(s, fmt, &x, &y) != 2) return -1;
+	*a = x / ((digits == 4) ? 65536.0 : REV);
+	*b = y / ((digits == 4) ? 65536.0 : REV);
+	return 0;
+}
+
+static int format_pair(char *buf, int digits, double a, double b) {
+	if (digits == 4)
+		return sprintf(buf, "%04X,%04X#", (unsigned)(a * 65536.0) & 0xFFFF, (unsigned)(b * 65536.0) & 0xFFFF);
+	/* hand controls report 24 bits of precision */
+	return sprintf(buf, "%08X,%08X#", (unsigned)((uint64_t)(a * REV)) & 0xFFFFFF00,
+	               (unsigned)((uint64_t)(b * REV)) & 0xFFFFFF00);
+}
+
+/* reply to one complete command, returns the reply length */
+static int execute(const char *cmd, int len, char *reply) {
+	int first, digits;
+
+	mount_update();
+	switch (cmd[0]) {
+	case 'E': case 'e':
+	case 'Z': case 'z':
+		first = (cmd[0] == 'E' || cmd[0] == 'e') ? 0 : 2;
+		digits = (cmd[0] == 'E' || cmd[0] == 'Z') ? 4 : 8;
+		return format_pair(reply, digits, m.axis[first], m.axis[first + 1]);
+	case 'R': case 'r':
+	case 'B': case 'b':
+		first = (cmd[0] == 'R' || cmd[0] == 'r') ? 0 : 2;
+		digits = (cmd[0] == 'R' || cmd[0] == 'B') ? 4 : 8;
+		if (parse_pair(cmd + 1, digits, &m.target[first], &m.target[first + 1]) == 0) {
+			m.slewing = first ? 2 : 1;
+			if (conf.verbose) printf("Goto %c %.4f,%.4f\n", cmd[0], m.target[first], m.target[first + 1]);
+		}
+		break;
+	case 'S': case 's':
+		digits = (cmd[0] == 'S') ? 4 : 8;
+		parse_pair(cmd + 1, digits, &m.axis[0], &m.axis[1]);
+		break;
+	case 't':
+		reply[0] = m.tracking;
+		reply[1] = '#';
+		return 2;
+	case 'T':
+		m.tracking = (unsigned char)cmd[1] & 3;
+		break;
+	case 'P':
+		memset(reply, 0, (unsigned char)cmd[7]);
+		reply[(unsigned char)cmd[7]] = '#';
+		return (unsigned char)cmd[7] + 1;
+	case 'w':
+	case 'h':
+		memcpy(reply, (cmd[0] == 'w') ? m.location : m.time, 8);
+		reply[8] = '#';
+		return 9;
+	case 'W':
+		memcpy(m.location, cmd + 1, 8);
+		break;
+	case 'H':
+		memcpy(m.time, cmd + 1, 8);
+		break;
+	case 'V':
+		return sprintf(reply, "%c%c#", 4, 21);
+	case 'm':
+		return sprintf(reply, "%c#", 20);   /* Advanced GT */
+	case 'K':
+		reply[0] = cmd[1];
+		reply[1] = '#';
+		return 2;
+	case 'J':
+		return sprintf(reply, "%c#", 1);
+	case 'L':
+		return sprintf(reply, "%c#", m.slewing ? '1' : '0');
+	case 'M':
+		m.slewing = 0;
+		break;
+	}
+	reply[0] = '#';
+	return 1;
+}
+
+/*
+ * One command at a time like the hand control: it is received at the line
+ * rate, processed for conf.delay and the reply goes out a byte per byte_time
+ */
+static int simulate(int fd) {
+	char in[BUFSIZZ], out[NEX_REPLY_MAX + 1];
+	int in_len = 0, out_len = 0, out_pos = 0;
+	uint64_t next = 0, now, wait;
+	struct timeval tv;
+	fd_set readset;
+	int r, len;
+
+	while (1) {
+		now = now_usec();
+		/* start the next command once the previous reply is out */
+		if (out_pos == out_len && in_len && (len = nex_command_len(in, in_len)) > 0) {
+			out_len = execute(in, len, out);
+			out_pos = 0;
+			if (conf.verbose) printf("Command '%c' (%d bytes), %d reply bytes\n", in[0], len, out_len);
+			in_len -= len;
+			memmove(in, in + len, in_len);
+			next = now + len * byte_time() + conf.delay * 1000;
+		}
+		while (out_pos < out_len && now >= next) {
+			if (write(fd, out + out_pos, 1) != 1) return -1;
+			out_pos++;
+			next += byte_time();
+			if (next < now) next = now;
+		}
+		/* the next command came with this one, do not wait for more */
+		if (out_pos == out_len && nex_command_len(in, in_len) > 0) continue;
+
+		FD_ZERO(&readset);
+		FD_SET(fd, &readset);
+		wait = (out_pos < out_len) ? ((next > now) ? next - now : 0) : 1000000;
+		tv.tv_sec = wait / 1000000;
+		tv.tv_usec = wait % 1000000;
+		r = select(fd + 1, &readset, NULL, NULL, &tv);
+		if (r < 0 && errno != EINTR) return -1;
+		if (r <= 0) continue;
+
+		r = read(fd, in + in_len, BUFSIZZ - in_len);
+		if (r < 0 && errno == EIO) { /* nobody has the tty open */
+			usleep(50000);
+			continue;
+		}
+		if (r <= 0) return -1;
+		in_len += r;
+		if (in_len == BUFSIZZ) in_len = 0; /* garbage, a real mount would lose it too */
+	}
+	return 0;
+}
+
+
+void sig_handler(int sig) {
+	unlink_tty(conf.tty_name);
+	exit(0);
+}
+
+
+void print_usage(char *name) {
+	printf( "%s version %s\n"
+		"This app emulates a NexStar hand control on a virtual serial port, so\n"
+		"nexbridge can be tested without a telescope. Gotos slew at a constant\n"
+		"rate, replies are delayed like a real hand control and sent at the\n"
+		"serial line rate. (see nexbridge)\n\n", name, VERSION);
+	printf( "usage: %s [-vV] [-T tty] [-b baudrate] [-d msec] [-s deg/sec]\n"
+		"    -T  virtual tty name to create\n"
+		"    -b  line rate used for the byte timing, 0 for none [default: %s]\n"
+		"    -d  hand control processing time per command in msec [default: 20]\n"
+		"    -s  slew rate in degrees per second [default: 4]\n"
+		"    -V  print every command\n"
+		"    -v  print version\n"
+		"    -h  print this help message\n\n", name, BAUDRATE);
+	printf( " Copyright (c)2014-2016 by Rumen Bogdanovski\n\n");
+}
+
+
+void config_defaults() {
+	conf.tty_name[0] = '\0';
+	conf.baudrate = atoi(BAUDRATE);
+	conf.delay = 20;
+	conf.slew_rate = 4;
+	conf.verbose = 0;
+}
+
+
+int main(int argc, char **argv) {
+	char tty_name[NAME_SIZZ];
+	int c, tty_fd, slave_fd;
+	struct sigaction sa;
+
+	/* dusable buffering for stdout and stderr */
+	setbuf(stdout, NULL);
+	setbuf(stderr, NULL);
+
+	config_defaults();
+	while((c=getopt(argc,argv,"hvVT:b:d:s:"))!=-1){
+		switch(c){
+		case 'T':
+			strncpy(conf.tty_name, optarg, 255);
+			break;
+		case 'b':
+			conf.baudrate = atoi(optarg);
+			break;
+		case 'd':
+			conf.delay = atoi(optarg);
+			break;
+		case 's':
+			conf.slew_rate = atof(optarg);
+			break;
+		case 'V':
+			conf.verbose = 1;
+			break;
+		case 'h':
+			print_usage(argv[0]);
+			exit(0);
+		case 'v':
+			printf("%s version %s\n", argv[0], VERSION);
+			exit(0);
+		case '?':
+		default:
+			printf("for help: %s -h\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	if ((conf.baudrate < 0) || (conf.delay < 0) || (conf.slew_rate <= 0)) {
+		printf("Invalid timing parameters, for help: %s -h\n", argv[0]);
+		exit(1);
+	}
+
+	sa.sa_handler = sig_handler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;
+	if ((sigaction(SIGHUP, &sa, NULL) == -1) || (sigaction(SIGTERM, &sa, NULL) == -1) ||
+	    (sigaction(SIGINT, &sa, NULL) == -1) || (sigaction(SIGQUIT, &sa, NULL) == -1)) {
+		printf("sigaction(): %s",strerror(errno));
+		exit(1);
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	tty_fd = open_pts(tty_name, NAME_SIZZ);
+	if (tty_fd == -1) {
+		printf("Can not allocate virtual tty.\n");
+		exit(1);
+	}
+	/* keep the slave side open, the bridge may close and reopen it */
+	slave_fd = open(tty_name, O_RDWR | O_NOCTTY);
+
+	if(conf.tty_name[0] != '\0') {
+		if (symlink(tty_name, conf.tty_name) < 0) {
+			printf("Can not create a symbolic link: %s\n",strerror(errno));
+			conf.tty_name[0]='\0';
+		}
+	}
+	printf("Emulating a NexStar hand control on [%s]\n", conf.tty_name[0] ? conf.tty_name : tty_name);
+
+	m.tracking = 2;
+	m.axis[1] = m.target[1] = 0.25;   /* pointing at the pole */
+	m.updated = now_usec();
+
+	if (simulate(tty_fd) < 0) printf("simulate(): %s\n", strerror(errno));
+	if (slave_fd >= 0) close(slave_fd);
+	unlink_tty(conf.tty_name);
+	exit(1);
+}
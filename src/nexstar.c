@@ -0,0 +1,131 @@
+/**************************************************************
+        nexstar - NexStar hand control command set, used to
+        find command and reply boundaries in the byte stream
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "nexstar.h"
+
+static const nex_command commands[] = {
+	{ 'E',  1, 10, NEX_QUERY },   /* get RA/Dec "34AB,12CE#" */
+	{ 'e',  1, 18, NEX_QUERY },   /* get precise RA/Dec "34AB0500,12CE0500#" */
+	{ 'Z',  1, 10, NEX_QUERY },   /* get Azm/Alt */
+	{ 'z',  1, 18, NEX_QUERY },   /* get precise Azm/Alt */
+	{ 'R', 10,  1, NEX_MOTION },  /* goto RA/Dec */
+	{ 'r', 18,  1, NEX_MOTION },  /* goto precise RA/Dec */
+	{ 'B', 10,  1, NEX_MOTION },  /* goto Azm/Alt */
+	{ 'b', 18,  1, NEX_MOTION },  /* goto precise Azm/Alt */
+	{ 'S', 10,  1, 0 },           /* sync */
+	{ 's', 18,  1, 0 },           /* precise sync */
+	{ 't',  1,  2, NEX_QUERY },   /* get tracking mode */
+	{ 'T',  2,  1, 0 },           /* set tracking mode */
+	{ 'P',  8,  0, 0 },           /* passthrough, byte 8 is the reply length */
+	{ 'w',  1,  9, NEX_QUERY },   /* get location */
+	{ 'W',  9,  1, 0 },           /* set location */
+	{ 'h',  1,  9, NEX_QUERY },   /* get time */
+	{ 'H',  9,  1, 0 },           /* set time */
+	{ 'V',  1,  3, NEX_QUERY },   /* get version */
+	{ 'm',  1,  2, NEX_QUERY },   /* get model */
+	{ 'K',  2,  2, NEX_QUERY },   /* echo */
+	{ 'J',  1,  2, NEX_QUERY },   /* is alignment complete */
+	{ 'L',  1,  2, NEX_QUERY },   /* is goto in progress */
+	{ 'M',  1,  1, NEX_MOTION },  /* cancel goto */
+	{ 'x',  1,  1, 0 },           /* hibernate */
+	{ 'y',  1,  1, 0 },           /* wake up */
+	{   0,  0,  0, 0 }
+};
+
+const nex_command *nex_lookup(unsigned char cmd) {
+	const nex_command *c;
+
+	for (c = commands; c->cmd; c++) {
+		if (c->cmd == cmd) return c;
+	}
+	return NULL;
+}
+
+int nex_command_len(const char *buf, int len) {
+	const nex_command *c;
+
+	if (len <= 0) return 0;
+	c = nex_lookup(buf[0]);
+	if (c == NULL) return (len > NEX_CMD_MAX) ? NEX_CMD_MAX : len;
+	return (len >= c->len) ? c->len : 0;
+}
+
+int nex_reply_len(const char *cmd, int len) {
+	const nex_command *c;
+
+	if (len <= 0) return -1;
+	c = nex_lookup(cmd[0]);
+	if (c == NULL || len < c->len) return -1;
+	if (c->reply_len == 0) return (unsigned char)cmd[7] + 1;
+	return c->reply_len;
+}
+
+static const char *priority_names[NEX_PRIOS] = { "stop", "motion", "config", "query" };
+
+/* 'P' fixed and variable rate slews of the azm/ra (16) and alt/dec (17) motors */
+static int is_slew(const unsigned char *p) {
+	if (p[2] != 16 && p[2] != 17) return 0;
+	return (p[1] == 2 && (p[3] == 36 || p[3] == 37)) || (p[1] == 3 && (p[3] == 6 || p[3] == 7));
+}
+
+int nex_priority(const char *cmd, int len) {
+	const unsigned char *p = (const unsigned char *)cmd;
+	const nex_command *c;
+
+	if (len <= 0 || (c = nex_lookup(p[0])) == NULL) return NEX_PRIO_CONFIG;
+	if (c->flags & NEX_QUERY) return NEX_PRIO_QUERY;
+	if (p[0] == 'M') return NEX_PRIO_STOP;
+	if (p[0] == 'P' && len >= c->len && is_slew(p)) {
+		/* the rate is p[4] for fixed and p[4]:p[5] for variable rate */
+		if (p[4] == 0 && (p[1] == 2 || p[5] == 0)) return NEX_PRIO_STOP;
+		return NEX_PRIO_MOTION;
+	}
+	return (c->flags & NEX_MOTION) ? NEX_PRIO_MOTION : NEX_PRIO_CONFIG;
+}
+
+const char *nex_priority_name(int prio) {
+	return (prio >= 0 && prio < NEX_PRIOS) ? priority_names[prio] : "?";
+}
+
+int nex_is_query(const char *cmd, int len) {
+	const nex_command *c;
+
+	if (len <= 0) return 0;
+	c = nex_lookup(cmd[0]);
+	return (c != NULL) && (c->flags & NEX_QUERY);
+}
+
+int nex_reply_complete(const char *cmd, int cmd_len, const char *reply, int got) {
+	int expected = nex_reply_len(cmd, cmd_len);
+
+	/* binary replies may contain '#', so trust the length when we know it */
+	if (expected > 0) return got >= expected;
+	return (got > 0) && (memchr(reply, NEX_TERMINATOR, got) != NULL);
+}
+
+int nex_reply_valid(const char *cmd, int cmd_len, const char *reply, int len) {
+	int expected = nex_reply_len(cmd, cmd_len);
+	int i;
+
+	if (expected < 0) return 1;
+	if (len != expected || reply[len - 1] != NEX_TERMINATOR) return 0;
+	switch (cmd[0]) {
+	case 'E':
+	case 'e':
+	case 'Z':
+	case 'z':
+		/* "34AB,12CE#" or "34AB0500,12CE0500#" */
+		for (i = 0; i < len - 1; i++) {
+			if (i == (len - 1) / 2 ? reply[i] != ',' : !isxdigit((unsigned char)reply[i])) return 0;
+		}
+		break;
+	}
+	return 1;
+}
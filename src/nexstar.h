@@ -0,0 +1,52 @@
+#ifndef __NEXSTAR_H__
+#define __NEXSTAR_H__
+
+#define NEX_TERMINATOR '#'
+#define NEX_CMD_MAX 64      /* longest command we buffer, 'r'/'b'/'s' are 18 bytes */
+#define NEX_REPLY_MAX 260   /* 'P' can ask for up to 255 bytes + '#' */
+
+#define NEX_QUERY 0x01  /* read-only, does not change the mount state */
+#define NEX_MOTION 0x02 /* starts or stops a slew */
+
+/* scheduling classes, a lower class goes to the tty first (-x) */
+enum {
+	NEX_PRIO_STOP,      /* cancel goto, zero rate slew */
+	NEX_PRIO_MOTION,
+	NEX_PRIO_CONFIG,    /* everything else which is not a query */
+	NEX_PRIO_QUERY,
+	NEX_PRIOS
+};
+
+typedef struct {
+	unsigned char cmd;
+	int len;            /* command length in bytes including the command byte */
+	int reply_len;      /* reply length including '#', 0 if given by the command */
+	int flags;
+} nex_command;
+
+/* table entry for a command byte, NULL if it is not a NexStar command */
+const nex_command *nex_lookup(unsigned char cmd);
+
+/*
+ * length of the complete command at the head of buf, 0 if more bytes are needed.
+ * Unknown commands are taken as whatever is in the buffer.
+ */
+int nex_command_len(const char *buf, int len);
+
+/* expected reply length including '#', -1 if the reply ends at the first '#' */
+int nex_reply_len(const char *cmd, int len);
+
+/* returns 1 for read-only commands, unknown commands are not */
+int nex_is_query(const char *cmd, int len);
+
+/* NEX_PRIO_* class of the complete command cmd */
+int nex_priority(const char *cmd, int len);
+const char *nex_priority_name(int prio);
+
+/* returns 1 if reply (got bytes) is a complete reply to cmd */
+int nex_reply_complete(const char *cmd, int cmd_len, const char *reply, int got);
+
+/* returns 0 if the complete reply can not be the answer to cmd, a garbled line */
+int nex_reply_valid(const char *cmd, int cmd_len, const char *reply, int len);
+
+#endif /*__NEXSTAR_H__*/
@@ -0,0 +1,708 @@
+/**************************************************************
+        options - the command line, the config file and the
+        checks of the settings
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <termios.h>
+#include <limits.h>
+
+#include "config.h"
+#include "nexbridge.h"
+#include "cache.h"
+#include "options.h"
+
+#define OPTIONS "defhnRuvWxza:A:b:B:c:C:D:F:g:L:m:M:O:p:P:r:s:S:T:t:w:"
+
+char config_file[PATH_MAX];             /* -c, re-read on SIGHUP */
+static int saved_argc;
+static char **saved_argv;
+
+int configure_tty_options(struct termios *options, const char *baudrate, const char *mode) {
+	int cbits=CS8, cpar=0, ipar=IGNPAR, bstop=0;
+	int baudr=0;
+
+	baudr = map_str_baudrate(baudrate);
+	if (baudr == -1) {
+		config_error("Baudrate is not valid: %s", baudrate);
+		return -1;
+	}
+
+	if(strlen(mode) != 3) {
+		config_error("Invalid data frmat \"%s\"", mode);
+		return -1;
+	}
+
+	switch(mode[0]) {
+		case '8': cbits = CS8; break;
+		case '7': cbits = CS7; break;
+		case '6': cbits = CS6; break;
+		case '5': cbits = CS5; break;
+		default :
+			config_error("Invalid number of data bits '%c'", mode[0]);
+			return -1;
+			break;
+	}
+
+	switch(mode[1]) {
+		case 'N':
+		case 'n':
+			cpar = 0;
+			ipar = IGNPAR;
+			break;
+		case 'E':
+		case 'e':
+			cpar = PARENB;
+			ipar = INPCK;
+			break;
+		case 'O':
+		case 'o':
+			cpar = (PARENB | PARODD);
+			ipar = INPCK;
+			break;
+		default :
+			config_error("Invalid parity '%c'", mode[1]);
+			return -1;
+            break;
+	}
+
+	switch(mode[2]) {
+		case '1': bstop = 0; break;
+		case '2': bstop = CSTOPB; break;
+		default :
+			config_error("Invalid number of stop bits '%c'", mode[2]);
+			return -1;
+			break;
+	}
+
+	memset(options, 0, sizeof(*options));  /* clear options struct */
+
+	options->c_cflag = cbits | cpar | bstop | CLOCAL | CREAD;
+	options->c_iflag = ipar;
+	options->c_oflag = 0;
+	options->c_lflag = 0;
+	options->c_cc[VMIN] = 0;       /* block untill n bytes are received */
+	options->c_cc[VTIME] = 50;     /* block untill a timer expires (n * 100 mSec.) */
+
+	cfsetispeed(options, baudr);
+	cfsetospeed(options, baudr);
+
+	return 0;
+}
+
+void config_defaults() {
+	conf.is_daemon = 1;
+	conf.server_port = PORT;
+	conf.address[0] = '\0';
+	conf.svc_name[0] = '\0';
+	sprintf(conf.svc_type, "%s.%s", SVC_TYPE, SVC_PROTO);
+	strcpy(conf.tty_port, TTY_PORT);
+	strcpy(conf.dataformat, DATA_FORMAT);
+	strcpy(conf.baudrate, BAUDRATE);
+	conf.timeout = SESS_TIMEOUT;
+	conf.max_conn = MAXCON;
+	conf.backlog = BACKLOG;
+	conf.shards = 1;
+	conf.engine = 0;
+	conf.mux = 0;
+	conf.cache = 0;
+	conf.cache_ttl[0] = '\0';
+	conf.poll_interval = 0;
+	conf.gap = 0;
+	conf.splice = 0;
+	conf.framing = 0;
+	conf.metrics_port = 0;
+	conf.low_latency = 0;
+	conf.vmin = 1;
+	conf.vtime = 0;
+	conf.latency_timer = 0;
+	conf.latency_probe = 0;
+	conf.log_rate = 0;
+	conf.rfc2217 = 0;
+	conf.udp = 0;
+	conf.websocket = 0;
+	conf.ws_origins[0] = '\0';
+	conf.capture_dir[0] = '\0';
+	conf.device_count = 0;
+	configure_tty_options(&conf.options, conf.baudrate, conf.dataformat);
+}
+
+/* parse "tty[,baud=9600][,format=8N1][,port=9999][,name=svc]" of a -D device */
+int configure_device(const char *spec) {
+	char buf[1024], *tok, *save = NULL;
+	device_conf *dc;
+
+	if (conf.device_count == DEVICES_MAX) {
+		config_error("Too many devices, at most %d are supported", DEVICES_MAX);
+		return -1;
+	}
+	dc = &conf.devices[conf.device_count];
+	memset(dc, 0, sizeof(device_conf));
+	snprintf(buf, sizeof(buf), "%s", spec);
+	tok = strtok_r(buf, ",", &save);
+	if (tok == NULL || spec[0] == ',' || strchr(tok, '=')) {
+		config_error("Device \"%s\" has no serial port", spec);
+		return -1;
+	}
+	snprintf(dc->tty_port, sizeof(dc->tty_port), "%s", tok);
+	while ((tok = strtok_r(NULL, ",", &save))) {
+		if (!strncmp(tok, "baud=", 5)) snprintf(dc->baudrate, sizeof(dc->baudrate), "%s", tok + 5);
+		else if (!strncmp(tok, "format=", 7)) snprintf(dc->dataformat, sizeof(dc->dataformat), "%s", tok + 7);
+		else if (!strncmp(tok, "port=", 5)) dc->server_port = atoi(tok + 5);
+		else if (!strncmp(tok, "name=", 5)) snprintf(dc->svc_name, sizeof(dc->svc_name), "%s", tok + 5);
+		else {
+			config_error("Invalid device setting \"%s\"", tok);
+			return -1;
+		}
+	}
+	if ((dc->server_port < 0) || (dc->server_port > 65535)) {
+		config_error("Server port of %s is out of range.", dc->tty_port);
+		return -1;
+	}
+	conf.device_count++;
+	return 0;
+}
+
+/* -B, -F and -p are the defaults of the -D devices, ports count up from -p,
+   the engine without -D serves -P as the only device */
+int configure_devices() {
+	device_conf *dc;
+	int i;
+
+	if (conf.engine && conf.device_count == 0) {
+		dc = &conf.devices[conf.device_count++];
+		memset(dc, 0, sizeof(device_conf));
+		strcpy(dc->tty_port, conf.tty_port);
+		strcpy(dc->svc_name, conf.svc_name);
+		dc->server_port = conf.server_port;
+	}
+
+	for (i = 0; i < conf.device_count; i++) {
+		dc = &conf.devices[i];
+		if (dc->baudrate[0] == '\0') strcpy(dc->baudrate, conf.baudrate);
+		if (dc->dataformat[0] == '\0') strcpy(dc->dataformat, conf.dataformat);
+		if (dc->server_port == 0) dc->server_port = conf.server_port + i;
+		if (configure_tty_options(&dc->options, dc->baudrate, dc->dataformat) == -1) return -1;
+		if (conf.low_latency) {
+			dc->options.c_cc[VMIN] = conf.vmin;
+			dc->options.c_cc[VTIME] = conf.vtime;
+		}
+	}
+	return 0;
+}
+
+/* parse "default,vmin=1,vtime=0,timer=1,probe" for the low latency serial profile */
+int configure_low_latency(const char *spec) {
+	char buf[255], *tok, *save = NULL;
+	int val;
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		if (!strcmp(tok, "default")) continue;
+		if (!strcmp(tok, "probe")) conf.latency_probe = 1;
+		else if (sscanf(tok, "vmin=%d", &val) == 1 && val >= 0 && val <= 255) conf.vmin = val;
+		else if (sscanf(tok, "vtime=%d", &val) == 1 && val >= 0 && val <= 255) conf.vtime = val;
+		else if (sscanf(tok, "timer=%d", &val) == 1 && val >= 1 && val <= 255) conf.latency_timer = val;
+		else {
+			config_error("Invalid low latency setting \"%s\"", tok);
+			return -1;
+		}
+	}
+	conf.low_latency = 1;
+	return 0;
+}
+
+void print_usage(char *name) {
+	printf( "Nexstar TCP to Serial Daemon version %s\n", VERSION);
+	printf( "This software is intended to be used with libnexstar and NexStarCtl\n"
+		"but it proved to be very useful for exporting all kinds of telescope\n"
+		"mounts on the network like Sky-Watcher, Meade etc. Nexbridge can be\n"
+		"used directly with software like SkySafari or through ttynet or other\n"
+		"serial port emulator with software like Stellarium, to control the\n"
+		"network exported telescopes. (see ttynet)\n\n" );
+	printf( "usage: %s [-dnefRuWxz] [-C ttls] [-O origins] [-S msec] [-g msec] [-D device] [-L profile] [-a address] [-b backlog] [-A workers] [-p port] [-M port] [-m conns] [-P ttydev] [-B baudrate] [-r msgs] [-w dir] [-t timeout] [-c file]\n"
+		"    -c  read the settings from a file first, one 'setting value' per line with\n"
+		"        the long names: debug, foreground, engine, mux, splice, framing,\n"
+		"        address, accept_workers, backlog, baudrate, cache, device, format, gap,\n"
+		"        low_latency, max_conn, metrics_port, port, tty, log_rate, name, poll,\n"
+		"        type, timeout, capture, rfc2217, udp, websocket, origin;\n"
+		"        the command line overrides it and kill -HUP reloads both, sessions of\n"
+		"        unchanged devices stay connected\n"
+		"    -d  log debug information\n"
+		"    -n  do not daemonize, log to stderr\n"
+		"    -z  relay through kernel pipes with splice(), falls back to copying\n"
+		"        if the tty does not support it (not used with -e)\n"
+		"    -f  send each NexStar reply to the client in one TCP segment, with -d the\n"
+		"        command and reply counters are logged at disconnect (takes precedence\n"
+		"        over -z, with -x it only disables Nagle on the client sockets)\n"
+		"        With -f or -x kill -USR1 logs per command latency percentiles, with -x\n"
+		"        clients get them with \"!stats\\n\"\n"
+		#ifdef HAVE_EVLOOP
+		"    -e  serve all connections from a single process event loop, the serial\n"
+		"        port is kept open and reopened if it disappears, a ttynet -M client\n"
+		"        reaches all the devices through one connection\n"
+		"    -R  let clients set the baudrate, data format, flow control, DTR/RTS\n"
+		"        and break and read the modem lines with telnet COM-Port-Control\n"
+		"        (RFC 2217), a session's settings are undone when it closes, the line\n"
+		"        can not be changed while other sessions use the port (implies -e,\n"
+		"        not with -x)\n"
+		"    -x  share the serial port, run each NexStar command as a separate\n"
+		"        transaction and send the reply only to the client that asked, a query\n"
+		"        identical to one already waiting for the tty shares its reply. Stops\n"
+		"        and motion commands go to the tty before queued configuration commands\n"
+		"        and queries, kill -USR1 logs the queueing delay of each class (implies -e)\n"
+		"    -u  also take commands as UDP datagrams on the port of every device, a\n"
+		"        4 byte sequence number and one command, the reply comes back with\n"
+		"        the same number; retransmits get the kept reply and are not run\n"
+		"        again (implies -x)\n"
+		"    -W  also take WebSocket (RFC 6455) upgrades on the port of every device,\n"
+		"        browsers send commands and get the replies in binary frames (implies -e)\n"
+		"    -O  with -W, comma separated origins of other pages which may connect,\n"
+		"        like 'http://host:8080', or '*' for any [default: only pages served by\n"
+		"        the host the browser connects to, on any port]\n"
+		"    -C  cache replies of read-only queries, comma separated cmd=msec list,\n"
+		"        'default' for the built in table, -1 keeps until reconnect (implies -x)\n"
+		"        (e.g. 'default,e=100,J=-1'), kill -USR1 logs the hit/miss counters\n"
+		"    -S  poll position, tracking and goto state every msec and push the samples\n"
+		"        to clients which sent \"!subscribe\\n\" (implies -x)\n"
+		"    -g  wait at least msec after a reply before the next command goes to the\n"
+		"        tty; timeouts and garbled replies make the wait longer and it shrinks\n"
+		"        back after clean runs, kill -USR1 logs it per device [default: 0] (implies -x)\n"
+		"    -D  serve a device, repeat it to serve several from one process, replaces\n"
+		"        -P and -s (implies -e)\n"
+		"        'tty[,baud=9600][,format=8N1][,port=N][,name=svc]', -B and -F are the\n"
+		"        defaults and ports count up from -p (e.g. '/dev/ttyUSB1,port=10000')\n"
+		#endif
+		"    -a  IP addresses to bind to, IPv4 or IPv6, comma separated [default: any,\n"
+		"        IPv4 and IPv6 on one socket where the system has IPv6]\n"
+		"    -b  listen backlog, the connections the kernel holds until they are\n"
+		"        accepted [default: %d]\n"
+		#ifdef SO_REUSEPORT
+		"    -A  open this many SO_REUSEPORT listeners on every address, each with its\n"
+		"        own accept queue; without -e each is drained by an accept thread of its\n"
+		"        own, with -e the event loop drains them all [default: 1]\n"
+		#endif
+		"    -m  maximum simultaneous connections [default: 1]\n"
+		"        Allowing More than one connection is not advisable without -x!\n"
+		"    -p  TCP port to bind to [default: %d]\n"
+		"    -M  serve Prometheus metrics on this TCP port at /metrics [default: off]\n"
+		#ifdef HAVE_MDNS
+		"    -s  Bonjour service name, if not specified no service will published\n"
+		"    -T  Bonjour service type [default: '_nexbridge'}\n"
+		#endif
+		"    -P  Serial port to connect to telescope [default: %s]\n"
+		"    -B  baudrate (1200, 2400, 4800, 460800 etc) [default: %s]\n"
+		"    -F  serial data format, databits/parity/stopbits (8N1, 7E2 etc) [default: %s]\n"
+		"    -L  low latency serial profile: no O_SYNC, ASYNC_LOW_LATENCY, and the given\n"
+		"        settings, 'default' or a list like 'vmin=1,vtime=0,timer=1' where timer\n"
+		"        is the FTDI latency timer in msec [default: vmin=1,vtime=0], 'probe'\n"
+		"        logs the round-trip of the NexStar echo command at startup, it is sent\n"
+		"        to the tty, so only use it with a mount (implied by -x)\n"
+		"    -w  record the traffic of every session with nsec timestamps into a file\n"
+		"        in this directory, nbreplay plays it back (turns -z off)\n"
+		"    -r  log at most this many messages per second, the rest are counted and\n"
+		"        the counts logged [default: 0, no limit]\n"
+		"    -t  session timeout in seconds (0 for no timeout) [default: %d]\n"
+		"    -v  print version\n"
+		"    -h  print this help message\n\n",
+		name, BACKLOG, PORT, TTY_PORT, BAUDRATE, DATA_FORMAT, SESS_TIMEOUT);
+	printf( " Copyright (c)2014-2016 by Rumen Bogdanovski\n\n");
+}
+
+
+/* apply one command line option, the config file goes through here too */
+int set_option(int c, char *optarg, char *name) {
+	switch(c){
+	case 'B':
+		snprintf(conf.baudrate,15,"%s", optarg);
+		LOG_DBG("baudrate = %s", conf.baudrate);
+		break;
+	case 'F':
+		snprintf(conf.dataformat,15,"%s", optarg);
+		LOG_DBG("dataformat = %s", conf.dataformat);
+		break;
+	case 'a':
+		snprintf(conf.address,255,"%s", optarg);
+		LOG_DBG("address = %s", conf.address);
+		break;
+	case 'p':
+		conf.server_port = atoi(optarg);
+		LOG_DBG("server_port = %d", conf.server_port);
+		break;
+	case 'P':
+		snprintf(conf.tty_port,255,"%s", optarg);
+		LOG_DBG("tty_port = %s", conf.tty_port);
+		break;
+	case 'D':
+		if (configure_device(optarg) < 0) return -1;
+		conf.engine = 1;
+		LOG_DBG("device = %s", optarg);
+		break;
+	case 's':
+		snprintf(conf.svc_name,255,"%s", optarg);
+		LOG_DBG("svc_name = %s", conf.svc_name);
+		break;
+	case 'T':
+		if (optarg[0] == '_')  // service type should start with '_' if not given add it
+			snprintf(conf.svc_type,255,"%s.%s", optarg,SVC_PROTO);
+		else
+			snprintf(conf.svc_type,255,"_%s.%s", optarg,SVC_PROTO);
+		LOG_DBG("svc_type = %s", conf.svc_type);
+		break;
+	case 't':
+		conf.timeout = atoi(optarg);
+		LOG_DBG("timeout = %d", conf.timeout);
+		break;
+	case 'm':
+		conf.max_conn = atoi(optarg);
+		LOG_DBG("max_conn = %d", conf.max_conn);
+		break;
+	case 'b':
+		conf.backlog = atoi(optarg);
+		LOG_DBG("backlog = %d", conf.backlog);
+		break;
+	case 'A':
+		conf.shards = atoi(optarg);
+		LOG_DBG("accept_workers = %d", conf.shards);
+		break;
+	case 'r':
+		conf.log_rate = atoi(optarg);
+		LOG_DBG("log_rate = %d", conf.log_rate);
+		break;
+	case 'w':
+		snprintf(conf.capture_dir, sizeof(conf.capture_dir), "%s", optarg);
+		LOG_DBG("capture_dir = %s", conf.capture_dir);
+		break;
+	case 'd':
+		log_mask(LOG_UPTO (LOG_DEBUG));
+		break;
+	case 'n':
+		conf.is_daemon=0;
+		break;
+	case 'z':
+		conf.splice = 1;
+		break;
+	case 'f':
+		conf.framing = 1;
+		break;
+	case 'M':
+		conf.metrics_port = atoi(optarg);
+		LOG_DBG("metrics_port = %d", conf.metrics_port);
+		break;
+	case 'e':
+		conf.engine = 1;
+		break;
+	case 'x':
+		conf.engine = 1;
+		conf.mux = 1;
+		break;
+	case 'R':
+		conf.engine = 1;
+		conf.rfc2217 = 1;
+		break;
+	case 'u':
+		conf.engine = 1;
+		conf.mux = 1;
+		conf.udp = 1;
+		break;
+	case 'W':
+		conf.engine = 1;
+		conf.websocket = 1;
+		break;
+	case 'O':
+		snprintf(conf.ws_origins, sizeof(conf.ws_origins), "%s", optarg);
+		LOG_DBG("ws_origins = %s", conf.ws_origins);
+		break;
+	case 'C':
+		if (cache_config(optarg, 0) < 0) return -1;
+		snprintf(conf.cache_ttl, sizeof(conf.cache_ttl), "%s", optarg);
+		conf.engine = 1;
+		conf.mux = 1;
+		conf.cache = 1;
+		LOG_DBG("cache = %s", optarg);
+		break;
+	case 'L':
+		if (configure_low_latency(optarg) < 0) return -1;
+		LOG_DBG("low_latency = %s", optarg);
+		break;
+	case 'S':
+		conf.poll_interval = atoi(optarg);
+		conf.engine = 1;
+		conf.mux = 1;
+		LOG_DBG("poll_interval = %d", conf.poll_interval);
+		break;
+	case 'g':
+		conf.gap = atoi(optarg);
+		conf.engine = 1;
+		conf.mux = 1;
+		LOG_DBG("gap = %d", conf.gap);
+		break;
+	case 'c':
+		break;  /* read before the other options */
+	case 'h':
+		print_usage(name);
+		exit(1);
+	case 'v':
+		printf("%s version %s\n", name, VERSION);
+		exit(1);
+	case '?':
+	default:
+		printf("for help: %s -h\n", name);
+		return -1;
+	}
+	return 0;
+
+}
+
+/*
+ * the -a list into bl, IPv4 and IPv6 addresses, [] around IPv6 ones are
+ * fine. An empty list is "::" taking IPv4 too, or 0.0.0.0 without IPv6.
+ */
+int parse_addresses(const char *list, bind_list *bl) {
+	char buf[sizeof(conf.address)], *a, *save;
+	struct sockaddr_in *sin;
+	struct sockaddr_in6 *sin6;
+	int fd;
+
+	memset(bl, 0, sizeof(*bl));
+	if (list[0] == '\0') {
+		if ((fd = socket(AF_INET6, SOCK_STREAM, 0)) < 0) {
+			list = "0.0.0.0";
+		} else {
+			close(fd);
+			list = "::";
+		}
+	}
+	snprintf(buf, sizeof(buf), "%s", list);
+	for (a = strtok_r(buf, ", ", &save); a; a = strtok_r(NULL, ", ", &save)) {
+		if (bl->count == ADDRS_MAX) {
+			config_error("At most %d addresses can be given.", ADDRS_MAX);
+			return -1;
+		}
+		if (a[0] == '[') {
+			a++;
+			a[strcspn(a, "]")] = '\0';
+		}
+		sin = (struct sockaddr_in *)&bl->addr[bl->count];
+		sin6 = (struct sockaddr_in6 *)&bl->addr[bl->count];
+		if (inet_pton(AF_INET, a, &sin->sin_addr) == 1) {
+			sin->sin_family = AF_INET;
+			bl->len[bl->count] = sizeof(*sin);
+			bl->v6only = 1;
+		} else if (inet_pton(AF_INET6, a, &sin6->sin6_addr) == 1) {
+			sin6->sin6_family = AF_INET6;
+			bl->len[bl->count] = sizeof(*sin6);
+		} else {
+			config_error("Bad address: %s", a);
+			return -1;
+		}
+		bl->count++;
+	}
+	if (bl->count == 0) {
+		config_error("Bad address: %s", list);
+		return -1;
+	}
+	return 0;
+}
+
+/* validate conf and derive the tty options and the device list */
+int check_config(bind_list *bl) {
+	if (parse_addresses(conf.address, bl) < 0) return -1;
+
+	if (conf.max_conn < 1) {
+		config_error("Number of connections should be a positive number.");
+		return -1;
+	}
+
+	if (conf.backlog < 1) {
+		config_error("Listen backlog should be a positive number.");
+		return -1;
+	}
+
+#ifdef SO_REUSEPORT
+	if (conf.shards < 1 || conf.shards > SHARDS_MAX) {
+		config_error("Accept workers should be between 1 and %d.", SHARDS_MAX);
+		return -1;
+	}
+#else
+	if (conf.shards != 1) {
+		config_error("Accept workers need SO_REUSEPORT, which this system does not have.");
+		return -1;
+	}
+#endif
+
+	if (conf.poll_interval < 0) {
+		config_error("Poll interval should be a positive number.");
+		return -1;
+	}
+
+	if (conf.gap < 0) {
+		config_error("Command gap should be a positive number, use 0 for none.");
+		return -1;
+	}
+
+	if (conf.log_rate < 0) {
+		config_error("Log rate should be a positive number, use 0 for no limit.");
+		return -1;
+	}
+
+	if (conf.rfc2217 && conf.mux) {
+		config_error("RFC 2217 line control can not be used with a shared port (-x, -C or -S).");
+		return -1;
+	}
+
+	if (conf.capture_dir[0] && access(conf.capture_dir, W_OK) < 0) {
+		config_error("Can not write captures to %s: %s", conf.capture_dir, strerror(errno));
+		return -1;
+	}
+
+	if (conf.timeout < 0) {
+		config_error("Timeout should be a positive number, use 0 for no timeout.");
+		return -1;
+	}
+
+	if ((conf.server_port < 0) || (conf.server_port > 65535)) {
+		config_error("Server port is out of range.");
+		return -1;
+	}
+
+	if (configure_tty_options(&conf.options, conf.baudrate, conf.dataformat) == -1) {
+		return -1;
+	}
+	conf.stock_options = conf.options;
+	if (conf.low_latency) {
+		conf.options.c_cc[VMIN] = conf.vmin;
+		conf.options.c_cc[VTIME] = conf.vtime;
+	}
+	if (configure_devices() < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/* config file settings are the long names of the options */
+static const struct {
+	const char *key;
+	int opt;
+	int has_arg;
+} config_keys[] = {
+	{ "debug", 'd', 0 }, { "foreground", 'n', 0 }, { "engine", 'e', 0 },
+	{ "mux", 'x', 0 }, { "splice", 'z', 0 }, { "framing", 'f', 0 },
+	{ "rfc2217", 'R', 0 }, { "udp", 'u', 0 }, { "websocket", 'W', 0 },
+	{ "address", 'a', 1 }, { "accept_workers", 'A', 1 }, { "backlog", 'b', 1 },
+	{ "baudrate", 'B', 1 }, { "cache", 'C', 1 }, { "device", 'D', 1 }, { "format", 'F', 1 },
+	{ "gap", 'g', 1 }, { "low_latency", 'L', 1 }, { "max_conn", 'm', 1 },
+	{ "metrics_port", 'M', 1 }, { "origin", 'O', 1 }, { "port", 'p', 1 },
+	{ "tty", 'P', 1 }, { "log_rate", 'r', 1 }, { "name", 's', 1 }, { "poll", 'S', 1 },
+	{ "type", 'T', 1 }, { "timeout", 't', 1 }, { "capture", 'w', 1 },
+	{ NULL, 0, 0 }
+};
+
+/* "key value" lines, '#' starts a comment, flags take an optional yes/no */
+int load_config_file(const char *path) {
+	char line[1024], *key, *val, *end;
+	FILE *f;
+	int i, n = 0, rc = 0;
+
+	if ((f = fopen(path, "r")) == NULL) {
+		config_error("Can not open %s: %s", path, strerror(errno));
+		return -1;
+	}
+	while (rc == 0 && fgets(line, sizeof(line), f)) {
+		n++;
+		if ((end = strchr(line, '#'))) *end = '\0';
+		key = line + strspn(line, " \t");
+		val = key + strcspn(key, " \t=\r\n");
+		if (val == key) continue;
+		if (*val) *val++ = '\0';
+		val += strspn(val, " \t=");
+		end = val + strlen(val);
+		while (end > val && strchr(" \t\r\n", end[-1])) *--end = '\0';
+
+		for (i = 0; config_keys[i].key && strcmp(config_keys[i].key, key); i++);
+		if (config_keys[i].key == NULL) {
+			config_error("%s:%d: unknown setting \"%s\"", path, n, key);
+			rc = -1;
+		} else if (config_keys[i].has_arg && *val == '\0') {
+			config_error("%s:%d: %s needs a value", path, n, key);
+			rc = -1;
+		} else if (!config_keys[i].has_arg) {
+			if (*val == '\0' || !strcmp(val, "yes") || !strcmp(val, "on") ||
+			    !strcmp(val, "true") || !strcmp(val, "1")) {
+				set_option(config_keys[i].opt, NULL, (char *)path);
+			} else if (strcmp(val, "no") && strcmp(val, "off") &&
+			           strcmp(val, "false") && strcmp(val, "0")) {
+				config_error("%s:%d: %s is yes or no", path, n, key);
+				rc = -1;
+			}
+		} else if (set_option(config_keys[i].opt, val, (char *)path) < 0) {
+			config_error("%s:%d: invalid %s", path, n, key);
+			rc = -1;
+		}
+	}
+	fclose(f);
+	return rc;
+}
+
+void config_args(int argc, char **argv) {
+	saved_argc = argc;
+	saved_argv = argv;
+}
+
+/* the config file first, then the command line overrides it */
+int read_config() {
+	int c;
+
+	if (config_file[0] == '\0') {
+		opterr = 0;
+		optind = 1;
+		while ((c = getopt(saved_argc, saved_argv, OPTIONS)) != -1) {
+			if (c != 'c') continue;
+			if (realpath(optarg, config_file) == NULL) {
+				config_error("Can not open %s: %s", optarg, strerror(errno));
+				return -1;
+			}
+		}
+		opterr = 1;
+	}
+	if (config_file[0] && load_config_file(config_file) < 0) return -1;
+	optind = 1;
+	while ((c = getopt(saved_argc, saved_argv, OPTIONS)) != -1) {
+		if (set_option(c, optarg, saved_argv[0]) < 0) return -1;
+	}
+	return 0;
+}
+
+/* settings the running daemon can not switch stay until a restart */
+void keep_restart_settings(const config *old) {
+	#define KEEP(field, key) \
+		if (conf.field != old->field) { \
+			LOG("Changing %s needs a restart", key); \
+			conf.field = old->field; \
+		}
+	KEEP(is_daemon, "foreground");
+	KEEP(engine, "engine");
+	KEEP(mux, "mux");
+	KEEP(udp, "udp");
+	KEEP(cache, "cache");
+	KEEP(metrics_port, "metrics_port");
+	KEEP(shards, "accept_workers");
+	#undef KEEP
+	if ((conf.poll_interval == 0) != (old->poll_interval == 0)) {
+		LOG("Changing poll needs a restart");
+		conf.poll_interval = old->poll_interval;
+	}
+	if (strcmp(conf.address, old->address)) {
+		LOG("Changing address needs a restart");
+		strcpy(conf.address, old->address);
+	}
+}
@@ -0,0 +1,37 @@
+#ifndef __OPTIONS_H__
+#define __OPTIONS_H__
+
+#include <termios.h>
+
+#include "nexbridge.h"
+
+/* the -c file with its full path, empty without one */
+extern char config_file[];
+
+/* conf before any option */
+void config_defaults();
+/* "8N1" at baudrate into options, -1 if either is bad */
+int configure_tty_options(struct termios *options, const char *baudrate, const char *mode);
+/* parse "tty[,baud=9600][,format=8N1][,port=9999][,name=svc]" of a -D device */
+int configure_device(const char *spec);
+/* the tty options of the -D devices, -P is the device of the engine without -D */
+int configure_devices();
+/* parse "default,vmin=1,vtime=0,timer=1,probe" of -L */
+int configure_low_latency(const char *spec);
+void print_usage(char *name);
+/* apply one command line option, the config file goes through here too */
+int set_option(int c, char *optarg, char *name);
+/* the -a list into bl, -1 if an address is bad or there are too many */
+int parse_addresses(const char *list, bind_list *bl);
+/* validate conf and derive the tty options and the device list */
+int check_config(bind_list *bl);
+/* "key value" lines, '#' starts a comment, flags take an optional yes/no */
+int load_config_file(const char *path);
+/* the command line read_config() parses, kept for the reloads */
+void config_args(int argc, char **argv);
+/* the config file first, then the command line overrides it */
+int read_config();
+/* settings the running daemon can not switch are put back to old */
+void keep_restart_settings(const config *old);
+
+#endif /*__OPTIONS_H__*/
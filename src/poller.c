@@ -0,0 +1,113 @@
+/**************************************************************
+        poller - one telemetry poll loop per device, samples
+        are fanned out to all subscribed sessions
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "nexbridge.h"
+#include "mux.h"
+#include "poller.h"
+
+#ifdef HAVE_EVLOOP
+
+static const char *poll_cmds[POLL_QUERIES] = { "e", "z", "t", "L" };
+
+static void poll_round(ev_timer *timer);
+
+/* reply without '#', binary tracking mode as a number, '?' if incomplete */
+static int format_field(char *buf, size_t size, int i, transaction *t) {
+	if (!nex_reply_complete(t->cmd, t->cmd_len, t->reply, t->reply_len) ||
+	    t->reply[t->reply_len - 1] != NEX_TERMINATOR)
+		return snprintf(buf, size, "?");
+	if (poll_cmds[i][0] == 't') return snprintf(buf, size, "%d", (unsigned char)t->reply[0]);
+	return snprintf(buf, size, "%.*s", t->reply_len - 1, t->reply);
+}
+
+static void publish(device *dev) {
+	char line[256];
+	struct timeval tv;
+	session *s, *next;
+	int i, len;
+
+	gettimeofday(&tv, NULL);
+	len = snprintf(line, sizeof(line), "!T %llu", (unsigned long long)tv.tv_sec * 1000 + tv.tv_usec / 1000);
+	for (i = 0; i < POLL_QUERIES; i++) {
+		len += snprintf(line + len, sizeof(line) - len, " %c=%s", poll_cmds[i][0], dev->poll_sample[i]);
+	}
+	len += snprintf(line + len, sizeof(line) - len, "\n");
+
+	for (s = dev->sessions; s; s = next) {
+		next = s->next;
+		if (!s->subscribed) continue;
+		if (session_send(s, line, len) < 0) session_close(s);
+	}
+	dev->poll_samples++;
+}
+
+/* t is NULL if the query could not be sent */
+static void poll_field_done(device *dev, int i, transaction *t) {
+	uint64_t elapsed;
+
+	if (t) format_field(dev->poll_sample[i], sizeof(dev->poll_sample[i]), i, t);
+	else snprintf(dev->poll_sample[i], sizeof(dev->poll_sample[i]), "?");
+	if (--dev->poll_outstanding) return;
+
+	publish(dev);
+	if (dev->subscribers == 0) return;
+	/* keep the rate, a slow round starts the next one right away */
+	elapsed = ev_now() - dev->poll_started;
+	ev_timer_set(&dev->poll_timer, (elapsed < conf.poll_interval) ? conf.poll_interval - elapsed : 0,
+	             poll_round, dev);
+}
+
+static void poll_done(device *dev, transaction *t) {
+	poll_field_done(dev, (int)(long)t->data, t);
+}
+
+static void poll_round(ev_timer *timer) {
+	device *dev = timer->data;
+	int i;
+
+	if (dev->subscribers == 0 || dev->poll_outstanding) return;
+	dev->poll_started = ev_now();
+	dev->poll_outstanding = POLL_QUERIES;
+	for (i = 0; i < POLL_QUERIES; i++) {
+		/* while the tty is away subscribers keep getting samples full of '?' */
+		if (mux_submit(dev, poll_cmds[i], strlen(poll_cmds[i]), poll_done, (void *)(long)i) < 0)
+			poll_field_done(dev, i, NULL);
+	}
+}
+
+void poller_subscribe(session *s) {
+	device *dev = s->dev;
+
+	if (s->subscribed) return;
+	s->subscribed = 1;
+	if (dev->subscribers++ == 0) {
+		LOG("Telemetry polling of %s started, every %d ms", dev->tty_port, conf.poll_interval);
+		ev_timer_set(&dev->poll_timer, 0, poll_round, dev);
+	}
+}
+
+void poller_unsubscribe(session *s) {
+	device *dev = s->dev;
+
+	if (!s->subscribed) return;
+	s->subscribed = 0;
+	if (--dev->subscribers == 0) {
+		LOG("Telemetry polling of %s stopped", dev->tty_port);
+		ev_timer_cancel(&dev->poll_timer);
+	}
+}
+
+void poller_dump(device *dev) {
+	LOG("Poller %s: interval=%d subscribers=%d samples=%lu", dev->tty_port,
+	    conf.poll_interval, dev->subscribers, dev->poll_samples);
+}
+
+#endif /* HAVE_EVLOOP */
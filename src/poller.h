@@ -0,0 +1,19 @@
+#ifndef __POLLER_H__
+#define __POLLER_H__
+
+#include "engine.h"
+
+/*
+ * Telemetry poller: while a device has subscribers it queries position,
+ * tracking mode and goto state every conf.poll_interval msec and pushes
+ * one line per sample to every subscribed session:
+ *
+ *   !T <unix msec> e=<RA,Dec> z=<Azm,Alt> t=<tracking mode> L=<0|1>
+ *
+ * fields the mount did not answer are sent as '?'.
+ */
+void poller_subscribe(session *s);
+void poller_unsubscribe(session *s);
+void poller_dump(device *dev);
+
+#endif /*__POLLER_H__*/
@@ -0,0 +1,350 @@
+/**************************************************************
+        relay - move bytes between the tty and the socket,
+        with read()/write() or zero-copy with splice()
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "config.h"
+#include "relay.h"
+#include "nexstar.h"
+
+#define BUFSIZZ 1024
+#define PIPE_CHUNK 65536
+#define FRAME_PENDING 32   /* commands waiting for a reply */
+
+static const char *errs[2][2] = {
+	{ "read(fd1)", "write(fd2)" },
+	{ "read(fd2)", "write(fd1)" }
+};
+
+static int write_all(int fd, const char *buf, int len) {
+	int r, done = 0;
+
+	while (done < len) {
+		r = write(fd, buf + done, len - done);
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR) continue;
+			return -1;
+		}
+		done += r;
+	}
+	return done;
+}
+
+/* one read()/write() round in direction dir, returns bytes moved, 0 on EOF */
+static int copy_once(int from, int to, int dir, relay_state *st) {
+	char buf[BUFSIZZ];
+	int r;
+
+	r = read(from, buf, BUFSIZZ-1);
+	if (r <= 0) {
+		if (r < 0) st->error = errs[dir][0];
+		return r;
+	}
+	if (write_all(to, buf, r) < 0) {
+		st->error = errs[dir][1];
+		return -1;
+	}
+	capture_write(st->cap, dir, buf, r);
+	st->bytes[dir] += r;
+	return r;
+}
+
+/* -1 without st->error if st->stop was set. The capture is flushed every
+   CAPTURE_FLUSH_SEC while waiting. */
+static int wait_readable_timeout(int fd1, int fd2, fd_set *readset, int msec, relay_state *st) {
+	struct timeval tv;
+	int r, wait, max = (fd1 > fd2) ? fd1 : fd2;
+
+	while (1) {
+		if (st->stop && *st->stop) return -1;
+		wait = msec;
+		if (st->cap && (wait < 0 || wait > CAPTURE_FLUSH_SEC * 1000)) wait = CAPTURE_FLUSH_SEC * 1000;
+		FD_ZERO(readset);
+		FD_SET(fd1, readset);
+		FD_SET(fd2, readset);
+		tv.tv_sec = wait / 1000;
+		tv.tv_usec = (wait % 1000) * 1000;
+		r = select(max + 1, readset, NULL, NULL, (wait < 0) ? NULL : &tv);
+		if (r == -1 && errno == EINTR) continue;
+		if (r == 0 && wait != msec) {
+			capture_flush(st->cap);
+			continue;
+		}
+		return r;
+	}
+}
+
+static int wait_readable(int fd1, int fd2, fd_set *readset, relay_state *st) {
+	return wait_readable_timeout(fd1, fd2, readset, -1, st);
+}
+
+int relay_copy(int fd1, int fd2, relay_state *st) {
+	fd_set readset;
+
+	while (1) {
+		if (wait_readable(fd1, fd2, &readset, st) < 0) return -1;
+		if (FD_ISSET(fd1, &readset) && copy_once(fd1, fd2, 0, st) <= 0) break;
+		if (FD_ISSET(fd2, &readset) && copy_once(fd2, fd1, 1, st) <= 0) break;
+	}
+	return st->error ? -1 : 0;
+}
+
+static uint64_t now_usec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+typedef struct {
+	char cmd[FRAME_PENDING][NEX_CMD_MAX];
+	int len[FRAME_PENDING];
+	uint64_t stamp[FRAME_PENDING][3];
+	int head, count;
+	char in[NEX_CMD_MAX];      /* incomplete command from the client */
+	int in_len;
+	char out[NEX_REPLY_MAX * 4];
+	int out_len;
+} framer;
+
+/* forward client data to the tty as it comes, remember the commands it carries */
+static int frame_commands(framer *f, int from, int to, relay_state *st) {
+	char buf[BUFSIZZ];
+	int r, n, off = 0, slot;
+	uint64_t arrived, written;
+
+	r = read(from, buf, BUFSIZZ);
+	if (r <= 0) {
+		if (r < 0) st->error = errs[1][0];
+		return r;
+	}
+	arrived = now_usec();
+	if (write_all(to, buf, r) < 0) {
+		st->error = errs[1][1];
+		return -1;
+	}
+	written = now_usec();
+	capture_write(st->cap, CAPTURE_TO_TTY, buf, r);
+	st->bytes[1] += r;
+
+	while (off < r) {
+		n = (r - off < NEX_CMD_MAX - f->in_len) ? r - off : NEX_CMD_MAX - f->in_len;
+		memcpy(f->in + f->in_len, buf + off, n);
+		f->in_len += n;
+		off += n;
+		while ((n = nex_command_len(f->in, f->in_len)) > 0) {
+			if (f->count == FRAME_PENDING) { /* no replies, forget the oldest */
+				f->head = (f->head + 1) % FRAME_PENDING;
+				f->count--;
+			}
+			slot = (f->head + f->count++) % FRAME_PENDING;
+			memcpy(f->cmd[slot], f->in, n);
+			f->len[slot] = n;
+			f->stamp[slot][0] = arrived;
+			f->stamp[slot][1] = written;
+			st->frames[1]++;
+			f->in_len -= n;
+			memmove(f->in, f->in + n, f->in_len);
+		}
+	}
+	return r;
+}
+
+/* length of the complete reply at the start of buf, 0 if it is not complete yet */
+static int reply_frame_len(framer *f, const char *buf, int len) {
+	const char *end;
+	int n = -1;
+
+	if (f->count) n = nex_reply_len(f->cmd[f->head], f->len[f->head]);
+	if (n > 0) return (len >= n) ? n : 0;
+	end = memchr(buf, NEX_TERMINATOR, len);
+	return end ? end - buf + 1 : 0;
+}
+
+/* send len bytes of out to the client in one segment */
+static int frame_flush(framer *f, int to, int len, relay_state *st) {
+	if (len <= 0) return 0;
+	if (write_all(to, f->out, len) < 0) {
+		st->error = errs[0][1];
+		return -1;
+	}
+	st->bytes[0] += len;
+	f->out_len -= len;
+	memmove(f->out, f->out + len, f->out_len);
+	return 0;
+}
+
+static int frame_replies(framer *f, int from, int to, relay_state *st) {
+	int r, n, ready = 0;
+
+	r = read(from, f->out + f->out_len, sizeof(f->out) - f->out_len);
+	if (r <= 0) {
+		if (r < 0) st->error = errs[0][0];
+		return r;
+	}
+	capture_write(st->cap, CAPTURE_TO_CLIENT, f->out + f->out_len, r);
+	f->out_len += r;
+
+	/* collect every reply completed by this read and send them together */
+	while (ready < f->out_len) {
+		n = reply_frame_len(f, f->out + ready, f->out_len - ready);
+		if (n == 0) break;
+		ready += n;
+		st->frames[0]++;
+		if (f->count && st->reply_done) {
+			f->stamp[f->head][2] = now_usec();
+			st->reply_done(f->cmd[f->head][0], f->stamp[f->head], st->data);
+		}
+		if (f->count) {
+			f->head = (f->head + 1) % FRAME_PENDING;
+			f->count--;
+		}
+	}
+	if (ready == 0 && f->out_len == sizeof(f->out)) { /* not NexStar, do not stall */
+		st->partial++;
+		ready = f->out_len;
+	}
+	if (frame_flush(f, to, ready, st) < 0) return -1;
+	return r;
+}
+
+int relay_framed(int fd1, int fd2, relay_state *st) {
+	framer *f;
+	fd_set readset;
+	int r, val = 1;
+
+	f = calloc(1, sizeof(framer));
+	if (f == NULL) return RELAY_UNSUPPORTED;
+	setsockopt(fd2, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+
+	while (1) {
+		r = wait_readable_timeout(fd1, fd2, &readset, f->out_len ? RELAY_FRAME_WAIT : -1, st);
+		if (r < 0) break;
+		if (r == 0) { /* the rest of the reply is not coming */
+			st->partial++;
+			if (f->count) {
+				f->head = (f->head + 1) % FRAME_PENDING;
+				f->count--;
+			}
+			if (frame_flush(f, fd2, f->out_len, st) < 0) break;
+			continue;
+		}
+		if (FD_ISSET(fd1, &readset) && frame_replies(f, fd1, fd2, st) <= 0) break;
+		if (FD_ISSET(fd2, &readset) && frame_commands(f, fd2, fd1, st) <= 0) break;
+	}
+	if (f->out_len) frame_flush(f, fd2, f->out_len, st);
+	free(f);
+	return st->error ? -1 : 0;
+}
+
+#ifdef HAVE_SPLICE
+
+/* empty what is left in the pipe the old way, used when "to" can not splice.
+   Returns the bytes written, less than len on failure. */
+static int drain_pipe(int pipe_out, int to, int len) {
+	char buf[BUFSIZZ];
+	int r, done = 0;
+
+	while (done < len) {
+		r = read(pipe_out, buf, (len - done < BUFSIZZ) ? len - done : BUFSIZZ);
+		if (r <= 0) break;
+		if (write_all(to, buf, r) < 0) break;
+		done += r;
+	}
+	return done;
+}
+
+/* one splice round in direction dir, returns bytes moved, 0 on EOF */
+static int splice_once(int from, int to, int pipefd[2], int dir, relay_state *st) {
+	int r, w, left;
+
+	r = splice(from, NULL, pipefd[1], NULL, PIPE_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (r < 0 && errno == EINVAL) return RELAY_UNSUPPORTED; /* nothing was consumed */
+	if (r <= 0) {
+		if (r < 0) st->error = errs[dir][0];
+		return r;
+	}
+
+	for (left = r; left > 0; left -= w) {
+		w = splice(pipefd[0], NULL, to, NULL, left, SPLICE_F_MOVE);
+		if (w < 0 && errno == EINVAL) {
+			w = drain_pipe(pipefd[0], to, left);
+			st->bytes[dir] += w;
+			left -= w;
+			break;
+		}
+		if (w <= 0) break;
+		st->bytes[dir] += w;
+	}
+	if (left > 0) {
+		st->error = errs[dir][1];
+		return -1;
+	}
+	return r;
+}
+
+int relay_splice(int fd1, int fd2, relay_state *st) {
+	int fds[2] = { fd1, fd2 };
+	int pipes[2][2];
+	fd_set readset;
+	int dir, r = 0;
+
+	if (pipe(pipes[0]) < 0) return RELAY_UNSUPPORTED;
+	if (pipe(pipes[1]) < 0) {
+		close(pipes[0][0]);
+		close(pipes[0][1]);
+		return RELAY_UNSUPPORTED;
+	}
+	st->spliced[0] = st->spliced[1] = 1;
+
+	while (r >= 0) {
+		if (wait_readable(fd1, fd2, &readset, st) < 0) {
+			r = -1;
+			break;
+		}
+		for (dir = 0; dir < 2; dir++) {
+			if (!FD_ISSET(fds[dir], &readset)) continue;
+			if (st->spliced[dir]) {
+				r = splice_once(fds[dir], fds[1 - dir], pipes[dir], dir, st);
+				if (r == RELAY_UNSUPPORTED) {
+					st->spliced[dir] = 0;
+					r = copy_once(fds[dir], fds[1 - dir], dir, st);
+				}
+			} else {
+				r = copy_once(fds[dir], fds[1 - dir], dir, st);
+			}
+			if (r <= 0) {
+				r = -1;
+				break;
+			}
+		}
+	}
+
+	close(pipes[0][0]);
+	close(pipes[0][1]);
+	close(pipes[1][0]);
+	close(pipes[1][1]);
+	return st->error ? -1 : 0;
+}
+
+#else /* HAVE_SPLICE */
+
+int relay_splice(int fd1, int fd2, relay_state *st) {
+	return RELAY_UNSUPPORTED;
+}
+
+#endif /* HAVE_SPLICE */
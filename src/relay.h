@@ -0,0 +1,43 @@
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+#include <stdint.h>
+#include <signal.h>
+
+#include "capture.h"
+
+#define RELAY_UNSUPPORTED -2
+
+typedef struct {
+	unsigned long long bytes[2];  /* [0] fd1 -> fd2, [1] fd2 -> fd1 */
+	int spliced[2];               /* direction went through kernel pipes */
+	unsigned long frames[2];      /* framed relay: [0] replies, [1] commands */
+	unsigned long partial;        /* replies sent before they were complete */
+	/* framed relay: called for every complete reply, stamp[] is arrived, written, done in usec */
+	void (*reply_done)(unsigned char cmd, const uint64_t stamp[3], void *data);
+	void *data;
+	capture *cap;                 /* records both directions if set, not spliced */
+	const char *error;            /* the call that failed, errno says why */
+	volatile sig_atomic_t *stop;  /* set by a signal handler, the relay returns */
+} relay_state;
+
+/*
+ * Relay data between fd1 and fd2 until one side closes. Both return 0 on
+ * EOF and -1 on error. relay_splice() moves the data through pipes with
+ * splice(2), a direction whose fds do not support it falls back to copying.
+ * It returns RELAY_UNSUPPORTED if splice() is not available at all.
+ */
+int relay_copy(int fd1, int fd2, relay_state *st);
+int relay_splice(int fd1, int fd2, relay_state *st);
+
+/*
+ * Like relay_copy() but fd1 is the tty and fd2 the client socket. Replies
+ * from the tty are held until they are complete for the command that asked
+ * and then sent with one write on a TCP_NODELAY socket, so the client gets
+ * one segment per reply. Data that does not complete within RELAY_FRAME_WAIT
+ * msec is sent as it is.
+ */
+#define RELAY_FRAME_WAIT 100
+int relay_framed(int fd1, int fd2, relay_state *st);
+
+#endif /*__RELAY_H__*/
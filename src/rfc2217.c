@@ -0,0 +1,487 @@
+/**************************************************************
+        rfc2217 - telnet COM-Port-Control, the client sets the
+        line and the modem control lines of the tty
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#include <sys/ioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <termios.h>
+
+#include "config.h"
+#include "nexbridge.h"
+#include "rfc2217.h"
+
+#ifdef HAVE_EVLOOP
+
+#define BUFSIZZ 1024
+#define SB_MAX 64
+#define MODEM_POLL 1000   /* msec between looks at the modem lines */
+
+/* telnet */
+#define SE    240
+#define SB    250
+#define WILL  251
+#define WONT  252
+#define DO    253
+#define DONT  254
+#define IAC   255
+
+#define OPT_BINARY   0
+#define OPT_SGA      3
+#define OPT_COMPORT  44
+
+/* COM-PORT-OPTION commands of the client, the bridge answers with +100 */
+enum {
+	CPC_SIGNATURE,
+	CPC_SET_BAUDRATE,
+	CPC_SET_DATASIZE,
+	CPC_SET_PARITY,
+	CPC_SET_STOPSIZE,
+	CPC_SET_CONTROL,
+	CPC_NOTIFY_LINESTATE,
+	CPC_NOTIFY_MODEMSTATE,
+	CPC_FLOWCONTROL_SUSPEND,
+	CPC_FLOWCONTROL_RESUME,
+	CPC_SET_LINESTATE_MASK,
+	CPC_SET_MODEMSTATE_MASK,
+	CPC_PURGE_DATA
+};
+#define CPC_REPLY 100
+
+/* modem state bits, the low nibble flags the changes */
+#define MS_CTS 0x10
+#define MS_DSR 0x20
+#define MS_RI  0x40
+#define MS_CD  0x80
+
+enum { TS_DATA, TS_IAC, TS_OPT, TS_SB, TS_SB_IAC };
+
+struct telnet {
+	int state;
+	int verb;               /* WILL, WONT, DO or DONT waiting for its option */
+	unsigned char sb[SB_MAX];  /* subnegotiation being received */
+	int sb_len;
+	int negotiated;         /* the client sent a telnet command, its data is escaped */
+	int comport;            /* the client enabled COM-PORT-OPTION */
+	int binary[2];          /* TRANSMIT-BINARY [0] by the bridge, [1] by the client */
+	int sga[2];             /* SUPPRESS-GO-AHEAD, same order */
+	int changed;            /* line is not the device setting */
+	int brk;                /* break is on */
+	struct termios line;    /* tty settings as the client set them */
+	unsigned char line_mask;
+	unsigned char modem_mask;
+	unsigned char modem;    /* last modem state sent */
+	ev_timer modem_timer;
+};
+
+telnet *rfc2217_open(session *s) {
+	telnet *t = calloc(1, sizeof(telnet));
+
+	if (t == NULL) return NULL;
+	t->line = s->dev->options;
+	t->modem_mask = 0xff;
+	return t;
+}
+
+void rfc2217_close(session *s) {
+	telnet *t = s->telnet;
+	int fd = s->dev->tty.fd;
+
+	ev_timer_cancel(&t->modem_timer);
+	if (fd >= 0 && t->brk) ioctl(fd, TIOCCBRK);
+	if (fd >= 0 && t->changed) {
+		LOG_DBG("Restoring the line settings of %s", s->dev->tty_port);
+		tcsetattr(fd, TCSADRAIN, &s->dev->options);
+	}
+	ev_free_later(t);
+	s->telnet = NULL;
+}
+
+static int send_cmd(session *s, int verb, int opt) {
+	char cmd[3] = { IAC, verb, opt };
+	return session_write(s, cmd, sizeof(cmd));
+}
+
+/* IAC SB COM-PORT-OPTION cmd+100 value IAC SE, 0xff in value doubled */
+static int send_sb(session *s, int cmd, const unsigned char *value, int len) {
+	char buf[2 * SB_MAX + 6];
+	int i, n = 0;
+
+	buf[n++] = IAC;
+	buf[n++] = SB;
+	buf[n++] = OPT_COMPORT;
+	buf[n++] = cmd + CPC_REPLY;
+	for (i = 0; i < len && i < SB_MAX; i++) {
+		if (value[i] == IAC) buf[n++] = IAC;
+		buf[n++] = value[i];
+	}
+	buf[n++] = IAC;
+	buf[n++] = SE;
+	return session_write(s, buf, n);
+}
+
+static int send_byte(session *s, int cmd, unsigned char value) {
+	return send_sb(s, cmd, &value, 1);
+}
+
+static int send_modem_state(session *s, int always);
+static void modem_poll(ev_timer *timer);
+
+/* the options are kept as asked, a request for what is already on is not answered */
+static int negotiate(session *s, int verb, int opt) {
+	telnet *t = s->telnet;
+	int *on = NULL;
+
+	if (verb == DO || verb == DONT) {
+		if (opt == OPT_BINARY) on = &t->binary[0];
+		else if (opt == OPT_SGA) on = &t->sga[0];
+	} else {
+		if (opt == OPT_BINARY) on = &t->binary[1];
+		else if (opt == OPT_SGA) on = &t->sga[1];
+		else if (opt == OPT_COMPORT) on = &t->comport;
+	}
+	switch (verb) {
+	case DO:
+		if (on == NULL) return send_cmd(s, WONT, opt);
+		if (*on) return 0;
+		*on = 1;
+		return send_cmd(s, WILL, opt);
+	case WILL:
+		if (on == NULL) return send_cmd(s, DONT, opt);
+		if (*on) return 0;
+		*on = 1;
+		if (send_cmd(s, DO, opt) < 0) return -1;
+		if (opt != OPT_COMPORT) return 0;
+		LOG_DBG("Client %s uses RFC 2217", s->addr);
+		/* clients wait for the first modem state, then for changes */
+		ev_timer_set(&t->modem_timer, MODEM_POLL, modem_poll, s);
+		return send_modem_state(s, 1);
+	case DONT:
+		if (on == NULL || !*on) return 0;
+		*on = 0;
+		return send_cmd(s, WONT, opt);
+	case WONT:
+		if (on == NULL || !*on) return 0;
+		*on = 0;
+		return send_cmd(s, DONT, opt);
+	}
+	return 0;
+}
+
+static unsigned char modem_state(device *dev) {
+	unsigned char m = 0;
+	int bits;
+
+	if (dev->tty.fd < 0 || ioctl(dev->tty.fd, TIOCMGET, &bits) < 0) return 0;
+	if (bits & TIOCM_CTS) m |= MS_CTS;
+	if (bits & TIOCM_DSR) m |= MS_DSR;
+	if (bits & TIOCM_RI) m |= MS_RI;
+	if (bits & TIOCM_CD) m |= MS_CD;
+	return m;
+}
+
+static int send_modem_state(session *s, int always) {
+	telnet *t = s->telnet;
+	unsigned char m = modem_state(s->dev);
+	unsigned char delta = ((m ^ t->modem) >> 4) & 0x0f;
+
+	if (!always && !(((m ^ t->modem) | delta) & t->modem_mask)) return 0;
+	t->modem = m;
+	return send_byte(s, CPC_NOTIFY_MODEMSTATE, (m | delta) & t->modem_mask);
+}
+
+static void modem_poll(ev_timer *timer) {
+	session *s = timer->data;
+
+	if (send_modem_state(s, 0) < 0) {
+		session_close(s);
+		return;
+	}
+	ev_timer_set(timer, MODEM_POLL, modem_poll, s);
+}
+
+static int modem_line(device *dev, int bit, int value) {
+	int bits;
+
+	if (dev->tty.fd < 0) return 0;
+	if (value == 0 && ioctl(dev->tty.fd, TIOCMGET, &bits) == 0) return (bits & bit) != 0;
+	ioctl(dev->tty.fd, (value == 1) ? TIOCMBIS : TIOCMBIC, &bit);
+	return value == 1;
+}
+
+static void apply_line(session *s) {
+	telnet *t = s->telnet;
+
+	t->changed = 1;
+	if (s->dev->tty.fd >= 0 && tcsetattr(s->dev->tty.fd, TCSADRAIN, &t->line) < 0) {
+		LOG("tcsetattr(%s): %s", s->dev->tty_port, strerror(errno));
+		tcgetattr(s->dev->tty.fd, &t->line);  /* the replies tell what the tty took */
+	}
+}
+
+/* the line is the device's, a session may not change it under the others.
+   The replies then tell the setting of the tty. */
+static int line_shared(session *s, const char *what) {
+	device *dev = s->dev;
+
+	if (dev->session_count <= 1) return 0;
+	LOG("Client %s may not change the %s of %s, %d sessions use it", s->addr, what, dev->tty_port,
+	    dev->session_count);
+	if (dev->tty.fd >= 0) tcgetattr(dev->tty.fd, &s->telnet->line);
+	return 1;
+}
+
+static int set_baudrate(session *s, const unsigned char *v, int len) {
+	telnet *t = s->telnet;
+	unsigned char reply[4];
+	char str[16];
+	unsigned baud;
+	int speed;
+
+	if (len < 4) return 0;
+	baud = (v[0] << 24) | (v[1] << 16) | (v[2] << 8) | v[3];
+	if (baud && !line_shared(s, "baudrate")) {
+		snprintf(str, sizeof(str), "%u", baud);
+		if ((speed = map_str_baudrate(str)) < 0) {
+			LOG("Client %s asked for baudrate %u, it is not supported", s->addr, baud);
+		} else if (speed != cfgetospeed(&t->line)) {
+			cfsetispeed(&t->line, speed);
+			cfsetospeed(&t->line, speed);
+			apply_line(s);
+			LOG_DBG("%s set to %u baud by %s", s->dev->tty_port, baud, s->addr);
+		}
+	}
+	baud = map_speed_baudrate(cfgetospeed(&t->line));
+	reply[0] = baud >> 24;
+	reply[1] = baud >> 16;
+	reply[2] = baud >> 8;
+	reply[3] = baud;
+	return send_sb(s, CPC_SET_BAUDRATE, reply, 4);
+}
+
+static int set_datasize(session *s, int v) {
+	static const int sizes[] = { CS5, CS6, CS7, CS8 };
+	struct termios *line = &s->telnet->line;
+	int i;
+
+	if (v >= 5 && v <= 8 && !line_shared(s, "data size")) {
+		line->c_cflag = (line->c_cflag & ~CSIZE) | sizes[v - 5];
+		apply_line(s);
+	}
+	for (i = 0; i < 4 && (line->c_cflag & CSIZE) != sizes[i]; i++);
+	return send_byte(s, CPC_SET_DATASIZE, i + 5);
+}
+
+#ifndef CMSPAR
+#define CMSPAR 0        /* mark and space parity become odd and even */
+#endif
+
+static int set_parity(session *s, int v) {
+	struct termios *line = &s->telnet->line;
+	static const int parity[] = { 0, PARENB | PARODD, PARENB, PARENB | PARODD | CMSPAR, PARENB | CMSPAR };
+
+	if (v >= 1 && v <= 5 && !line_shared(s, "parity")) {
+		line->c_cflag = (line->c_cflag & ~(PARENB | PARODD | CMSPAR)) | parity[v - 1];
+		line->c_iflag &= ~(IGNPAR | INPCK);
+		line->c_iflag |= (v == 1) ? IGNPAR : INPCK;
+		apply_line(s);
+	}
+	for (v = 5; v > 1 && (line->c_cflag & (PARENB | PARODD | CMSPAR)) != parity[v - 1]; v--);
+	return send_byte(s, CPC_SET_PARITY, v);
+}
+
+static int set_stopsize(session *s, int v) {
+	struct termios *line = &s->telnet->line;
+
+	if ((v == 1 || v == 2) && !line_shared(s, "stop bits")) {  /* 3 is 1.5, not in termios */
+		if (v == 2) line->c_cflag |= CSTOPB;
+		else line->c_cflag &= ~CSTOPB;
+		apply_line(s);
+	}
+	return send_byte(s, CPC_SET_STOPSIZE, (line->c_cflag & CSTOPB) ? 2 : 1);
+}
+
+static int set_control(session *s, int v) {
+	telnet *t = s->telnet;
+	struct termios *line = &t->line;
+	int fd = s->dev->tty.fd;
+
+	switch (v) {
+	case 1: case 2: case 3:     /* outbound flow control: none, XON/XOFF, hardware */
+		if (!line_shared(s, "flow control")) {
+			line->c_iflag &= ~(IXON | IXOFF);
+			line->c_cflag &= ~CRTSCTS;
+			if (v == 2) line->c_iflag |= IXON | IXOFF;
+			if (v == 3) line->c_cflag |= CRTSCTS;
+			apply_line(s);
+		}
+		/* fall through */
+	case 0:
+		return send_byte(s, CPC_SET_CONTROL, (line->c_cflag & CRTSCTS) ? 3 : (line->c_iflag & IXON) ? 2 : 1);
+	case 5: case 6:
+		if (!line_shared(s, "break")) {
+			if (fd >= 0) ioctl(fd, (v == 5) ? TIOCSBRK : TIOCCBRK);
+			t->brk = (v == 5);
+		}
+		/* fall through */
+	case 4:
+		return send_byte(s, CPC_SET_CONTROL, t->brk ? 5 : 6);
+	case 7: case 8: case 9:     /* a shared line is only read */
+		if (v != 7 && line_shared(s, "DTR")) v = 7;
+		return send_byte(s, CPC_SET_CONTROL, modem_line(s->dev, TIOCM_DTR, v - 7) ? 8 : 9);
+	case 10: case 11: case 12:
+		if (v != 10 && line_shared(s, "RTS")) v = 10;
+		return send_byte(s, CPC_SET_CONTROL, modem_line(s->dev, TIOCM_RTS, v - 10) ? 11 : 12);
+	case 14: case 15: case 16:  /* inbound: none, XON/XOFF, hardware */
+		if (!line_shared(s, "flow control")) {
+			line->c_iflag &= ~IXOFF;
+			line->c_cflag &= ~CRTSCTS;
+			if (v == 15) line->c_iflag |= IXOFF;
+			if (v == 16) line->c_cflag |= CRTSCTS;
+			apply_line(s);
+		}
+		/* fall through */
+	case 13:
+	default:                    /* DCD and DSR flow control are not supported */
+		return send_byte(s, CPC_SET_CONTROL, (line->c_cflag & CRTSCTS) ? 16 : (line->c_iflag & IXOFF) ? 15 : 14);
+	}
+}
+
+/* the queued tty output of the other sessions is theirs, it is not dropped */
+static int purge(session *s, int v) {
+	device *dev = s->dev;
+
+	if ((v >= 1 && v <= 3) && line_shared(s, "buffers")) return send_byte(s, CPC_PURGE_DATA, v);
+	if (dev->tty.fd >= 0 && (v == 1 || v == 3)) tcflush(dev->tty.fd, TCIFLUSH);
+	if (v == 2 || v == 3) {
+		if (dev->tty.fd >= 0) tcflush(dev->tty.fd, TCOFLUSH);
+		buf_consume(&dev->out, dev->out.len);
+	}
+	return send_byte(s, CPC_PURGE_DATA, v);
+}
+
+static int subnegotiate(session *s) {
+	telnet *t = s->telnet;
+	const unsigned char *v = t->sb + 2;
+	int len = t->sb_len - 2;
+	const char *sig = PACKAGE_NAME " " VERSION;
+
+	if (t->sb_len < 2 || t->sb[0] != OPT_COMPORT) return 0;
+	switch (t->sb[1]) {
+	case CPC_SIGNATURE:
+		if (len == 0) return send_sb(s, CPC_SIGNATURE, (const unsigned char *)sig, strlen(sig));
+		LOG_DBG("Client %s is %.*s", s->addr, len, v);
+		return 0;
+	case CPC_SET_BAUDRATE:
+		return set_baudrate(s, v, len);
+	case CPC_SET_DATASIZE:
+		return set_datasize(s, len ? v[0] : 0);
+	case CPC_SET_PARITY:
+		return set_parity(s, len ? v[0] : 0);
+	case CPC_SET_STOPSIZE:
+		return set_stopsize(s, len ? v[0] : 0);
+	case CPC_SET_CONTROL:
+		return set_control(s, len ? v[0] : 0);
+	case CPC_NOTIFY_LINESTATE:
+		return send_byte(s, CPC_NOTIFY_LINESTATE, 0);  /* line errors are not reported by termios */
+	case CPC_NOTIFY_MODEMSTATE:
+		return send_modem_state(s, 1);
+	case CPC_FLOWCONTROL_SUSPEND:
+		s->suspended = 1;
+		tty_update(s->dev);
+		return 0;
+	case CPC_FLOWCONTROL_RESUME:
+		s->suspended = 0;
+		tty_update(s->dev);
+		if (s->out.len) ev_modify(&s->io, EV_READ | EV_WRITE);
+		return 0;
+	case CPC_SET_LINESTATE_MASK:
+		t->line_mask = len ? v[0] : 0;
+		return send_byte(s, CPC_SET_LINESTATE_MASK, t->line_mask);
+	case CPC_SET_MODEMSTATE_MASK:
+		t->modem_mask = len ? v[0] : 0;
+		if (send_byte(s, CPC_SET_MODEMSTATE_MASK, t->modem_mask) < 0) return -1;
+		return send_modem_state(s, 1);
+	case CPC_PURGE_DATA:
+		return purge(s, len ? v[0] : 0);
+	}
+	return 0;
+}
+
+int rfc2217_input(session *s, const char *buf, size_t len, char *data, size_t *data_len) {
+	telnet *t = s->telnet;
+	unsigned char c;
+	size_t i, n = 0;
+
+	for (i = 0; i < len; i++) {
+		c = buf[i];
+		switch (t->state) {
+		case TS_DATA:
+			if (c == IAC) t->state = TS_IAC;
+			else data[n++] = c;
+			break;
+		case TS_IAC:
+			t->state = TS_DATA;
+			if (c == IAC) {
+				data[n++] = c;
+				break;
+			}
+			t->negotiated = 1;
+			if (c >= WILL && c <= DONT) {
+				t->verb = c;
+				t->state = TS_OPT;
+			} else if (c == SB) {
+				if (n) {
+					/* the data before it goes out with the current settings first */
+					*data_len = n;
+					return i - 1;
+				}
+				t->sb_len = 0;
+				t->state = TS_SB;
+			}
+			break;
+		case TS_OPT:
+			t->state = TS_DATA;
+			if (negotiate(s, t->verb, c) < 0) return -1;
+			break;
+		case TS_SB:
+			if (c == IAC) t->state = TS_SB_IAC;
+			else if (t->sb_len < SB_MAX) t->sb[t->sb_len++] = c;
+			break;
+		case TS_SB_IAC:
+			if (c == IAC) {
+				if (t->sb_len < SB_MAX) t->sb[t->sb_len++] = c;
+				t->state = TS_SB;
+			} else {
+				t->state = TS_DATA;
+				if (c == SE && subnegotiate(s) < 0) return -1;
+			}
+			break;
+		}
+	}
+	*data_len = n;
+	return len;
+}
+
+int rfc2217_send(session *s, const char *data, size_t len) {
+	char buf[2 * BUFSIZZ];
+	size_t i = 0;
+	int n;
+
+	/* a plain TCP client gets 'P' and 'w' replies as the mount sent them */
+	if (!s->telnet->negotiated) return session_write(s, data, len);
+	while (i < len) {
+		for (n = 0; i < len && n < BUFSIZZ; i++) {
+			if ((unsigned char)data[i] == IAC) buf[n++] = IAC;
+			buf[n++] = data[i];
+		}
+		if (session_write(s, buf, n) < 0) return -1;
+	}
+	return 0;
+}
+
+#endif /* HAVE_EVLOOP */
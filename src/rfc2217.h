@@ -0,0 +1,33 @@
+#ifndef __RFC2217_H__
+#define __RFC2217_H__
+
+#include <stddef.h>
+
+#include "engine.h"
+
+/*
+ * Telnet COM-Port-Control (RFC 2217, -R): the client changes the line
+ * settings of the tty, sets DTR/RTS, sends breaks and reads the modem
+ * lines with telnet subnegotiations in its data stream. The bridge never
+ * starts a negotiation and sends the tty data as it is until the client
+ * sent a telnet command, so a plain TCP client works as long as it does
+ * not send 0xff. While other sessions share the tty a session can not
+ * change its line, modem lines or buffers, the replies tell the setting.
+ * Line settings a session changed are put back when it closes.
+ */
+
+/* NULL if out of memory */
+telnet *rfc2217_open(session *s);
+/* restores the device line settings if s changed them, frees the state */
+void rfc2217_close(session *s);
+/*
+ * Handles the telnet commands in buf and copies the data bytes to data,
+ * which has room for len. Stops before a subnegotiation if data is not
+ * empty, so data written before a line change goes out with the old
+ * settings. Returns the bytes of buf consumed, -1 if s has to be closed.
+ */
+int rfc2217_input(session *s, const char *buf, size_t len, char *data, size_t *data_len);
+/* data for the client, 0xff doubled once the client sent a telnet command */
+int rfc2217_send(session *s, const char *data, size_t len);
+
+#endif /*__RFC2217_H__*/
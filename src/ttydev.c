@@ -0,0 +1,194 @@
+/**************************************************************
+        ttydev - keeps the serial port of a device open and
+        configured, reopens it when a USB adapter goes away
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "nexbridge.h"
+#include "engine.h"
+#include "mux.h"
+#include "metrics.h"
+
+#ifdef HAVE_EVLOOP
+
+#define BUFSIZZ 1024
+#define SERIAL_BY_ID "/dev/serial/by-id"
+#define REOPEN_MIN 100    /* msec */
+#define REOPEN_MAX 5000
+
+/* udev keeps a link named after the adapter serial number, it survives renumbering */
+static void find_serial_id(device *dev) {
+	char path[PATH_MAX], target[PATH_MAX], real[PATH_MAX];
+	struct dirent *de;
+	DIR *d;
+
+	if (!strncmp(dev->tty_port, SERIAL_BY_ID, strlen(SERIAL_BY_ID))) return;
+	if (realpath(dev->tty_port, target) == NULL) return;
+	if ((d = opendir(SERIAL_BY_ID)) == NULL) return;
+	while ((de = readdir(d))) {
+		if (de->d_name[0] == '.') continue;
+		snprintf(path, sizeof(path), "%s/%s", SERIAL_BY_ID, de->d_name);
+		if (realpath(path, real) && !strcmp(real, target)) {
+			if (strcmp(dev->tty_id, path)) LOG("%s is %s", dev->tty_port, path);
+			snprintf(dev->tty_id, sizeof(dev->tty_id), "%s", path);
+			break;
+		}
+	}
+	closedir(d);
+}
+
+void tty_close(device *dev) {
+	if (dev->tty.fd < 0) return;
+	ev_del(&dev->tty);
+	buf_free(&dev->out);
+	close_tty(dev->tty.fd, &dev->saved_options);
+	dev->tty.fd = -1;
+}
+
+static void tty_event(ev_handle *h, uint32_t events) {
+	device *dev = h->data;
+	char buf[BUFSIZZ];
+	ssize_t r;
+
+	if (events & EV_READ) {
+		r = read(h->fd, buf, BUFSIZZ);
+		if (r < 0 && errno != EAGAIN && errno != EINTR) {
+			LOG("read(fd2): %s", strerror(errno));
+			tty_lost(dev);
+			return;
+		}
+		if (r == 0 && (events & EV_HUP)) {
+			tty_lost(dev);
+			return;
+		}
+		if (r > 0 && conf.mux) {
+			mux_tty_input(dev, buf, r);
+		} else if (r > 0) {
+			dev->owner_waiting = 0;
+			if (dev->owner) {
+				if (session_send(dev->owner, buf, r) < 0) session_close(dev->owner);
+			} else {
+				LOG_DBG("Dropped %d bytes from %s, no session is waiting", (int)r, dev->tty_port);
+			}
+		}
+	} else if (events & (EV_HUP | EV_ERR)) {
+		tty_lost(dev);
+		return;
+	}
+
+	if (events & EV_WRITE) {
+		if (buf_flush(&dev->out, h->fd) < 0) {
+			LOG("write(fd2): %s", strerror(errno));
+			tty_lost(dev);
+			return;
+		}
+		if (dev->out.len == 0) tty_update(dev);
+	}
+}
+
+static int open_path(device *dev, const char *path) {
+	int fd;
+
+	if (access(path, F_OK) < 0) return -1; /* still unplugged, do not flood the log */
+	fd = open_tty(path, &dev->options, &dev->saved_options);
+	if (fd < 0) return -1;
+	set_nonblock(fd);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	if (ev_add(&dev->tty, fd, EV_READ, tty_event, dev) < 0) {
+		close_tty(fd, &dev->saved_options);
+		return -1;
+	}
+	tty_update(dev);
+	return 0;
+}
+
+static int tty_open(device *dev) {
+	if (dev->tty.fd >= 0) return 0;
+	/* the adapter may come back under another ttyUSBn, its by-id name is the same */
+	if ((dev->tty_id[0] == '\0' || open_path(dev, dev->tty_id) < 0) &&
+	    open_path(dev, dev->tty_port) < 0)
+		return -1;
+	find_serial_id(dev);
+	cache_reset(&dev->cache);
+	return 0;
+}
+
+static void tty_reopen(ev_timer *t) {
+	device *dev = t->data;
+
+	if (tty_open(dev) == 0) {
+		if (dev->lost_at) {
+			dev->tty_reopens++;
+			METRIC_ADD(tty_reopens, 1);
+			LOG("Reopened %s after %llu ms", dev->tty_port, (unsigned long long)(ev_now() - dev->lost_at));
+		}
+		dev->lost_at = 0;
+		return;
+	}
+	dev->reopen_delay *= 2;
+	if (dev->reopen_delay > REOPEN_MAX) dev->reopen_delay = REOPEN_MAX;
+	ev_timer_set(&dev->reopen_timer, dev->reopen_delay, tty_reopen, dev);
+}
+
+void tty_start(device *dev) {
+	dev->tty.fd = -1;
+	dev->reopen_delay = REOPEN_MIN;
+	if (tty_open(dev) < 0) {
+		LOG("%s is not available, will keep trying", dev->tty_port);
+		ev_timer_set(&dev->reopen_timer, dev->reopen_delay, tty_reopen, dev);
+	}
+}
+
+void tty_lost(device *dev) {
+	LOG("Lost %s, reopening", dev->tty_port);
+	METRIC_ADD(tty_lost, 1);
+	tty_close(dev);
+	dev->lost_at = ev_now();
+	if (conf.mux) {
+		mux_fail(dev);
+	} else if (dev->owner && dev->owner_waiting) {
+		/* the command on the wire gets an answer, as with -x */
+		dev->owner_waiting = 0;
+		if (session_send(dev->owner, TTY_ERROR_REPLY, strlen(TTY_ERROR_REPLY)) < 0) session_close(dev->owner);
+	}
+	dev->reopen_delay = REOPEN_MIN;
+	ev_timer_set(&dev->reopen_timer, dev->reopen_delay, tty_reopen, dev);
+}
+
+int tty_write(device *dev, const char *data, size_t len) {
+	if (dev->tty.fd < 0) return -1;
+	METRIC_ADD(bytes_to_tty, len);
+	if (dev->out.len == 0) {
+		if (buf_append(&dev->out, data, len) < 0) return -1;
+		if (buf_flush(&dev->out, dev->tty.fd) < 0) {
+			LOG("write(fd2): %s", strerror(errno));
+			return -1;
+		}
+	} else if (buf_append(&dev->out, data, len) < 0) {
+		return -1;
+	}
+	if (dev->out.len) tty_update(dev);
+	return 0;
+}
+
+/* the tty is not read while the session its data goes to is suspended (-R),
+   the data waits in the tty instead of piling up in the session */
+void tty_update(device *dev) {
+	uint32_t events = dev->out.len ? EV_WRITE : 0;
+
+	if (dev->tty.fd < 0) return;
+	if (dev->owner == NULL || !dev->owner->suspended) events |= EV_READ;
+	ev_modify(&dev->tty, events);
+}
+
+#endif /* HAVE_EVLOOP */
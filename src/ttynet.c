@@ -5,6 +5,7 @@
     (C)2013-2016 by Rumen G.Bogdanovski
 ***************************************************************/
 #define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE  /* cfmakeraw() */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,12 +20,23 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <sys/select.h>
+#include <netinet/tcp.h>
 #include <sys/stat.h>
+#include <poll.h>
+#include <time.h>
 #include "config.h"
+#include "channel.h"
+#include "nexstar.h"
 
 #define NAME_SIZZ 1024
 #define BUFSIZZ 1024
+#define QUEUE_MAX 4096         /* client data held while disconnected */
+#define BACKOFF_MIN 100        /* msec, the first reconnect delay */
+#define CONNECT_WAIT 1000      /* msec for connect() to complete */
+#define STABLE_TIME 5000       /* msec up after which a loss restarts the backoff */
+#define GRACE_TIME 2000
+#define VPORTS_MAX 16
+#define PUMP_RAW 1             /* data_pump(): the bridge does not speak the channel protocol */
 #define h_addr h_addr_list[0] /* for backward compatibility */
 #define unlink_tty(tty_name) if ((tty_name[0]) != '\0') unlink(tty_name)
 
@@ -32,11 +44,39 @@ typedef struct {
 	int tcp_port;
 	char reconnect;
 	int reconnect_time;
+	int grace_time;
+	int channels;           /* -c, the -M ports over one connection */
 	char address[NAME_SIZZ];
 	char tty_name[NAME_SIZZ];
 } config;
 config conf;
 
+typedef struct {
+	char data[QUEUE_MAX];
+	int len;
+} queue;
+
+/* a virtual tty and the bridge port it is connected to */
+typedef struct {
+	int port;
+	int pty_fd;
+	int slave_fd;
+	char pts_name[NAME_SIZZ];
+	char link[NAME_SIZZ];   /* -T or -M name, may be empty */
+	int opened;             /* CH_OPEN sent on this connection */
+	int refused;            /* the bridge has no device on port */
+	queue outq, sent;
+	uint64_t sent_at;       /* msec, when the first unanswered byte of sent went out */
+	unsigned long dropped;
+	uint64_t rtt_sum;       /* usec, of the replies on the channel */
+	unsigned long rtt_count;
+} vport;
+
+vport vports[VPORTS_MAX];
+int vport_count = 0;
+pid_t children[VPORTS_MAX];
+int child_count = 0;
+
 
 int open_pts(char *pts_name, int pts_name_size) {
 	char *pname;
@@ -63,99 +103,433 @@ int open_pts(char *pts_name, int pts_name_size) {
 }
 
 
-int open_tcp(char *host, int port) {
-	struct sockaddr_in srv_info;
-	struct hostent *he;
-	int sock;
+static uint64_t now_usec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static uint64_t now_msec() {
+	return now_usec() / 1000;
+}
 
-	if ((he = gethostbyname(host))==NULL) {
+
+/* connect with a time limit, so the pty is not left unserved for long */
+static int connect_wait(const struct addrinfo *ai) {
+	struct pollfd pfd;
+	socklen_t len = sizeof(int);
+	int sock, err = 0;
+
+	if ((sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1) {
 		return -1;
 	}
+	fcntl(sock, F_SETFL, O_NONBLOCK);
+	if (connect(sock, ai->ai_addr, ai->ai_addrlen) < 0) {
+		pfd.fd = sock;
+		pfd.events = POLLOUT;
+		if ((errno != EINPROGRESS) || (poll(&pfd, 1, CONNECT_WAIT) != 1) ||
+		    (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0) || err) {
+			close(sock);
+			return -1;
+		}
+	}
+	return sock;
+}
 
-	if ((sock = socket(AF_INET, SOCK_STREAM, 0))== -1) {
+/* tries the addresses of host in turn, IPv4 or IPv6 */
+int open_tcp(char *host, int port) {
+	struct addrinfo hints, *res, *ai;
+	char service[16];
+	int sock = -1, val = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(service, sizeof(service), "%d", port);
+	if (getaddrinfo(host, service, &hints, &res)) {
 		return -1;
 	}
-
-	memset(&srv_info, 0, sizeof(srv_info));
-	srv_info.sin_family = AF_INET;
-	srv_info.sin_port = htons(port);
-	srv_info.sin_addr = *((struct in_addr *)he->h_addr);
-	if (connect(sock, (struct sockaddr *)&srv_info, sizeof(struct sockaddr))<0) {
+	for (ai = res; ai && sock < 0; ai = ai->ai_next) sock = connect_wait(ai);
+	freeaddrinfo(res);
+	if (sock < 0) {
 		return -1;
 	}
-
+	fcntl(sock, F_SETFL, 0);
+
+	/* notice a dead peer in seconds, not after the TCP defaults */
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+	setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &val, sizeof(val));
+	val = 2;
+	setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &val, sizeof(val));
+	val = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &val, sizeof(val));
+	val = 3;
+	setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &val, sizeof(val));
+#ifdef TCP_USER_TIMEOUT
+	val = 5000;
+	setsockopt(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, &val, sizeof(val));
+#endif
 	return sock;
 }
 
 
-int data_pump(int net_fd, int pty_fd, char exit_on_close) {
+static int write_all(int fd, const char *buf, int len) {
+	int r, done = 0;
+
+	while (done < len) {
+		r = write(fd, buf + done, len - done);
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR) continue;
+			return -1;
+		}
+		done += r;
+	}
+	return done;
+}
+
+
+static int queue_add(queue *q, const char *data, int len) {
+	if (q->len + len > QUEUE_MAX) return -1;
+	memcpy(q->data + q->len, data, len);
+	q->len += len;
+	return 0;
+}
+
+
+/* delay before the next attempt, a random part keeps clients of a restarted
+   server from coming back all at once */
+static int jitter(int msec) {
+	return msec / 2 + rand() % (msec / 2 + 1);
+}
+
+
+/* 1 if buf is only complete read-only NexStar commands, safe to send twice */
+static int only_queries(const char *buf, int len) {
+	int n;
+
+	while (len > 0) {
+		n = nex_command_len(buf, len);
+		if (n <= 0 || !nex_is_query(buf, n)) return 0;
+		buf += n;
+		len -= n;
+	}
+	return 1;
+}
+
+
+/*
+ * Offer the channel protocol, the bridge echoes CHANNEL_HELLO if it speaks
+ * it. Returns 1 if it does, 0 if it answers with other bytes and -1 if the
+ * connection failed or there was no answer in time.
+ */
+static int negotiate(int net_fd) {
+	char buf[CHANNEL_HELLO_LEN];
+	struct pollfd pfd = { net_fd, POLLIN, 0 };
+	uint64_t deadline = now_msec() + CONNECT_WAIT;
+	int len = 0, r;
+
+	if (write_all(net_fd, CHANNEL_HELLO, CHANNEL_HELLO_LEN) < 0) return -1;
+	while (len < CHANNEL_HELLO_LEN) {
+		r = (int)(deadline - now_msec());
+		if (r <= 0 || poll(&pfd, 1, r) == 0) return -1;
+		r = read(net_fd, buf + len, CHANNEL_HELLO_LEN - len);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) return -1;
+		if (memcmp(buf + len, CHANNEL_HELLO + len, r)) return 0;
+		len += r;
+	}
+	return 1;
+}
+
+
+static int send_frame(int net_fd, channel_header *h, const char *data) {
+	char frame[sizeof(channel_header) + CHANNEL_PAYLOAD_MAX];
+
+	channel_encode(frame, h);
+	if (h->len) memcpy(frame + sizeof(channel_header), data, h->len);
+	return write_all(net_fd, frame, sizeof(channel_header) + h->len);
+}
+
+
+/* client data of vport n to the bridge, as DATA frames of channel n if framed */
+static int vport_send(int net_fd, int n, int framed, const char *data, int len) {
+	vport *vp = &vports[n];
+	channel_header h;
+
+	if (!framed) return write_all(net_fd, data, len);
+	if (vp->refused) {
+		vp->dropped += len;
+		return 0;
+	}
+	memset(&h, 0, sizeof(h));
+	h.channel = n;
+	if (!vp->opened) {
+		h.type = CH_OPEN;
+		h.port = n ? vp->port : 0;
+		if (send_frame(net_fd, &h, NULL) < 0) return -1;
+		vp->opened = 1;
+	}
+	h.type = CH_DATA;
+	h.port = 0;
+	h.stamp = (uint32_t)now_usec();
+	while (len) {
+		h.len = (len < CHANNEL_PAYLOAD_MAX) ? len : CHANNEL_PAYLOAD_MAX;
+		if (send_frame(net_fd, &h, data) < 0) return -1;
+		data += h.len;
+		len -= h.len;
+	}
+	return 0;
+}
+
+
+static void pty_write(vport *vp, const char *data, int len) {
+	int r = write(vp->pty_fd, data, len);
+	if ((r < 0) && (errno != EAGAIN)) { /* ignore the error if the buffer is full */
+		printf("write(pty_fd): %s\n", strerror(errno));
+	}
+}
+
+
+/* returns -1 on a bad frame, the stream can not be trusted after it */
+static int frame_input(const channel_header *h, const char *data) {
+	vport *vp;
+
+	if (h->channel >= vport_count) return 0;
+	vp = &vports[h->channel];
+	switch (h->type) {
+	case CH_OPENED:
+		if (h->status == CH_EBUSY) {
+			printf("%s refused a channel to port %d, dropping the data of %s.\n", conf.address, vp->port, vp->pts_name);
+			vp->refused = 1;
+		} else if (h->status) {
+			printf("Port %d is not served by %s, dropping the data of %s.\n", vp->port, conf.address, vp->pts_name);
+			vp->refused = 1;
+		}
+		break;
+	case CH_DATA:
+		vp->sent.len = 0;  /* answered */
+		if (h->stamp) {
+			vp->rtt_sum += (uint32_t)((uint32_t)now_usec() - h->stamp);
+			vp->rtt_count++;
+		}
+		pty_write(vp, data, h->len);
+		break;
+	case CH_CLOSE:
+		vp->opened = 0;  /* the session timed out, reopened by the next command */
+		break;
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+
+/*
+ * Relay between the ptys and the server until a signal ends it. The ptys
+ * stay, the connection is re-established in the background. Commands
+ * the client writes while disconnected are queued for grace_time msec
+ * and sent after the reconnect, later ones are dropped so the client
+ * times out as with a dead mount. A query that got no reply when the
+ * connection broke is sent again if it went out less than grace_time msec
+ * before, any other command is dropped, the mount may have run it already
+ * and a late reply would be taken for the one of the next command. Framed, all vports share one connection
+ * to the port of vports[0], otherwise there is only one. Returns PUMP_RAW
+ * if framed and the bridge answers the first connection with other bytes
+ * than the hello, later ones which do are only failed connects.
+ */
+int data_pump(int framed) {
 	char buf[BUFSIZZ];
-	int r;
-	int max;
-	fd_set readset;
-
-	do {
-		do {
-			FD_ZERO(&readset);
-			FD_SET(net_fd, &readset);
-			FD_SET(pty_fd, &readset);
-			max = (net_fd > pty_fd) ? net_fd : pty_fd;
-			r = select(max + 1, &readset, NULL, NULL, NULL);
-		} while (r == -1 && errno == EINTR);
-
-		if ( r < 0 ) return -1;
-
-		if(FD_ISSET(net_fd,&readset)) {
-			r = read(net_fd,buf,BUFSIZZ-1);
-			if (r <= 0) {
-				if(r < 0) printf("read(net_fd): %s\n",strerror(errno));
-				return -1;
+	char in[2 * (sizeof(channel_header) + CHANNEL_PAYLOAD_MAX)];
+	struct pollfd pfd[VPORTS_MAX + 1];
+	channel_header h;
+	uint64_t now, next_try = 0, lost_at = 0, connected_at = 0;
+	int net_fd = -1, backoff = BACKOFF_MIN, timeout, in_len = 0, r, i;
+	vport *vp;
+
+	while (1) {
+		now = now_msec();
+		if (net_fd < 0 && now >= next_try) {
+			net_fd = open_tcp(conf.address, vports[0].port);
+			if (net_fd >= 0 && framed && (r = negotiate(net_fd)) <= 0) {
+				close(net_fd);
+				net_fd = -1;
+				if (r == 0 && connected_at == 0) return PUMP_RAW;
 			}
-			r = write(pty_fd,buf,r);
-			if (r <= 0) {
-				if ((r < 0) && (errno != EAGAIN)) { /* ignore the error if the buffer is full */
-					printf("write(pty_fd): %s\n",strerror(errno));
+			if (net_fd < 0) {
+				if (lost_at == 0) {
+					printf("Can not connect to %s:%d, retrying.\n", conf.address, vports[0].port);
+					lost_at = now;
+				}
+				next_try = now + jitter(backoff);
+				backoff = (backoff * 2 < conf.reconnect_time * 1000) ? backoff * 2 : conf.reconnect_time * 1000;
+			} else {
+				if (lost_at) printf("Connected to %s:%d after %llu msec.\n", conf.address, vports[0].port,
+				                    (unsigned long long)(now - lost_at));
+				else printf("Connected to %s:%d%s.\n", conf.address, vports[0].port, framed ? ", channels" : "");
+				connected_at = now;
+				lost_at = 0;
+				for (i = 0; i < vport_count; i++) {
+					vp = &vports[i];
+					if (vp->dropped) printf("Dropped %lu bytes from %s while disconnected.\n", vp->dropped, vp->pts_name);
+					vp->dropped = 0;
+					vp->opened = vp->refused = 0;
+					if (vp->outq.len && vport_send(net_fd, i, framed, vp->outq.data, vp->outq.len) < 0) goto lost;
+					vp->sent = vp->outq;
+					vp->sent_at = now;
+					vp->outq.len = 0;
 				}
-				continue;
 			}
 		}
 
-		if(FD_ISSET(pty_fd,&readset)) {
-			r = read(pty_fd,buf,BUFSIZZ-1);
+		pfd[0].fd = net_fd;  /* ignored by poll() while disconnected */
+		pfd[0].events = POLLIN;
+		timeout = (net_fd < 0) ? (int)(next_try - now) : -1;
+		for (i = 0; i < vport_count; i++) {
+			vp = &vports[i];
+			if (net_fd < 0 && vp->outq.len) {
+				if (now - lost_at >= conf.grace_time) {
+					vp->dropped += vp->outq.len;
+					vp->outq.len = 0;
+				} else if ((int)(lost_at + conf.grace_time - now) < timeout) {
+					timeout = (int)(lost_at + conf.grace_time - now);
+				}
+			}
+			pfd[i + 1].fd = vp->pty_fd;
+			pfd[i + 1].events = POLLIN;
+		}
+		r = poll(pfd, vport_count + 1, timeout);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			printf("poll(): %s\n", strerror(errno));
+			return -1;
+		}
+
+		if (pfd[0].revents) {
+			r = read(net_fd, buf, BUFSIZZ);
 			if (r <= 0) {
-				if (exit_on_close) {
-					return -2;
-				} else {
-					usleep(50000); /* offload the cpu as once the client closes tty -> FD_ISSET. Wired?! */
-					continue;
+				if (r < 0) printf("read(net_fd): %s\n", strerror(errno));
+				goto lost;
+			}
+			backoff = BACKOFF_MIN;
+			if (!framed) {
+				vports[0].sent.len = 0;  /* answered */
+				pty_write(&vports[0], buf, r);
+			} else {
+				memcpy(in + in_len, buf, r);
+				in_len += r;
+				while (in_len >= (int)sizeof(channel_header)) {
+					channel_decode(&h, in);
+					if (h.len > CHANNEL_PAYLOAD_MAX) {
+						printf("Bad frame from %s:%d.\n", conf.address, vports[0].port);
+						goto lost;
+					}
+					r = sizeof(channel_header) + h.len;
+					if (in_len < r) break;
+					if (frame_input(&h, in + sizeof(channel_header)) < 0) {
+						printf("Bad frame from %s:%d.\n", conf.address, vports[0].port);
+						goto lost;
+					}
+					in_len -= r;
+					memmove(in, in + r, in_len);
 				}
 			}
-			r = write(net_fd,buf,r);
+		}
+
+		for (i = 0; i < vport_count; i++) {
+			vp = &vports[i];
+			if (!(pfd[i + 1].revents & POLLIN)) continue;
+			r = read(vp->pty_fd, buf, BUFSIZZ);
 			if (r <= 0) {
-				if(r < 0) printf("write(net_fd): %s\n",strerror(errno));
-				return -1;
+				if (r < 0 && errno != EAGAIN && errno != EINTR) {
+					printf("read(pty_fd): %s\n", strerror(errno));
+					return -1;
+				}
+				continue;
+			}
+			if (net_fd >= 0) {
+				if (vp->sent.len == 0) vp->sent_at = now_msec();
+				if (queue_add(&vp->sent, buf, r) < 0) vp->sent.len = 0;  /* streaming, not commands */
+				if (vport_send(net_fd, i, framed, buf, r) < 0) {
+					printf("write(net_fd): %s\n", strerror(errno));
+					goto lost;
+				}
+			} else if (now_msec() - lost_at >= conf.grace_time || queue_add(&vp->outq, buf, r) < 0) {
+				vp->dropped += r;
 			}
 		}
-	} while (1);
+		continue;
+
+	lost:
+		close(net_fd);
+		net_fd = -1;
+		in_len = 0;
+		now = now_msec();
+		lost_at = now;
+		printf("Remote connection lost, reconnecting...\n");
+		for (i = 0; i < vport_count; i++) {
+			vp = &vports[i];
+			if (vp->rtt_count) printf("%s: %lu replies, %llu usec average round trip.\n", vp->pts_name,
+			                          vp->rtt_count, (unsigned long long)(vp->rtt_sum / vp->rtt_count));
+			vp->rtt_sum = vp->rtt_count = 0;
+			/* an unanswered query goes first after the reconnect, the rest is dropped */
+			if (vp->sent.len && now - vp->sent_at < (uint64_t)conf.grace_time &&
+			    only_queries(vp->sent.data, vp->sent.len) &&
+			    queue_add(&vp->sent, vp->outq.data, vp->outq.len) == 0) {
+				vp->outq = vp->sent;
+			} else {
+				vp->dropped += vp->sent.len;
+			}
+			vp->sent.len = 0;
+		}
+		if (now - connected_at >= STABLE_TIME) backoff = BACKOFF_MIN;
+		next_try = now + jitter(backoff);
+		backoff = (backoff * 2 < conf.reconnect_time * 1000) ? backoff * 2 : conf.reconnect_time * 1000;
+	}
 
 	return 0;
 }
 
 
+/* without channels: a process and a
+   connection per vport, each child relays its own one */
+int fork_pumps() {
+	pid_t pid;
+	int i;
+
+	for (i = 1; i < vport_count; i++) {
+		pid = fork();
+		if (pid < 0) {
+			printf("fork(): %s\n", strerror(errno));
+			return -1;
+		}
+		if (pid == 0) {
+			child_count = 0;
+			vports[0] = vports[i];
+			vport_count = 1;
+			exit((data_pump(0) < 0) ? EXIT_FAILURE : EXIT_SUCCESS);
+		}
+		children[child_count++] = pid;
+	}
+	vport_count = 1;
+	return data_pump(0);
+}
+
+
 void sig_handler(int sig) {
-	pid_t pgrp;
+	int i;
 
 	#ifdef SIG_DEBUG
 	printf("SIG: pid=%d, signal=%d", getpid(), sig);
 	#endif
 	switch (sig) {
 	case SIGHUP:
-	case SIGPIPE:
 	case SIGTERM:
 	case SIGINT:
 	case SIGQUIT:
 	case SIGCHLD:
-		unlink_tty(conf.tty_name);
+		for (i = 0; i < child_count; i++) kill(children[i], SIGTERM);
+		for (i = 0; i < vport_count; i++) unlink_tty(vports[i].link);
 		exit(0);
 		break;
 	}
@@ -169,14 +543,24 @@ void print_usage(char *name) {
 		"is intended to be used with software like Stellarium that relies on serial\n"
 		"port to control telescope mounts, thus enabling it to control network\n"
 		"exported mounts too. (see nexbridge)\n\n", name, VERSION);
-	printf( "usage: %s [-vr] -a address -p port [-T tty] [-t seconds]\n"
+	printf( "usage: %s [-vrc] -a address -p port [-T tty] [-M port[:tty]]... [-t seconds] [-g msec]\n"
 		"    -a  IP address to connect to\n"
 		"    -p  TCP port to connect to\n"
-		"    -r  reconnect when virtual port is closed\n"
-		"    -t  delay between reconnects in seconds (used with -r) [default: %d]\n"
+		"    -M  one more virtual tty for the device on port, up to %d, each with\n"
+		"        its own connection\n"
+		"    -c  carry the -M ports over the connection to -p with the channel\n"
+		"        protocol of nexbridge -e, a bridge which answers without it gets\n"
+		"        a connection per port\n"
+		"    -r  accepted for compatibility, the virtual tty always stays and a lost\n"
+		"        connection is re-established in the background\n"
+		"    -t  longest delay between reconnects in seconds, they start at %d msec\n"
+		"        and double [default: %d]\n"
+		"    -g  msec to hold commands written while disconnected, they are sent\n"
+		"        after the reconnect, later ones are dropped. An unanswered query\n"
+		"        sent within it is sent again, other commands never [default: %d]\n"
 		"    -T  virtual tty name to create\n"
 		"    -v  print version\n"
-		"    -h  print this help message\n\n", name, RECONNECT_TIME);
+		"    -h  print this help message\n\n", name, VPORTS_MAX - 1, BACKOFF_MIN, RECONNECT_TIME, GRACE_TIME);
 	printf( " Copyright (c)2014-2016 by Rumen Bogdanovski\n\n");
 }
 
@@ -187,14 +571,54 @@ void config_defaults() {
 	conf.tty_name[0] = '\0';
 	conf.reconnect = 0;
 	conf.reconnect_time = RECONNECT_TIME;
+	conf.grace_time = GRACE_TIME;
+	conf.channels = 0;
+}
+
+
+/* a pty with the slave held open, so the master never sees a hangup as
+   clients come and go, and a link to it if one was asked for */
+int vport_open(vport *vp) {
+	struct termios options;
+	int res;
+
+	vp->pty_fd = open_pts(vp->pts_name, NAME_SIZZ);
+	if (vp->pty_fd == -1) {
+		printf("Can not allocate virtual tty.\n");
+		return -1;
+	}
+	vp->slave_fd = open(vp->pts_name, O_RDWR | O_NOCTTY);
+	if (vp->slave_fd == -1) {
+		printf("Can not open %s: %s\n", vp->pts_name, strerror(errno));
+		return -1;
+	}
+	/* no echo of the replies back to the server until a client sets its mode */
+	tcgetattr(vp->slave_fd, &options);
+	cfmakeraw(&options);
+	tcsetattr(vp->slave_fd, TCSANOW, &options);
+	printf("Connection: [%s] <=> [%s:%d]\n", vp->pts_name, conf.address, vp->port);
+	if(vp->link[0] != '\0') {
+		res = symlink(vp->pts_name, vp->link);
+		if (res < 0) {
+			printf("Can not create a symbolic link: %s\n",strerror(errno));
+			vp->link[0]='\0';
+		} else {
+			printf("Use: '%s' to connect.\n", vp->link);
+		}
+		if(geteuid() == 0) { /* if root allow everyone to use it (crw-rw-rw-) */
+			res = chmod(vp->link, 0666);
+			if (res < 0) {
+				printf("Could not change mode: %s\n",strerror(errno));
+			}
+		}
+	}
+	return 0;
 }
 
 
 int main(int argc, char **argv) {
-	char tty_name[NAME_SIZZ];
-	int res, c;
-	int tcp_fd;
-	int tty_fd;
+	int res, c, i;
+	char *tty;
 	struct sigaction sa;
 
 	/* dusable buffering for stdout and stderr */
@@ -202,7 +626,8 @@ int main(int argc, char **argv) {
 	setbuf(stderr, NULL);
 
 	config_defaults();
-	while((c=getopt(argc,argv,"hvra:p:T:t:"))!=-1){
+	vport_count = 1;  /* vports[0] is -p and -T */
+	while((c=getopt(argc,argv,"hvrca:g:M:p:T:t:"))!=-1){
 		switch(c){
 		case 'a':
 			strncpy(conf.address, optarg, 255);
@@ -210,9 +635,25 @@ int main(int argc, char **argv) {
 		case 'p':
 			conf.tcp_port = atoi(optarg);
 			break;
+		case 'M':
+			if (vport_count == VPORTS_MAX) {
+				printf("At most %d ports can be added with -M, for help: %s -h\n", VPORTS_MAX - 1, argv[0]);
+				exit(1);
+			}
+			vports[vport_count].port = atoi(optarg);
+			if (vports[vport_count].port <= 0) {
+				printf("Bad port in '%s', for help: %s -h\n", optarg, argv[0]);
+				exit(1);
+			}
+			if ((tty = strchr(optarg, ':'))) strncpy(vports[vport_count].link, tty + 1, 255);
+			vport_count++;
+			break;
 		case 'r':
 			conf.reconnect = 1;
 			break;
+		case 'c':
+			conf.channels = 1;
+			break;
 		case 'T':
 			strncpy(conf.tty_name, optarg, 255);
 			break;
@@ -225,6 +666,9 @@ int main(int argc, char **argv) {
 		case 't':
 			conf.reconnect_time = atoi(optarg);
 			break;
+		case 'g':
+			conf.grace_time = atoi(optarg);
+			break;
 		case '?':
 		default:
 			printf("for help: %s -h\n", argv[0]);
@@ -242,6 +686,11 @@ int main(int argc, char **argv) {
 		exit(1);
 	}
 
+	if (conf.grace_time < 0) {
+		printf("Grace time should be a positive number, for help: %s -h\n", argv[0]);
+		exit(1);
+	}
+
 	sa.sa_handler = sig_handler;
 	sigemptyset(&sa.sa_mask);
 	sa.sa_flags = 0;
@@ -253,10 +702,7 @@ int main(int argc, char **argv) {
 		printf("sigaction(): %s",strerror(errno));
 		exit(1);
 	}
-	if (sigaction(SIGPIPE, &sa, NULL) == -1) {
-		printf("sigaction(): %s",strerror(errno));
-		exit(1);
-	}
+	signal(SIGPIPE, SIG_IGN);  /* a lost connection is handled where write() fails */
 	if (sigaction(SIGTERM, &sa, NULL) == -1) {
 		printf("sigaction(): %s",strerror(errno));
 		exit(1);
@@ -270,48 +716,33 @@ int main(int argc, char **argv) {
 		exit(1);
 	}
 
-	do { /* recreate the pty if the file is closed by the app otherwise select() always returns */
-		tcp_fd = open_tcp(conf.address, conf.tcp_port);
-		if (tcp_fd == -1) {
-			printf("Can not connect to %s:%d.\n", conf.address, conf.tcp_port);
+	vports[0].port = conf.tcp_port;
+	strcpy(vports[0].link, conf.tty_name);
+	for (i = 0; i < vport_count; i++) {
+		if (vport_open(&vports[i]) < 0) {
+			for (i--; i >= 0; i--) unlink_tty(vports[i].link);
 			exit(1);
 		}
-		tty_fd = open_pts(tty_name, NAME_SIZZ);
-		if (tty_fd == -1) {
-			close(tcp_fd);
-			printf("Can not allocate virtual tty.\n");
-			exit(1);
-		}
-		printf("Connection: [%s] <=> [%s:%d]\n", tty_name, conf.address, conf.tcp_port);
-		if(conf.tty_name[0] != '\0') {
-			res = symlink(tty_name,conf.tty_name);
-			if (res < 0) {
-				printf("Can not create a symbolic link: %s\n",strerror(errno));
-				conf.tty_name[0]='\n';
-			} else {
-				printf("Use: '%s' to connect.\n", conf.tty_name);
-			}
-			if(geteuid() == 0) { /* if root allow everyone to use it (crw-rw-rw-) */
-				res = chmod(conf.tty_name, 0666);
-				if (res < 0) {
-					printf("Could not change mode: %s\n",strerror(errno));
-				}
-			}
-		}
-
-		res = data_pump(tcp_fd, tty_fd, conf.reconnect);
+	}
 
-		close(tty_fd);
-		unlink_tty(conf.tty_name);
-		close(tcp_fd);
-		printf("Remote connection closed.\n");
-		if (conf.reconnect) {
-			printf("Will reconnect in %d sec...\n", conf.reconnect_time);
-			sleep(conf.reconnect_time);
+	srand(getpid() ^ now_msec());
+	if (conf.channels && vport_count > 1) {
+		res = data_pump(1);
+		if (res == PUMP_RAW) {
+			printf("%s:%d does not speak the channel protocol, a connection per port.\n", conf.address, vports[0].port);
+			res = fork_pumps();
 		}
-	} while (res == -2);
+	} else {
+		res = fork_pumps();
+	}
 
+	for (i = 0; i < child_count; i++) kill(children[i], SIGTERM);
+	for (i = 0; i < vport_count; i++) {
+		close(vports[i].slave_fd);
+		close(vports[i].pty_fd);
+		unlink_tty(vports[i].link);
+	}
 	printf("Exitting.\n");
 
-	return EXIT_SUCCESS;
+	return (res < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -0,0 +1,213 @@
+/**************************************************************
+        udp - one NexStar command per datagram, deduplicated
+        by sequence number, for lossy links
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "nexbridge.h"
+#include "mux.h"
+#include "metrics.h"
+#include "udp.h"
+
+#ifdef HAVE_EVLOOP
+
+#define DATAGRAM_MAX (UDP_SEQ_LEN + NEX_CMD_MAX)
+
+enum { SLOT_FREE, SLOT_RUNNING, SLOT_DONE };
+
+typedef struct {
+	uint32_t seq;
+	int state;
+	unsigned gen;           /* a reused slot does not take an old reply */
+	int len;
+	char reply[UDP_SEQ_LEN + NEX_REPLY_MAX];
+} udp_slot;
+
+typedef struct {
+	struct sockaddr_storage addr;   /* addr_len 0 for a free entry */
+	socklen_t addr_len;
+	int fd;                 /* the socket it was heard on, replies go out there */
+	uint64_t heard;         /* msec */
+	int next;               /* slot for the next new command */
+	udp_slot slots[UDP_HISTORY];
+} udp_peer;
+
+struct udp_server {
+	ev_handle io[ADDRS_MAX];
+	int io_count;
+	unsigned gen;
+	udp_peer peers[UDP_PEERS];
+};
+
+/* what a mux transaction needs to find its slot again */
+typedef struct {
+	udp_server *u;
+	udp_peer *peer;
+	udp_slot *slot;
+	unsigned gen;
+} udp_request;
+
+static const cache_entry tty_error = { TTY_ERROR_REPLY, sizeof(TTY_ERROR_REPLY) - 1, 0, 1 };
+
+static void reply(udp_server *u, udp_peer *peer, udp_slot *slot, const char *data, int len) {
+	if (len > NEX_REPLY_MAX) len = NEX_REPLY_MAX;
+	memcpy(slot->reply + UDP_SEQ_LEN, data, len);
+	slot->len = UDP_SEQ_LEN + len;
+	slot->state = SLOT_DONE;
+	METRIC_ADD(bytes_to_client, slot->len);
+	if (sendto(peer->fd, slot->reply, slot->len, 0, (struct sockaddr *)&peer->addr, peer->addr_len) < 0)
+		LOG_DBG("sendto(): %s", strerror(errno));
+}
+
+static void command_done(device *dev, transaction *t) {
+	udp_request *r = t->data;
+
+	/* the peer may have been forgotten and the slot reused meanwhile */
+	if (r->slot->gen == r->gen && r->slot->state == SLOT_RUNNING) {
+		if (nex_reply_complete(t->cmd, t->cmd_len, t->reply, t->reply_len))
+			reply(r->u, r->peer, r->slot, t->reply, t->reply_len);
+		else reply(r->u, r->peer, r->slot, tty_error.reply, tty_error.len);
+	}
+	free(r);
+}
+
+/* the entry of addr, a new one replaces the peer heard least recently */
+static udp_peer *find_peer(udp_server *u, const struct sockaddr_storage *addr, socklen_t len) {
+	udp_peer *p, *oldest = &u->peers[0];
+
+	for (p = u->peers; p < u->peers + UDP_PEERS; p++) {
+		if (p->addr_len == len && !memcmp(&p->addr, addr, len)) return p;
+		if (p->heard < oldest->heard) oldest = p;
+	}
+	memset(oldest, 0, sizeof(*oldest));
+	memcpy(&oldest->addr, addr, len);
+	oldest->addr_len = len;
+	return oldest;
+}
+
+static void datagram(udp_server *u, device *dev, int fd, const struct sockaddr_storage *addr,
+                     socklen_t addr_len, const char *buf, int len) {
+	const cache_entry *e = NULL;
+	udp_request *r;
+	udp_peer *peer;
+	udp_slot *slot;
+	uint32_t seq;
+	int i;
+
+	len -= UDP_SEQ_LEN;
+	if (len <= 0 || nex_command_len(buf + UDP_SEQ_LEN, len) != len) {
+		LOG_DBG("Dropped a datagram of %d bytes, not one command", len + UDP_SEQ_LEN);
+		METRIC_ADD(udp_dropped, 1);
+		return;
+	}
+	memcpy(&seq, buf, UDP_SEQ_LEN);
+	peer = find_peer(u, addr, addr_len);
+	peer->heard = ev_now();
+	peer->fd = fd;
+	for (i = 0; i < UDP_HISTORY; i++) {
+		slot = &peer->slots[i];
+		if (slot->state == SLOT_FREE || slot->seq != seq) continue;
+		/* a retransmit, the command is not run again */
+		METRIC_ADD(udp_duplicates, 1);
+		if (slot->state == SLOT_DONE && sendto(peer->fd, slot->reply, slot->len, 0,
+		                                       (struct sockaddr *)&peer->addr, peer->addr_len) < 0)
+			LOG_DBG("sendto(): %s", strerror(errno));
+		return;
+	}
+
+	slot = &peer->slots[peer->next];
+	if (slot->state == SLOT_RUNNING) {
+		METRIC_ADD(udp_dropped, 1);  /* UDP_HISTORY commands in flight, the peer retries */
+		return;
+	}
+	peer->next = (peer->next + 1) % UDP_HISTORY;
+	memcpy(slot->reply, buf, UDP_SEQ_LEN);
+	slot->seq = seq;
+	slot->state = SLOT_RUNNING;
+	slot->gen = ++u->gen;
+	METRIC_ADD(udp_commands, 1);
+
+	buf += UDP_SEQ_LEN;
+	if (conf.cache) e = cache_lookup(&dev->cache, buf, len);
+	if (e == NULL) {
+		if ((r = malloc(sizeof(udp_request))) == NULL) {
+			slot->state = SLOT_FREE;
+			return;
+		}
+		r->u = u;
+		r->peer = peer;
+		r->slot = slot;
+		r->gen = slot->gen;
+		if (mux_submit(dev, buf, len, command_done, r) == 0) return;
+		free(r);
+		e = &tty_error;  /* the tty is not available */
+	}
+	reply(u, peer, slot, e->reply, e->len);
+}
+
+static void udp_event(ev_handle *h, uint32_t events) {
+	device *dev = h->data;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	char buf[DATAGRAM_MAX + 1];
+	ssize_t r;
+
+	while (1) {
+		addr_len = sizeof(addr);
+		r = recvfrom(h->fd, buf, sizeof(buf), 0, (struct sockaddr *)&addr, &addr_len);
+		if (r < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				LOG("recvfrom(): %s", strerror(errno));
+			return;
+		}
+		datagram(dev->udp, dev, h->fd, &addr, addr_len, buf, r);
+	}
+}
+
+int udp_start(device *dev, const int *socks, int count) {
+	udp_server *u = calloc(1, sizeof(udp_server));
+
+	if (u == NULL) return -1;
+	for (; u->io_count < count; u->io_count++) {
+		set_nonblock(socks[u->io_count]);
+		if (ev_add(&u->io[u->io_count], socks[u->io_count], EV_READ, udp_event, dev) < 0) {
+			/* the caller closes socks */
+			while (u->io_count) ev_del(&u->io[--u->io_count]);
+			free(u);
+			return -1;
+		}
+	}
+	dev->udp = u;
+	return 0;
+}
+
+void udp_stop(device *dev) {
+	udp_server *u = dev->udp;
+
+	if (u == NULL) return;
+	while (u->io_count) {
+		ev_del(&u->io[--u->io_count]);
+		close(u->io[u->io_count].fd);
+	}
+	ev_free_later(u);
+	dev->udp = NULL;
+}
+
+#else /* HAVE_EVLOOP */
+
+int udp_start(device *dev, const int *socks, int count) {
+	return -1;
+}
+
+void udp_stop(device *dev) {
+}
+
+#endif /* HAVE_EVLOOP */
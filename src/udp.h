@@ -0,0 +1,23 @@
+#ifndef __UDP_H__
+#define __UDP_H__
+
+#include "engine.h"
+
+/*
+ * Datagram transport (-u): every datagram is a 4 byte sequence number in
+ * network byte order and one complete NexStar command, the reply datagram
+ * carries the same sequence number and the reply. Commands run through
+ * the mux like those of the TCP sessions. The last UDP_HISTORY replies of
+ * every peer are kept, a retransmitted command gets the kept reply and is
+ * not run again; one still running is not answered twice.
+ */
+#define UDP_SEQ_LEN 4
+#define UDP_PEERS 64            /* least recently heard peers are forgotten */
+#define UDP_HISTORY 8
+
+/* serve datagrams on the count sockets in socks for dev, -1 if out of memory */
+int udp_start(device *dev, const int *socks, int count);
+/* after mux_fail(), nothing may be in flight */
+void udp_stop(device *dev);
+
+#endif /*__UDP_H__*/
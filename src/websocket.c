@@ -0,0 +1,340 @@
+/**************************************************************
+        websocket - RFC 6455 handshake and framing, browsers
+        talk to the mount without a proxy
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+
+#include "nexbridge.h"
+#include "websocket.h"
+
+#ifdef HAVE_EVLOOP
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define FRAME_CHUNK 4096
+
+enum { WS_HTTP, WS_OPEN };
+
+enum {
+	OP_CONTINUATION = 0x0,
+	OP_TEXT = 0x1,
+	OP_BINARY = 0x2,
+	OP_CLOSE = 0x8,
+	OP_PING = 0x9,
+	OP_PONG = 0xa
+};
+
+/* close codes */
+#define WS_PROTOCOL_ERROR 1002
+#define WS_UNSUPPORTED 1003
+#define WS_TOO_BIG 1009
+#define CONTROL_MAX 125         /* payload of close, ping and pong */
+
+struct websocket {
+	int state;
+	buffer in;
+	size_t consumed;        /* the frame ws_next() returned last */
+};
+
+/* SHA-1 (FIPS 180-1), only for Sec-WebSocket-Accept */
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1_block(uint32_t h[5], const unsigned char *p) {
+	uint32_t w[80], a, b, c, d, e, f, k, t;
+	int i;
+
+	for (i = 0; i < 16; i++) w[i] = (p[4*i] << 24) | (p[4*i+1] << 16) | (p[4*i+2] << 8) | p[4*i+3];
+	for (; i < 80; i++) w[i] = ROL(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+	a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+	for (i = 0; i < 80; i++) {
+		if (i < 20) { f = (b & c) | (~b & d); k = 0x5a827999; }
+		else if (i < 40) { f = b ^ c ^ d; k = 0x6ed9eba1; }
+		else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8f1bbcdc; }
+		else { f = b ^ c ^ d; k = 0xca62c1d6; }
+		t = ROL(a, 5) + f + e + k + w[i];
+		e = d; d = c; c = ROL(b, 30); b = a; a = t;
+	}
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+}
+
+static void sha1(const char *data, size_t len, unsigned char out[20]) {
+	uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+	unsigned char block[64];
+	uint64_t bits = (uint64_t)len * 8;
+	size_t i, n;
+
+	for (i = 0; i + 64 <= len; i += 64) sha1_block(h, (const unsigned char *)data + i);
+	n = len - i;
+	memcpy(block, data + i, n);
+	block[n++] = 0x80;
+	if (n > 56) {
+		memset(block + n, 0, 64 - n);
+		sha1_block(h, block);
+		n = 0;
+	}
+	memset(block + n, 0, 56 - n);
+	for (i = 0; i < 8; i++) block[56 + i] = bits >> (56 - 8 * i);
+	sha1_block(h, block);
+	for (i = 0; i < 20; i++) out[i] = h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+static void base64(const unsigned char *in, int len, char *out) {
+	static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	uint32_t v;
+	int i;
+
+	for (i = 0; i < len; i += 3) {
+		v = in[i] << 16;
+		if (i + 1 < len) v |= in[i + 1] << 8;
+		if (i + 2 < len) v |= in[i + 2];
+		*out++ = b64[(v >> 18) & 0x3f];
+		*out++ = b64[(v >> 12) & 0x3f];
+		*out++ = (i + 1 < len) ? b64[(v >> 6) & 0x3f] : '=';
+		*out++ = (i + 2 < len) ? b64[v & 0x3f] : '=';
+	}
+	*out = '\0';
+}
+
+websocket *ws_open(session *s) {
+	return calloc(1, sizeof(websocket));
+}
+
+void ws_close(session *s) {
+	buf_free(&s->ws->in);
+	free(s->ws);
+	s->ws = NULL;
+}
+
+int ws_input(session *s, const char *buf, size_t len) {
+	websocket *ws = s->ws;
+
+	if (ws->in.len - ws->consumed + len > WS_REQUEST_MAX + WS_PAYLOAD_MAX) return -1;
+	return buf_append(&ws->in, buf, len);
+}
+
+static int send_frame(session *s, int op, const char *data, size_t len) {
+	char frame[10 + FRAME_CHUNK];
+	int hdr = 2;
+
+	frame[0] = 0x80 | op;
+	if (len < 126) {
+		frame[1] = len;
+	} else {
+		frame[1] = 126;
+		frame[2] = len >> 8;
+		frame[3] = len;
+		hdr = 4;
+	}
+	memcpy(frame + hdr, data, len);
+	return session_write(s, frame, hdr + len);
+}
+
+int ws_send(session *s, const char *data, size_t len) {
+	size_t n;
+
+	while (len) {
+		n = (len < FRAME_CHUNK) ? len : FRAME_CHUNK;
+		if (send_frame(s, OP_BINARY, data, n) < 0) return -1;
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int send_close(session *s, int code) {
+	char status[2] = { code >> 8, code & 0xff };
+	return send_frame(s, OP_CLOSE, status, 2);
+}
+
+/* the blank line after the headers, NULL if it has not arrived */
+static char *request_end(char *buf, size_t len) {
+	size_t i;
+
+	for (i = 0; i + 4 <= len; i++) {
+		if (!memcmp(buf + i, "\r\n\r\n", 4)) return buf + i;
+	}
+	return NULL;
+}
+
+/* value of header name in the request, NULL if it is not there */
+static char *header(char *req, const char *name, char *value, size_t size) {
+	size_t len = strlen(name), n;
+	char *line, *v;
+
+	for (line = strstr(req, "\r\n"); line && line[2]; line = strstr(line + 2, "\r\n")) {
+		if (strncasecmp(line + 2, name, len) || line[2 + len] != ':') continue;
+		v = line + 3 + len;
+		v += strspn(v, " \t");
+		n = strcspn(v, "\r");
+		while (n && (v[n - 1] == ' ' || v[n - 1] == '\t')) n--;
+		if (n >= size) return NULL;
+		memcpy(value, v, n);
+		value[n] = '\0';
+		return value;
+	}
+	return NULL;
+}
+
+/* word (a token of a comma separated list) is in value, case insensitive */
+static int has_token(const char *value, const char *word) {
+	size_t len = strlen(word);
+
+	while (*value) {
+		value += strspn(value, " \t,");
+		if (!strncasecmp(value, word, len) && strchr(" \t,", value[len])) return 1;
+		value += strcspn(value, ",");
+	}
+	return 0;
+}
+
+/* length of the host in "host[:port]", an IPv6 address is in [] */
+static size_t host_len(const char *host) {
+	const char *end;
+
+	if (host[0] == '[' && (end = strchr(host, ']'))) return end - host + 1;
+	return strcspn(host, ":");
+}
+
+/* a browser sends the Origin of the page the script runs in, the page may
+   connect if it came from this host, on any port, or its origin is listed
+   with -O, other clients do not send Origin. */
+static int origin_allowed(char *req, const char *origin) {
+	char host[WS_REQUEST_MAX];
+	const char *o;
+	size_t len;
+
+	if (!strcmp(conf.ws_origins, "*") || has_token(conf.ws_origins, origin)) return 1;
+	o = strstr(origin, "://");
+	if (o == NULL || !header(req, "Host", host, sizeof(host))) return 0;
+	o += 3;
+	len = host_len(o);
+	return len && len == host_len(host) && !strncasecmp(o, host, len);
+}
+
+static int handshake(session *s, char *req) {
+	static const char bad[] = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+	static const char forbidden[] = "HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+	static const char old[] = "HTTP/1.1 426 Upgrade Required\r\nSec-WebSocket-Version: 13\r\n"
+	                          "Content-Length: 0\r\nConnection: close\r\n\r\n";
+	char key[64], upgrade[64], connection[128], version[16], accept_key[32], reply[256];
+	char keyed[64 + sizeof(WS_GUID)], origin[WS_REQUEST_MAX];
+	unsigned char digest[20];
+	int val = 1;
+
+	if (!header(req, "Upgrade", upgrade, sizeof(upgrade)) || !has_token(upgrade, "websocket") ||
+	    !header(req, "Connection", connection, sizeof(connection)) || !has_token(connection, "upgrade") ||
+	    !header(req, "Sec-WebSocket-Key", key, sizeof(key))) {
+		LOG("Client %s sent an HTTP request which is not a WebSocket upgrade", s->addr);
+		session_write(s, bad, sizeof(bad) - 1);
+		return -1;
+	}
+	if (!header(req, "Sec-WebSocket-Version", version, sizeof(version)) || strcmp(version, "13")) {
+		LOG("Client %s asked for an unsupported WebSocket version", s->addr);
+		session_write(s, old, sizeof(old) - 1);
+		return -1;
+	}
+	/* the buffer holds the whole request, a missing header is not a long one */
+	if (header(req, "Origin", origin, sizeof(origin)) && !origin_allowed(req, origin)) {
+		LOG("Client %s was refused, origin %s is not allowed (-O)", s->addr, origin);
+		session_write(s, forbidden, sizeof(forbidden) - 1);
+		return -1;
+	}
+	snprintf(keyed, sizeof(keyed), "%s%s", key, WS_GUID);
+	sha1(keyed, strlen(keyed), digest);
+	base64(digest, sizeof(digest), accept_key);
+	snprintf(reply, sizeof(reply), "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n"
+	         "Connection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept_key);
+	/* one frame per reply, do not let Nagle hold them */
+	setsockopt(s->io.fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+	LOG_DBG("Client %s upgraded to WebSocket", s->addr);
+	return session_write(s, reply, strlen(reply));
+}
+
+int ws_next(session *s, const char **data) {
+	websocket *ws = s->ws;
+	unsigned char *p;
+	uint64_t len;
+	size_t hdr, i;
+	char *end;
+	int op;
+
+	while (1) {
+		buf_consume(&ws->in, ws->consumed);
+		ws->consumed = 0;
+		p = (unsigned char *)ws->in.data;
+
+		if (ws->state == WS_HTTP) {
+			if ((end = request_end(ws->in.data, ws->in.len)) == NULL) {
+				if (ws->in.len > WS_REQUEST_MAX) return -1;
+				return 0;
+			}
+			end[2] = '\0';  /* the request ends with its last header line */
+			if (handshake(s, ws->in.data) < 0) return -1;
+			ws->consumed = end + 4 - ws->in.data;
+			ws->state = WS_OPEN;
+			continue;
+		}
+
+		if (ws->in.len < 2) return 0;
+		op = p[0] & 0x0f;
+		len = p[1] & 0x7f;
+		hdr = 2;
+		if (len == 126) {
+			if (ws->in.len < 4) return 0;
+			len = (p[2] << 8) | p[3];
+			hdr = 4;
+		} else if (len == 127) {
+			if (ws->in.len < 10) return 0;
+			for (len = 0, i = 2; i < 10; i++) len = (len << 8) | p[i];
+			hdr = 10;
+		}
+		if (!(p[1] & 0x80)) {
+			LOG("Client %s sent an unmasked WebSocket frame", s->addr);
+			send_close(s, WS_PROTOCOL_ERROR);
+			return -1;
+		}
+		if ((op & 0x08) && len > CONTROL_MAX) {
+			send_close(s, WS_PROTOCOL_ERROR);
+			return -1;
+		}
+		if (len > WS_PAYLOAD_MAX) {
+			send_close(s, WS_TOO_BIG);
+			return -1;
+		}
+		if (ws->in.len < hdr + 4 + len) return 0;
+		for (i = 0; i < len; i++) p[hdr + 4 + i] ^= p[hdr + i % 4];
+		ws->consumed = hdr + 4 + len;
+		*data = (const char *)p + hdr + 4;
+
+		switch (op) {
+		case OP_CONTINUATION:
+		case OP_TEXT:
+		case OP_BINARY:
+			if (len) return len;
+			break;
+		case OP_PING:
+			if (send_frame(s, OP_PONG, *data, len) < 0) return -1;
+			break;
+		case OP_PONG:
+			break;
+		case OP_CLOSE:
+			/* echo the status, then the TCP connection goes */
+			send_frame(s, OP_CLOSE, *data, (len < 2) ? len : 2);
+			return -1;
+		default:
+			send_close(s, WS_UNSUPPORTED);
+			return -1;
+		}
+	}
+}
+
+#endif /* HAVE_EVLOOP */
@@ -0,0 +1,33 @@
+#ifndef __WEBSOCKET_H__
+#define __WEBSOCKET_H__
+
+#include <stddef.h>
+
+#include "engine.h"
+
+/*
+ * WebSocket sessions (-W): a session starting with WS_PREFIX is taken for
+ * an HTTP upgrade request. After the handshake the client sends NexStar
+ * bytes in binary or text frames and gets the replies in binary frames,
+ * the rest of the session is the same as for a plain TCP client.
+ */
+#define WS_PREFIX "GET "
+#define WS_PREFIX_LEN (sizeof(WS_PREFIX) - 1)
+#define WS_REQUEST_MAX 4096     /* the upgrade request with its headers */
+#define WS_PAYLOAD_MAX 65536
+
+/* NULL if out of memory */
+websocket *ws_open(session *s);
+void ws_close(session *s);
+/* client bytes, -1 if they do not fit */
+int ws_input(session *s, const char *buf, size_t len);
+/*
+ * Runs the handshake and the control frames and points data to the payload
+ * of the next data frame, valid until the next call. Returns its length, 0
+ * if more input is needed and -1 if s has to be closed.
+ */
+int ws_next(session *s, const char **data);
+/* data for the client in binary frames */
+int ws_send(session *s, const char *data, size_t len);
+
+#endif /*__WEBSOCKET_H__*/
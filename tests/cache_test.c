@@ -0,0 +1,91 @@
+/**************************************************************
+        cache_test - TTL table, expiry and invalidation of the
+        reply cache
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#include <string.h>
+
+#include "../src/nexbridge.h"
+#include "../src/cache.h"
+#include "stubs.h"
+#include "check.h"
+
+static cache c;
+
+static void store(const char *cmd, const char *reply) {
+	cache_store(&c, c.generation, cmd, strlen(cmd), reply, strlen(reply));
+}
+
+static int cached(const char *cmd, const char *reply) {
+	const cache_entry *e = cache_lookup(&c, cmd, strlen(cmd));
+
+	if (reply == NULL) return e == NULL;
+	return e && e->len == (int)strlen(reply) && !memcmp(e->reply, reply, e->len);
+}
+
+int main() {
+	unsigned generation;
+
+	/* only single byte queries, TTLs from -1 up */
+	CHECK(cache_config("default,e=100,V=-1", 1) == 0);
+	CHECK(cache_config("E=0", 0) == 0);
+	CHECK(cache_config("K=100", 0) < 0);
+	CHECK(cache_config("M=100", 0) < 0);
+	CHECK(cache_config("e=-2", 0) < 0);
+	CHECK(cache_config("e", 0) < 0);
+	CHECK(cache_config("nonsense", 0) < 0);
+
+	/* kept for the TTL */
+	store("e", "34AB0500,12CE0500#");
+	CHECK(cached("e", "34AB0500,12CE0500#"));
+	now_usec += 99 * 1000;
+	CHECK(cached("e", "34AB0500,12CE0500#"));
+	now_usec += 1000;
+	CHECK(cached("e", NULL));
+	CHECK(c.hits['e'] == 2 && c.misses['e'] == 1);
+
+	/* not cached: commands without a TTL, incomplete or garbled replies */
+	store("K", "x#");
+	CHECK(cached("K", NULL));
+	store("e", "34AB0500,12CE");
+	CHECK(cached("e", NULL));
+	store("e", "34AB0500;12CE0500#");
+	CHECK(cached("e", NULL));
+	store("V", "\x04\x0a");
+	CHECK(cached("V", NULL));
+	store("V", "\x04\x0a#\xff");
+	CHECK(cached("V", NULL));
+
+	/* a reply which left before the last invalidation is not stored */
+	generation = c.generation;
+	cache_invalidate(&c);
+	cache_store(&c, generation, "e", 1, "34AB0500,12CE0500#", 18);
+	CHECK(cached("e", NULL));
+
+	/* an invalidation drops all but the static entries */
+	store("V", "\x04\x0a#");
+	store("e", "34AB0500,12CE0500#");
+	now_usec += 3600 * 1000000ULL;
+	CHECK(cached("V", "\x04\x0a#"));
+	CHECK(cached("e", NULL));
+	store("e", "34AB0500,12CE0500#");
+	generation = c.generation;
+	cache_invalidate(&c);
+	CHECK(c.generation != generation && c.invalidations == 2);
+	CHECK(cached("e", NULL));
+	CHECK(cached("V", "\x04\x0a#"));
+
+	/* a reopened tty may be another mount */
+	cache_reset(&c);
+	CHECK(cached("V", NULL));
+
+	/* a new table is used only when applied */
+	CHECK(cache_config("V=-1", 0) == 0);
+	store("e", "34AB0500,12CE0500#");
+	CHECK(cached("e", "34AB0500,12CE0500#"));
+	CHECK(cache_config("V=-1", 1) == 0);
+	CHECK(cached("e", NULL));
+
+	return CHECK_RESULT;
+}
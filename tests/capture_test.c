@@ -0,0 +1,91 @@
+/**************************************************************
+        capture_test - what capture_write() records is read
+        back from the file as nbreplay reads it
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#include <sys/stat.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/capture.h"
+#include "check.h"
+
+#define BIG (CAPTURE_BUF + 1000)    /* goes around the buffer */
+
+static const struct {
+	int dir;
+	const char *data;
+	size_t len;
+} records[] = {
+	{ CAPTURE_TO_TTY, "Kx", 2 },
+	{ CAPTURE_TO_CLIENT, "x#", 2 },
+	{ CAPTURE_TO_TTY, "e", 1 },
+	{ CAPTURE_TO_CLIENT, NULL, BIG },
+	{ CAPTURE_TO_CLIENT, "#", 1 },
+};
+#define RECORDS (int)(sizeof(records) / sizeof(records[0]))
+
+int main() {
+	char dir[] = "/tmp/nbcap_testXXXXXX", name[PATH_MAX];
+	static char big[BIG], file[BIG * 2];
+	capture_header h;
+	capture_record r;
+	capture *c;
+	uint64_t last = 0;
+	size_t size, pos;
+	FILE *f;
+	int i;
+
+	if (mkdtemp(dir) == NULL) return 99;
+	memset(big, 0xa5, sizeof(big));
+	c = capture_open(dir, "192.0.2.1", "/dev/ttyUSB0");
+	CHECK(c != NULL);
+	if (c == NULL) return CHECK_RESULT;
+	snprintf(name, sizeof(name), "%s", capture_name(c));  /* c is gone after close */
+	CHECK(strncmp(name, dir, strlen(dir)) == 0);
+	for (i = 0; i < RECORDS; i++) {
+		capture_write(c, records[i].dir, records[i].data ? records[i].data : big, records[i].len);
+		if (i == 1) capture_flush(c);
+	}
+	capture_write(c, CAPTURE_TO_TTY, "", 0);  /* nothing to record */
+	CHECK(capture_close(c) == 0);
+
+	f = fopen(name, "rb");
+	CHECK(f != NULL);
+	if (f == NULL) return CHECK_RESULT;
+	size = fread(file, 1, sizeof(file), f);
+	fclose(f);
+
+	CHECK(size >= sizeof(h));
+	memcpy(&h, file, sizeof(h));
+	CHECK(memcmp(h.magic, CAPTURE_MAGIC, sizeof(h.magic)) == 0);
+	CHECK(h.version == CAPTURE_VERSION);
+	CHECK(h.header_size == sizeof(h));
+	CHECK(strcmp(h.peer, "192.0.2.1") == 0);
+	CHECK(strcmp(h.tty, "/dev/ttyUSB0") == 0);
+
+	/* the records come back in order, times do not go backwards */
+	pos = h.header_size;
+	for (i = 0; i < RECORDS && pos + sizeof(r) <= size; i++) {
+		memcpy(&r, file + pos, sizeof(r));
+		pos += sizeof(r);
+		CHECK(r.dir == records[i].dir);
+		CHECK(r.len == records[i].len);
+		CHECK(r.ns >= last);
+		CHECK(pos + r.len <= size);
+		if (pos + r.len > size) break;
+		CHECK(memcmp(file + pos, records[i].data ? records[i].data : big, r.len) == 0);
+		last = r.ns;
+		pos += r.len;
+	}
+	CHECK(i == RECORDS);
+	CHECK(pos == size);
+
+	unlink(name);
+	rmdir(dir);
+	return CHECK_RESULT;
+}
@@ -0,0 +1,47 @@
+/**************************************************************
+        channel_test - the frame header of the channel protocol
+        is the same on every host
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#include <string.h>
+
+#include "../src/channel.h"
+#include "check.h"
+
+int main() {
+	static const unsigned char wire[] = { CH_OPEN, CH_EBUSY, 0x00, 0x03, 0x01, 0x02,
+	                                      0x2f, 0x09, 0xde, 0xad, 0xbe, 0xef };
+	channel_header h, d;
+	char out[sizeof(channel_header)];
+
+	CHECK(sizeof(channel_header) == 12);
+	CHECK(strlen(CHANNEL_HELLO) == CHANNEL_HELLO_LEN);
+
+	memset(&h, 0, sizeof(h));
+	h.type = CH_OPEN;
+	h.status = CH_EBUSY;
+	h.channel = 3;
+	h.len = 0x102;
+	h.port = 12041;
+	h.stamp = 0xdeadbeef;
+	channel_encode(out, &h);
+	CHECK(memcmp(out, wire, sizeof(wire)) == 0);
+
+	channel_decode(&d, (const char *)wire);
+	CHECK(d.type == CH_OPEN);
+	CHECK(d.status == CH_EBUSY);
+	CHECK(d.channel == 3);
+	CHECK(d.len == 0x102);
+	CHECK(d.port == 12041);
+	CHECK(d.stamp == 0xdeadbeef);
+
+	/* the largest values survive the round trip */
+	h.channel = h.len = h.port = 0xffff;
+	h.stamp = 0xffffffff;
+	channel_encode(out, &h);
+	channel_decode(&d, out);
+	CHECK(memcmp(&d, &h, sizeof(h)) == 0);
+
+	return CHECK_RESULT;
+}
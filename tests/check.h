@@ -0,0 +1,21 @@
+#ifndef __CHECK_H__
+#define __CHECK_H__
+
+#include <stdio.h>
+
+/*
+ * The tests are plain programs run by make check. A failed CHECK() prints
+ * where it is and the test goes on, main() returns CHECK_RESULT.
+ */
+static int failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+#define CHECK_RESULT (failures ? 1 : 0)
+
+#endif /*__CHECK_H__*/
@@ -0,0 +1,159 @@
+/**************************************************************
+        config_test - the config file, the command line over it
+        and what a reload keeps
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "../src/nexbridge.h"
+#include "../src/options.h"
+#include "check.h"
+
+static char path[] = "/tmp/nbconf_testXXXXXX";
+
+/* the config file is text, 0 if it could not be written */
+static int write_file(const char *text) {
+	FILE *f = fopen(path, "w");
+
+	if (f == NULL) return 0;
+	fputs(text, f);
+	return fclose(f) == 0;
+}
+
+/* text loaded over the defaults */
+static int load(const char *text) {
+	config_defaults();
+	if (!write_file(text)) return -2;
+	return load_config_file(path);
+}
+
+int main() {
+	static config old;
+	char *argv[] = { "nexbridge", "-c", path, "-p", "10002", NULL };
+	bind_list bl;
+	int fd;
+
+	if ((fd = mkstemp(path)) < 0) return 99;
+	close(fd);
+
+	config_defaults();
+	CHECK(conf.server_port == PORT && conf.is_daemon && !conf.engine);
+	CHECK(!strcmp(conf.baudrate, BAUDRATE) && conf.device_count == 0);
+
+	/* keys are the long option names, '=' is optional, flags take yes or no */
+	CHECK(load("# nexbridge.conf\n"
+	           "\n"
+	           "port 10001\n"
+	           "  baudrate = 19200   # the mount\n"
+	           "foreground\n"
+	           "splice no\n"
+	           "mux yes\n"
+	           "gap 5\r\n"
+	           "device /dev/ttyUSB1,baud=9600,port=10010\n"
+	           "device /dev/ttyUSB2,name=second\n") == 0);
+	CHECK(conf.server_port == 10001 && !strcmp(conf.baudrate, "19200"));
+	CHECK(!conf.is_daemon && !conf.splice && conf.mux && conf.engine && conf.gap == 5);
+	CHECK(conf.device_count == 2);
+	CHECK(!strcmp(conf.devices[0].tty_port, "/dev/ttyUSB1") && conf.devices[0].server_port == 10010);
+	CHECK(!strcmp(conf.devices[1].svc_name, "second"));
+
+	/* the devices get the defaults they do not set, ports count up from -p */
+	CHECK(check_config(&bl) == 0);
+	CHECK(!strcmp(conf.devices[0].baudrate, "9600") && !strcmp(conf.devices[1].baudrate, "19200"));
+	CHECK(conf.devices[1].server_port == 10002 && !strcmp(conf.devices[1].dataformat, DATA_FORMAT));
+	CHECK(cfgetospeed(&conf.devices[0].options) == B9600);
+	CHECK(cfgetospeed(&conf.devices[1].options) == B19200);
+
+	/* the engine without -D serves -P */
+	CHECK(load("engine\ntty /dev/ttyS3\nlow_latency vmin=2,vtime=1\n") == 0);
+	CHECK(check_config(&bl) == 0);
+	CHECK(conf.device_count == 1 && !strcmp(conf.devices[0].tty_port, "/dev/ttyS3"));
+	CHECK(conf.devices[0].server_port == PORT);
+	CHECK(conf.devices[0].options.c_cc[VMIN] == 2 && conf.devices[0].options.c_cc[VTIME] == 1);
+	CHECK(conf.stock_options.c_cc[VMIN] == 0);
+
+	/* bad lines */
+	CHECK(load("speed 9600\n") < 0);
+	CHECK(load("port\n") < 0);
+	CHECK(load("mux maybe\n") < 0);
+	CHECK(load("device ,baud=9600\n") < 0);
+	CHECK(load("device baud=9600\n") < 0);
+	CHECK(load("device /dev/ttyUSB0,parity=none\n") < 0);
+	CHECK(load("low_latency vmin=300\n") < 0);
+	CHECK(load("cache M=100\n") < 0);
+	config_defaults();
+	CHECK(load_config_file("/nonexistent/nexbridge.conf") < 0);
+
+	/* good lines with bad values */
+	CHECK(load("max_conn 0\n") == 0 && check_config(&bl) < 0);
+	CHECK(load("port 70000\n") == 0 && check_config(&bl) < 0);
+	CHECK(load("baudrate 12345\n") == 0 && check_config(&bl) < 0);
+	CHECK(load("format 8X1\n") == 0 && check_config(&bl) < 0);
+	CHECK(load("rfc2217\nmux\n") == 0 && check_config(&bl) < 0);
+	CHECK(load("device /dev/ttyUSB0,format=9N1\n") == 0 && check_config(&bl) < 0);
+	CHECK(load("capture /nonexistent\n") == 0 && check_config(&bl) < 0);
+
+	/* the command line overrides the file given with -c */
+	CHECK(write_file("port 10001\nmux\ntimeout 30\n"));
+	config_args(5, argv);
+	config_defaults();
+	CHECK(read_config() == 0 && check_config(&bl) == 0);
+	CHECK(config_file[0] == '/' && conf.server_port == 10002 && conf.mux && conf.timeout == 30);
+
+	/* a reload takes what the daemon can switch, the rest waits for a restart */
+	old = conf;
+	CHECK(write_file("port 10001\ntimeout 5\naddress 127.0.0.1\n"));
+	config_defaults();
+	CHECK(read_config() == 0 && check_config(&bl) == 0);
+	keep_restart_settings(&old);
+	CHECK(conf.timeout == 5 && conf.server_port == 10002);
+	CHECK(conf.mux && conf.engine && conf.address[0] == '\0');
+
+	/* -a takes IPv4 and IPv6 addresses, IPv6 ones in [] too */
+	CHECK(parse_addresses("127.0.0.1", &bl) == 0);
+	CHECK(bl.count == 1 && bl.addr[0].ss_family == AF_INET && bl.len[0] == sizeof(struct sockaddr_in));
+	CHECK(bl.v6only);
+	CHECK(parse_addresses("::1", &bl) == 0);
+	CHECK(bl.count == 1 && bl.addr[0].ss_family == AF_INET6 && !bl.v6only);
+	CHECK(parse_addresses("[fe80::1]", &bl) == 0);
+	CHECK(bl.count == 1 && bl.addr[0].ss_family == AF_INET6);
+	CHECK(parse_addresses("127.0.0.1,[::1], 10.0.0.1 ::", &bl) == 0);
+	CHECK(bl.count == 4 && bl.v6only);
+	CHECK(bl.addr[1].ss_family == AF_INET6 && bl.addr[2].ss_family == AF_INET);
+	/* an empty list is any address */
+	CHECK(parse_addresses("", &bl) == 0 && bl.count == 1);
+	CHECK(parse_addresses("1.2.3.4,1.2.3.5,1.2.3.6,1.2.3.7,1.2.3.8", &bl) < 0);
+	CHECK(parse_addresses("localhost", &bl) < 0);
+	CHECK(parse_addresses("256.0.0.1", &bl) < 0);
+	CHECK(parse_addresses(",", &bl) < 0);
+	CHECK(load("address 127.0.0.1,nowhere\n") == 0 && check_config(&bl) < 0);
+
+#ifdef SO_REUSEPORT
+	/* the listeners of -a and -A stay until a restart */
+	CHECK(write_file("port 10001\naddress ::1\naccept_workers 2\n"));
+	config_defaults();
+	old = conf;
+	CHECK(read_config() == 0 && check_config(&bl) == 0);
+	keep_restart_settings(&old);
+	CHECK(conf.address[0] == '\0' && conf.shards == 1);
+#endif
+
+	/* a bad file fails the reload */
+	CHECK(write_file("port 10001\ntimeout -1\n"));
+	config_defaults();
+	CHECK(read_config() == 0 && check_config(&bl) < 0);
+	CHECK(write_file("port 10001\nretries 3\n"));
+	config_defaults();
+	CHECK(read_config() < 0);
+
+	unlink(path);
+	return CHECK_RESULT;
+}
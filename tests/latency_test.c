@@ -0,0 +1,70 @@
+/**************************************************************
+        latency_test - histogram buckets, percentiles and the
+        per command records
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#include <string.h>
+
+#include "../src/latency.h"
+#include "check.h"
+
+/* the bucket value of usec is off by less than 25% */
+static int close_to(uint64_t value, uint64_t usec) {
+	return 4 * value >= 3 * usec && 4 * value <= 5 * usec;
+}
+
+static uint64_t only(uint64_t usec) {
+	histogram h;
+
+	memset(&h, 0, sizeof(h));
+	hist_add(&h, usec);
+	return hist_percentile(&h, 50);
+}
+
+int main() {
+	static const uint64_t values[] = { 5, 7, 8, 9, 100, 1000, 4100, 65535, 1000000, 30000000 };
+	latency_stamp stamp = { 1000, 1500, 5500 };
+	histogram h, client;
+	char line[256];
+	uint64_t v;
+	int i;
+
+	/* small values are exact, the rest within a quarter */
+	for (v = 0; v < 5; v++) CHECK(only(v) == v);
+	for (i = 0; i < (int)(sizeof(values) / sizeof(values[0])); i++) CHECK(close_to(only(values[i]), values[i]));
+	/* beyond the last bucket all is counted in it */
+	CHECK(only(1ULL << 40) == only(1ULL << 30));
+
+	/* percentiles of 90 samples of 1000 and 10 of 100000 */
+	memset(&h, 0, sizeof(h));
+	CHECK(hist_percentile(&h, 50) == 0);
+	for (i = 0; i < 90; i++) hist_add(&h, 1000);
+	for (i = 0; i < 10; i++) hist_add(&h, 100000);
+	CHECK(h.count == 100);
+	CHECK(close_to(hist_percentile(&h, 50), 1000));
+	CHECK(close_to(hist_percentile(&h, 90), 1000));
+	CHECK(close_to(hist_percentile(&h, 99), 100000));
+	CHECK(hist_format(line, sizeof(line), &h) > 0);
+	CHECK(!strncmp(line, "n=100 p50=", 10));
+
+	/* nothing is kept per command before latency_init() */
+	memset(&client, 0, sizeof(client));
+	latency_record(&client, 'e', stamp);
+	CHECK(client.count == 1);
+	CHECK(latency_hist('e', LAT_TOTAL) == NULL);
+	CHECK(latency_format(line, sizeof(line), 'e') < 0);
+
+	/* the phases of a command: queue, tty and the whole */
+	CHECK(latency_init() == 0);
+	latency_record(&client, 'e', stamp);
+	CHECK(client.count == 2);
+	CHECK(latency_hist('e', LAT_QUEUE) && close_to(hist_percentile(latency_hist('e', LAT_QUEUE), 50), 500));
+	CHECK(latency_hist('e', LAT_TTY) && close_to(hist_percentile(latency_hist('e', LAT_TTY), 50), 4000));
+	CHECK(latency_hist('e', LAT_TOTAL) && close_to(hist_percentile(latency_hist('e', LAT_TOTAL), 50), 4500));
+	CHECK(latency_hist('E', LAT_TOTAL) == NULL);
+	CHECK(latency_format(line, sizeof(line), 'e') > 0);
+	CHECK(strstr(line, "queue: n=1") && strstr(line, "tty: n=1") && strstr(line, "total: n=1"));
+
+	return CHECK_RESULT;
+}
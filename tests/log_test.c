@@ -0,0 +1,131 @@
+/**************************************************************
+        log_test - the rate limit, the order of the records in
+        the ring and what is dropped when it is full
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/nexbridge.h"
+#include "../src/metrics.h"
+#include "../src/log.h"
+#include "check.h"
+
+#define TEXT_MAX (256 * 1024)
+
+config conf;
+metrics_counters *metrics = NULL;
+
+static char text[TEXT_MAX];
+static size_t text_len;
+static int pipe_fd[2];
+static int saved_stderr;
+
+/* what is logged goes to a pipe instead of stderr */
+static void capture() {
+	text_len = 0;
+	CHECK(pipe(pipe_fd) == 0);
+	fcntl(pipe_fd[0], F_SETFL, O_NONBLOCK);
+	saved_stderr = dup(2);
+	dup2(pipe_fd[1], 2);
+}
+
+/* read the pipe until needle shows up or for a few seconds, 0 if it did not */
+static int read_until(const char *needle) {
+	struct pollfd pfd = { 0, POLLIN, 0 };
+	int tries = 0;
+	ssize_t r;
+
+	pfd.fd = pipe_fd[0];
+	while (tries < 50) {
+		text[text_len] = '\0';
+		if (strstr(text, needle)) return 1;
+		if (poll(&pfd, 1, 100) <= 0) {
+			tries++;
+			continue;
+		}
+		r = read(pipe_fd[0], text + text_len, TEXT_MAX - 1 - text_len);
+		if (r > 0) text_len += r;
+	}
+	return 0;
+}
+
+static void capture_end() {
+	dup2(saved_stderr, 2);
+	close(saved_stderr);
+	close(pipe_fd[0]);
+	close(pipe_fd[1]);
+}
+
+static int count(const char *needle) {
+	const char *p = text;
+	int n = 0;
+
+	while ((p = strstr(p, needle))) {
+		n++;
+		p++;
+	}
+	return n;
+}
+
+/* the start of a second, so the rate window does not turn meanwhile */
+static void next_second() {
+	struct timespec t, now;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &t);
+	do clock_gettime(CLOCK_MONOTONIC_COARSE, &now); while (now.tv_sec == t.tv_sec);
+}
+
+int main() {
+	char fill[4096];
+	int i, found;
+
+	memset(fill, '.', sizeof(fill));
+
+	/* over the rate is dropped and counted, the writer reports it */
+	capture();
+	log_rate(5);
+	next_second();
+	for (i = 0; i < 10; i++) log_write(LOG_INFO, "rate %d", i);
+	log_rate(0);
+	log_write(LOG_DEBUG, "debug");
+	log_flush();
+	found = read_until("over the rate limit");
+	capture_end();
+	CHECK(found);
+	CHECK(count("LOG: rate ") == 5);
+	CHECK(strstr(text, "LOG: rate 4\n") && !strstr(text, "rate 5\n"));
+	CHECK(strstr(text, "DBG: debug\n") != NULL);
+	CHECK(strstr(text, "0 messages dropped (ring full), 5 over the rate limit") != NULL);
+
+	/* through the ring in order */
+	capture();
+	CHECK(log_start() == 0);
+	for (i = 0; i < 3; i++) log_write(LOG_INFO, "ring %d", i);
+	found = read_until("ring 2\n");
+	log_flush();  /* waits for the writer to be done with the ring */
+	capture_end();
+	CHECK(found);
+	CHECK(strstr(text, "LOG: ring 0\nLOG: ring 1\nLOG: ring 2\n") != NULL);
+
+	/* the writer is stuck on a full pipe, the ring takes LOG_RING_SIZE records */
+	capture();
+	fcntl(pipe_fd[1], F_SETFL, O_NONBLOCK);
+	while (write(pipe_fd[1], fill, sizeof(fill)) > 0);
+	while (write(pipe_fd[1], fill, 1) > 0);
+	fcntl(pipe_fd[1], F_SETFL, 0);
+	for (i = 0; i < LOG_RING_SIZE + 10; i++) log_write(LOG_INFO, "full %d", i);
+	found = read_until("messages dropped");
+	capture_end();
+	CHECK(found);
+	CHECK(count("LOG: full ") == LOG_RING_SIZE);
+	CHECK(strstr(text, "LOG: full 255\n") && !strstr(text, "full 256\n"));
+	CHECK(strstr(text, "10 messages dropped (ring full), 0 over the rate limit") != NULL);
+
+	return CHECK_RESULT;
+}
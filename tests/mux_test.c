@@ -0,0 +1,281 @@
+/**************************************************************
+        mux_test - NexStar transactions of several sessions on
+        one tty
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/nexbridge.h"
+#include "../src/mux.h"
+#include "stubs.h"
+#include "check.h"
+
+#ifdef HAVE_EVLOOP
+
+static device dev;
+
+static void input(session *s, const char *cmd) {
+	mux_session_input(s, cmd, strlen(cmd));
+}
+
+static void reply(const char *data) {
+	mux_tty_input(&dev, data, strlen(data));
+}
+
+/* what went to the tty as a string, emptied */
+static const char *tty_got() {
+	static char str[NEX_REPLY_MAX];
+
+	memcpy(str, to_tty, to_tty_len);
+	str[to_tty_len] = '\0';
+	to_tty_len = 0;
+	return str;
+}
+
+static int done_count;
+
+static void done(device *d, transaction *t) {
+	done_count++;
+}
+
+static void fire(ev_timer *t) {
+	if (!t->armed) return;
+	if (now_usec < t->when * 1000) now_usec = t->when * 1000;
+	t->armed = 0;
+	t->cb(t);
+}
+
+/* cmd of s answered usec after it went to the tty */
+static void transact(session *s, const char *cmd, const char *answer, uint64_t usec) {
+	input(s, cmd);
+	fire(&dev.pace_timer);
+	now_usec += usec;
+	reply(answer);
+	session_sent(s);
+	tty_got();
+}
+
+int main() {
+	session a, b, c, d;
+	int i;
+
+	conf.mux = 1;
+	stub_session(&a, &dev);
+	b = c = d = a;
+	b.id = 1;
+	c.id = 2;
+	d.id = 3;
+	dev.session_count = 4;
+	dev.tty.fd = open("/dev/null", O_RDWR);
+	CHECK(dev.tty.fd >= 0);
+
+	/* a command goes to the tty, the reply only to the session which asked */
+	input(&a, "Kx");
+	CHECK(!strcmp(tty_got(), "Kx"));
+	input(&b, "V");
+	CHECK(to_tty_len == 0);  /* waits for the reply to 'Kx' */
+	reply("x");
+	CHECK(!strcmp(session_sent(&a), ""));
+	reply("#");
+	CHECK(!strcmp(session_sent(&a), "x#"));
+	CHECK(!strcmp(tty_got(), "V"));
+	reply("\x04\x0a#");
+	CHECK(!strcmp(session_sent(&b), "\x04\x0a#"));
+	CHECK(!strcmp(session_sent(&a), ""));
+	CHECK(dev.current == NULL && dev.queue == NULL);
+
+	/* one transaction of a session at a time, its commands keep their order */
+	input(&a, "KaKb");
+	CHECK(!strcmp(tty_got(), "Ka"));
+	reply("a#");
+	CHECK(!strcmp(tty_got(), "Kb"));
+	reply("b#");
+	CHECK(!strcmp(session_sent(&a), "a#b#"));
+
+	/* a half command waits for the rest */
+	input(&a, "R34AB");
+	CHECK(to_tty_len == 0);
+	input(&a, ",12CE");
+	CHECK(!strcmp(tty_got(), "R34AB,12CE"));
+	reply("#");
+	CHECK(!strcmp(session_sent(&a), "#"));
+
+	/* the queued command of a session which went away is dropped */
+	input(&a, "Kx");
+	input(&b, "Ky");
+	mux_session_closed(&b);
+	CHECK(b.tr == NULL);
+	reply("x#");
+	CHECK(to_tty_len == 2 && !strcmp(tty_got(), "Kx"));
+	CHECK(dev.current == NULL && dev.queue == NULL);
+	session_sent(&a);
+
+	/* the tty went away, everything in flight and queued is answered */
+	input(&a, "E");
+	input(&b, "Z");
+	tty_got();
+	mux_fail(&dev);
+	CHECK(!strcmp(session_sent(&a), TTY_ERROR_REPLY));
+	CHECK(!strcmp(session_sent(&b), TTY_ERROR_REPLY));
+	CHECK(dev.current == NULL && dev.queue == NULL);
+
+	/* an identical query waits for the reply of the one on the wire */
+	input(&a, "E");
+	input(&b, "E");
+	CHECK(dev.coalesced == 1);
+	CHECK(!strcmp(tty_got(), "E"));
+	reply("34AB,12CE#");
+	CHECK(!strcmp(session_sent(&a), "34AB,12CE#"));
+	CHECK(!strcmp(session_sent(&b), "34AB,12CE#"));
+	CHECK(to_tty_len == 0);
+
+	/* or of the queued one */
+	input(&a, "Kx");
+	input(&b, "e");
+	input(&c, "e");
+	CHECK(dev.coalesced == 2);
+	reply("x#");
+	CHECK(!strcmp(tty_got(), "Kxe"));
+	reply("34AB0500,12CE0500#");
+	CHECK(!strcmp(session_sent(&b), "34AB0500,12CE0500#"));
+	CHECK(!strcmp(session_sent(&c), "34AB0500,12CE0500#"));
+	CHECK(to_tty_len == 0);
+	session_sent(&a);
+
+	/* not across a command which moves the mount, and never for those */
+	input(&a, "E");
+	input(&b, "M");
+	input(&c, "E");
+	reply("34AB,12CE#");
+	reply("#");
+	reply("34AC,12CE#");
+	CHECK(!strcmp(tty_got(), "EME"));
+	CHECK(!strcmp(session_sent(&c), "34AC,12CE#"));
+	input(&a, "M");
+	input(&b, "M");
+	reply("#");
+	reply("#");
+	CHECK(!strcmp(tty_got(), "MM"));
+	CHECK(dev.coalesced == 2);
+	session_sent(&a);
+	session_sent(&b);
+
+	/* a waiter whose session went away gets nothing, the others their reply */
+	input(&a, "Z");
+	input(&b, "Z");
+	input(&c, "Z");
+	mux_session_closed(&b);
+	reply("34AB,12CE#");
+	CHECK(!strcmp(session_sent(&a), "34AB,12CE#"));
+	CHECK(!strcmp(session_sent(&b), ""));
+	CHECK(!strcmp(session_sent(&c), "34AB,12CE#"));
+	CHECK(!strcmp(tty_got(), "Z"));
+	CHECK(dev.current == NULL && dev.queue == NULL);
+
+	/* stops and motion go to the tty before configuration, that before queries,
+	   a stop does not pass the motion queued before it */
+	input(&a, "E");
+	input(&b, "e");
+	input(&c, "T\x02");
+	input(&d, "R34AB,12CE");
+	CHECK(mux_submit(&dev, "M", 1, done, NULL) == 0);
+	reply("34AB,12CE#");
+	reply("#");
+	reply("#");
+	reply("#");
+	reply("34AB0500,12CE0500#");
+	CHECK(!strcmp(tty_got(), "ER34AB,12CEMT\x02" "e"));
+	CHECK(done_count == 1);
+	CHECK(!strcmp(session_sent(&b), "34AB0500,12CE0500#"));
+	CHECK(!strcmp(session_sent(&c), "#"));
+	CHECK(!strcmp(session_sent(&d), "#"));
+	session_sent(&a);
+
+	/* a zero rate passthrough slew is a stop, queries keep their order */
+	input(&a, "E");
+	input(&b, "Z");
+	input(&c, "e");
+	mux_session_input(&d, "P\x03\x10\x06\x00\x00\x00\x00", 8);  /* zero rate slew, a stop */
+	reply("34AB,12CE#");
+	reply("#");
+	reply("34AB,12CE#");
+	reply("34AB0500,12CE0500#");
+	CHECK(to_tty_len == 11 && !memcmp(to_tty, "EP\x03\x10\x06\x00\x00\x00\x00" "Ze", 11));
+	to_tty_len = 0;
+	CHECK(dev.current == NULL && dev.queue == NULL);
+	session_sent(&a);
+	session_sent(&b);
+	session_sent(&c);
+	session_sent(&d);
+
+	/* a timed out command gets the error reply, not the bytes which came */
+	input(&a, "E");
+	input(&b, "Kx");
+	CHECK(!strcmp(tty_got(), "E"));
+	reply("34AB,");
+	CHECK(dev.tr_timer.armed);
+	fire(&dev.tr_timer);
+	CHECK(!strcmp(session_sent(&a), TTY_ERROR_REPLY));
+	fire(&dev.pace_timer);  /* the mount gets a break after an error */
+	CHECK(!strcmp(tty_got(), "Kx"));
+	reply("x#");
+	CHECK(!strcmp(session_sent(&b), "x#"));
+
+	/* no gap while the mount makes no errors */
+	dev.gap = dev.failed_gap = dev.clean = 0;
+	dev.rtt = 0;
+	transact(&a, "E", "34AB,12CE#", 40000);
+	CHECK(dev.rtt == 40000 && dev.gap == 0);
+	input(&a, "E");
+	CHECK(!strcmp(tty_got(), "E") && !dev.pace_timer.armed);
+	now_usec += 40000;
+	reply("34AB,12CE#");
+	session_sent(&a);
+
+	/* an error makes it at least half the response time, the next one doubles it */
+	transact(&a, "E", "34AB;12CE#", 40000);
+	CHECK(dev.gap == 20);
+	input(&a, "E");
+	CHECK(to_tty_len == 0 && dev.pace_timer.armed && dev.pace_timer.when == dev.ready_at);
+	fire(&dev.pace_timer);
+	CHECK(!strcmp(tty_got(), "E"));
+	now_usec += 40000;
+	reply("34AB,12CE#");
+	session_sent(&a);
+	transact(&a, "E", "34AB", 0);
+	fire(&dev.tr_timer);
+	CHECK(dev.gap == 40 && dev.failed_gap == 20);
+	session_sent(&a);
+
+	/* a clean run takes 1/8 off, not below -g */
+	for (i = 0; i < 31; i++) transact(&a, "E", "34AB,12CE#", 40000);
+	CHECK(dev.gap == 40);
+	transact(&a, "E", "34AB,12CE#", 40000);
+	CHECK(dev.gap == 35);
+	conf.gap = 38;
+	for (i = 0; i < 32; i++) transact(&a, "E", "34AB,12CE#", 40000);
+	CHECK(dev.gap == 38);
+	conf.gap = 0;
+
+	/* it stops above the gap which failed, tries it after a long clean run */
+	dev.gap = 21;
+	dev.clean = 0;
+	for (i = 0; i < 511; i++) transact(&a, "E", "34AB,12CE#", 40000);
+	CHECK(dev.gap == 21);
+	transact(&a, "E", "34AB,12CE#", 40000);
+	CHECK(dev.gap == 20 && dev.failed_gap == 0);
+
+	close(dev.tty.fd);
+	return CHECK_RESULT;
+}
+
+#else
+
+int main() {
+	return 77;  /* skipped, no event loop on this system */
+}
+
+#endif /* HAVE_EVLOOP */
@@ -0,0 +1,70 @@
+/**************************************************************
+        nexstar_test - command and reply boundaries of the
+        NexStar command set
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#include <string.h>
+
+#include "../src/nexstar.h"
+#include "check.h"
+
+static int command_len(const char *buf) {
+	return nex_command_len(buf, strlen(buf));
+}
+
+static int reply_valid(const char *cmd, int cmd_len, const char *reply) {
+	return nex_reply_valid(cmd, cmd_len, reply, strlen(reply));
+}
+
+int main() {
+	char buf[NEX_CMD_MAX + 16];
+	char pass[8] = { 'P', 1, 16, 1, 0, 0, 0, 2 };  /* get the azm motor version, 2 bytes */
+
+	/* complete commands, 0 until all of it is there */
+	CHECK(nex_command_len("", 0) == 0);
+	CHECK(command_len("E") == 1);
+	CHECK(command_len("K") == 0);
+	CHECK(command_len("Kx") == 2);
+	CHECK(command_len("KxE") == 2);
+	CHECK(command_len("R34AB,12C") == 0);
+	CHECK(command_len("R34AB,12CE") == 10);
+	CHECK(command_len("r34AB0500,12CE050") == 0);
+	CHECK(command_len("r34AB0500,12CE0500") == 18);
+	CHECK(nex_command_len(pass, 7) == 0);
+	CHECK(nex_command_len(pass, 8) == 8);
+
+	/* unknown commands are taken whole, up to NEX_CMD_MAX */
+	CHECK(command_len("?ab") == 3);
+	memset(buf, '?', sizeof(buf));
+	CHECK(nex_command_len(buf, sizeof(buf)) == NEX_CMD_MAX);
+
+	/* reply lengths, 'P' gives it in its last byte */
+	CHECK(nex_reply_len("E", 1) == 10);
+	CHECK(nex_reply_len("Kx", 2) == 2);
+	CHECK(nex_reply_len(pass, 8) == 3);
+	CHECK(nex_reply_len("?", 1) == -1);
+
+	/* fixed length replies end with '#' */
+	CHECK(reply_valid("Kx", 2, "x#"));
+	CHECK(!reply_valid("Kx", 2, "xx"));
+	CHECK(!reply_valid("Kx", 2, "x##"));
+	CHECK(reply_valid("M", 1, "#"));
+	CHECK(reply_valid(pass, 8, "\x01\x02#"));
+	CHECK(!reply_valid(pass, 8, "\x01#"));
+
+	/* positions are hex digits with a ',' in the middle */
+	CHECK(reply_valid("E", 1, "34AB,12CE#"));
+	CHECK(reply_valid("Z", 1, "34ab,12ce#"));
+	CHECK(!reply_valid("E", 1, "34AB,12C#"));
+	CHECK(!reply_valid("E", 1, "34AB;12CE#"));
+	CHECK(!reply_valid("E", 1, "34AG,12CE#"));
+	CHECK(reply_valid("e", 1, "34AB0500,12CE0500#"));
+	CHECK(!reply_valid("z", 1, "34AB0500,12CE050#"));
+	CHECK(!reply_valid("e", 1, "34AB05,0012CE0500#"));
+
+	/* no table entry, anything goes */
+	CHECK(reply_valid("?", 1, "whatever"));
+
+	return CHECK_RESULT;
+}
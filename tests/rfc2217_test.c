@@ -0,0 +1,175 @@
+/**************************************************************
+        rfc2217_test - telnet commands and COM-PORT-OPTION
+        subnegotiations in the client data
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#include <string.h>
+
+#include "../src/nexbridge.h"
+#include "../src/rfc2217.h"
+#include "stubs.h"
+#include "check.h"
+
+#ifdef HAVE_EVLOOP
+
+#define IAC 255
+#define SB 250
+#define SE 240
+#define WILL 251
+#define DO 253
+#define COMPORT 44
+
+static char data[1024];
+static size_t data_len;
+
+/* all of buf, the data bytes end up in data */
+static int input(session *s, const unsigned char *buf, size_t len) {
+	size_t n;
+	int r;
+
+	data_len = 0;
+	while (len) {
+		r = rfc2217_input(s, (const char *)buf, len, data + data_len, &n);
+		if (r < 0) return -1;
+		data_len += n;
+		buf += r;
+		len -= r;
+	}
+	return 0;
+}
+
+static int sent_is(const unsigned char *expect, size_t len) {
+	return sent_len == len && memcmp(sent, expect, len) == 0;
+}
+
+int main() {
+	static const unsigned char escaped[] = { 'K', IAC, IAC, 'x' };
+	static const unsigned char will[] = { IAC, WILL, COMPORT };
+	static const unsigned char will_reply[] = { IAC, DO, COMPORT, IAC, SB, COMPORT, 107, 0, IAC, SE };
+	static const unsigned char signature[] = { IAC, SB, COMPORT, 0, IAC, SE };
+	static const unsigned char before_sb[] = { 'K', 'x', IAC, SB, COMPORT, 1, 0, 0, 0, 0, IAC, SE, 'e' };
+	static const unsigned char baud_9600[] = { IAC, SB, COMPORT, 101, 0, 0, 0x25, 0x80, IAC, SE };
+	static const unsigned char set_19200[] = { IAC, SB, COMPORT, 1, 0, 0, 0x4b, 0x00, IAC, SE };
+	static const unsigned char baud_19200[] = { IAC, SB, COMPORT, 101, 0, 0, 0x4b, 0x00, IAC, SE };
+	static const unsigned char set_115200[] = { IAC, SB, COMPORT, 1, 0, 1, 0xc2, 0x00, IAC, SE };
+	static const unsigned char set_7e[] = { IAC, SB, COMPORT, 2, 7, IAC, SE, IAC, SB, COMPORT, 3, 3, IAC, SE };
+	static const unsigned char reply_7e[] = { IAC, SB, COMPORT, 102, 7, IAC, SE, IAC, SB, COMPORT, 103, 3, IAC, SE };
+	static const unsigned char mask_ff[] = { IAC, SB, COMPORT, 10, IAC, IAC, IAC, SE };
+	static const unsigned char suspend[] = { IAC, SB, COMPORT, 8, IAC, SE };
+	static const unsigned char resume[] = { IAC, SB, COMPORT, 9, IAC, SE };
+	static const unsigned char to_client[] = { 'a', IAC, IAC, 'b' };
+	static const unsigned char dtr_on[] = { IAC, SB, COMPORT, 5, 8, IAC, SE };
+	static const unsigned char dtr_reply[] = { IAC, SB, COMPORT, 105, 9, IAC, SE };
+	static const unsigned char hw_flow[] = { IAC, SB, COMPORT, 5, 3, IAC, SE };
+	static const unsigned char no_flow[] = { IAC, SB, COMPORT, 105, 1, IAC, SE };
+	static const unsigned char brk_on[] = { IAC, SB, COMPORT, 5, 5, IAC, SE };
+	static const unsigned char brk_off[] = { IAC, SB, COMPORT, 105, 6, IAC, SE };
+	static const unsigned char purge_out[] = { IAC, SB, COMPORT, 12, 2, IAC, SE };
+	static const unsigned char purged[] = { IAC, SB, COMPORT, 112, 2, IAC, SE };
+	session s;
+	device dev;
+	size_t i;
+	int updates;
+
+	stub_session(&s, &dev);
+	s.telnet = rfc2217_open(&s);
+	CHECK(s.telnet != NULL);
+	if (s.telnet == NULL) return CHECK_RESULT;
+
+	/* plain data passes, a doubled IAC is one 0xff */
+	CHECK(input(&s, (const unsigned char *)"Kx", 2) == 0);
+	CHECK(data_len == 2 && memcmp(data, "Kx", 2) == 0);
+	CHECK(input(&s, escaped, sizeof(escaped)) == 0);
+	CHECK(data_len == 3 && memcmp(data, "K\xffx", 3) == 0);
+	CHECK(sent_len == 0);
+
+	/* a client which did not talk telnet gets binary replies as they are */
+	CHECK(rfc2217_send(&s, "a\xff" "b", 3) == 0);
+	CHECK(sent_len == 3 && memcmp(sent, "a\xff" "b", 3) == 0);
+	sent_clear();
+
+	/* WILL COM-PORT-OPTION is agreed to and the modem state follows */
+	CHECK(input(&s, will, sizeof(will)) == 0);
+	CHECK(sent_is(will_reply, sizeof(will_reply)));
+	sent_clear();
+	CHECK(input(&s, will, sizeof(will)) == 0);
+	CHECK(sent_len == 0);  /* already on, not answered again */
+
+	/* an empty SIGNATURE asks for ours */
+	CHECK(input(&s, signature, sizeof(signature)) == 0);
+	CHECK(sent_len > 6 && memcmp(sent, "\xff\xfa\x2c\x64", 4) == 0);
+	sent[sent_len] = '\0';
+	CHECK(strstr(sent + 4, PACKAGE_NAME " " VERSION) != NULL);
+	sent_clear();
+
+	/* the data before a subnegotiation is returned before it is run */
+	CHECK(rfc2217_input(&s, (const char *)before_sb, sizeof(before_sb), data, &data_len) == 2);
+	CHECK(data_len == 2 && sent_len == 0);
+	CHECK(input(&s, before_sb + 2, sizeof(before_sb) - 2) == 0);
+	CHECK(data_len == 1 && data[0] == 'e');
+	CHECK(sent_is(baud_9600, sizeof(baud_9600)));  /* baudrate 0 asks for the current one */
+	sent_clear();
+
+	/* one byte at a time is the same */
+	for (i = 0; i < sizeof(set_19200); i++) CHECK(input(&s, set_19200 + i, 1) == 0);
+	CHECK(sent_is(baud_19200, sizeof(baud_19200)));
+	sent_clear();
+
+	CHECK(input(&s, set_7e, sizeof(set_7e)) == 0);
+	CHECK(sent_is(reply_7e, sizeof(reply_7e)));
+	sent_clear();
+
+	/* not while another session uses the device, the reply is the setting */
+	dev.session_count = 2;
+	CHECK(input(&s, set_115200, sizeof(set_115200)) == 0);
+	CHECK(sent_is(baud_19200, sizeof(baud_19200)));
+	sent_clear();
+	CHECK(input(&s, hw_flow, sizeof(hw_flow)) == 0);
+	CHECK(sent_is(no_flow, sizeof(no_flow)));
+	sent_clear();
+	CHECK(input(&s, brk_on, sizeof(brk_on)) == 0);
+	CHECK(sent_is(brk_off, sizeof(brk_off)));
+	sent_clear();
+	CHECK(input(&s, dtr_on, sizeof(dtr_on)) == 0);
+	CHECK(sent_is(dtr_reply, sizeof(dtr_reply)));  /* no tty, reads as off */
+	sent_clear();
+	CHECK(buf_append(&dev.out, "Ky", 2) == 0);     /* another session's command */
+	CHECK(input(&s, purge_out, sizeof(purge_out)) == 0);
+	CHECK(sent_is(purged, sizeof(purged)));
+	CHECK(dev.out.len == 2);
+	dev.session_count = 1;
+	CHECK(input(&s, purge_out, sizeof(purge_out)) == 0);
+	CHECK(dev.out.len == 0);
+	sent_clear();
+
+	/* 0xff in a value is doubled both ways */
+	CHECK(input(&s, mask_ff, sizeof(mask_ff)) == 0);
+	CHECK(sent_len == 8 && (unsigned char)sent[3] == 110);
+	CHECK((unsigned char)sent[4] == IAC && (unsigned char)sent[5] == IAC);
+	sent_clear();
+
+	/* the owner suspended stops the tty */
+	updates = tty_updates;
+	CHECK(input(&s, suspend, sizeof(suspend)) == 0);
+	CHECK(s.suspended == 1 && tty_updates == updates + 1);
+	CHECK(input(&s, resume, sizeof(resume)) == 0);
+	CHECK(s.suspended == 0 && tty_updates == updates + 2);
+
+	/* to the client 0xff goes doubled */
+	sent_clear();
+	CHECK(rfc2217_send(&s, "a\xff" "b", 3) == 0);
+	CHECK(sent_is(to_client, sizeof(to_client)));
+
+	rfc2217_close(&s);
+	CHECK(s.telnet == NULL);
+	return CHECK_RESULT;
+}
+
+#else
+
+int main() {
+	return 77;  /* skipped, no event loop on this system */
+}
+
+#endif /* HAVE_EVLOOP */
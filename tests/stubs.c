@@ -0,0 +1,175 @@
+/**************************************************************
+        stubs - the engine, the event loop and the log for the
+        tests of the session modules
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include "../src/nexbridge.h"
+#include "../src/metrics.h"
+#include "stubs.h"
+
+#define SENT_MAX 65536
+
+config conf;
+metrics_counters *metrics = NULL;
+char sent[SENT_MAX];
+size_t sent_len = 0;
+char to_tty[SENT_MAX];
+size_t to_tty_len = 0;
+int tty_updates = 0;
+int tty_losses = 0;
+uint64_t now_usec = 1000000;
+ev_handle *ev_added = NULL;
+
+void sent_clear() {
+	sent_len = 0;
+}
+
+const char *session_sent(session *s) {
+	static char str[SENT_MAX + 1];
+	size_t len = (s->out.len < SENT_MAX) ? s->out.len : SENT_MAX;
+
+	memcpy(str, s->out.data, len);
+	str[len] = '\0';
+	buf_consume(&s->out, s->out.len);
+	return str;
+}
+
+void stub_session(session *s, device *dev) {
+	memset(dev, 0, sizeof(*dev));
+	memset(s, 0, sizeof(*s));
+	dev->tty.fd = -1;
+	cfsetispeed(&dev->options, B9600);
+	cfsetospeed(&dev->options, B9600);
+	dev->session_count = 1;
+	s->dev = dev;
+	s->io.fd = -1;
+	strcpy(s->addr, "127.0.0.1");
+	sent_clear();
+}
+
+int session_write(session *s, const char *data, size_t len) {
+	if (sent_len + len > SENT_MAX) return -1;
+	memcpy(sent + sent_len, data, len);
+	sent_len += len;
+	return 0;
+}
+
+int session_send(session *s, const char *data, size_t len) {
+	return buf_append(&s->out, data, len);
+}
+
+void session_close(session *s) {
+}
+
+void tty_update(device *dev) {
+	tty_updates++;
+}
+
+int tty_write(device *dev, const char *data, size_t len) {
+	if (to_tty_len + len > SENT_MAX) return -1;
+	memcpy(to_tty + to_tty_len, data, len);
+	to_tty_len += len;
+	return 0;
+}
+
+void tty_lost(device *dev) {
+	tty_losses++;
+}
+
+void poller_subscribe(session *s) {
+}
+
+void poller_unsubscribe(session *s) {
+}
+
+uint64_t ev_now_usec() {
+	return now_usec;
+}
+
+uint64_t ev_now() {
+	return now_usec / 1000;
+}
+
+int set_nonblock(int fd) {
+	return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+int ev_add(ev_handle *h, int fd, uint32_t events, ev_callback cb, void *data) {
+	h->fd = fd;
+	h->events = events;
+	h->cb = cb;
+	h->data = data;
+	ev_added = h;
+	return 0;
+}
+
+int ev_del(ev_handle *h) {
+	if (ev_added == h) ev_added = NULL;
+	return 0;
+}
+
+int ev_modify(ev_handle *h, uint32_t events) {
+	h->events = events;
+	return 0;
+}
+
+void ev_timer_set(ev_timer *t, uint64_t msec, ev_timer_callback cb, void *data) {
+	t->when = ev_now() + msec;
+	t->cb = cb;
+	t->data = data;
+	t->armed = 1;
+}
+
+void ev_timer_cancel(ev_timer *t) {
+	t->armed = 0;
+}
+
+void ev_free_later(void *ptr) {
+	free(ptr);
+}
+
+int map_str_baudrate(const char *baudrate) {
+	if (!strcmp(baudrate, "9600")) return B9600;
+	if (!strcmp(baudrate, "19200")) return B19200;
+	if (!strcmp(baudrate, "115200")) return B115200;
+	return -1;
+}
+
+int map_speed_baudrate(int speed) {
+	switch (speed) {
+	case B9600: return 9600;
+	case B19200: return 19200;
+	case B115200: return 115200;
+	}
+	return 0;
+}
+
+void config_error(const char *fmt, ...) {
+	va_list ap;
+
+	if (getenv("TEST_LOG") == NULL) return;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+void log_write(int level, const char *fmt, ...) {
+	va_list ap;
+
+	if (getenv("TEST_LOG") == NULL) return;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+int log_mask(int mask) {
+	return mask;
+}
@@ -0,0 +1,29 @@
+#ifndef __STUBS_H__
+#define __STUBS_H__
+
+#include <stddef.h>
+
+#include "../src/engine.h"
+
+/*
+ * The engine side of the session modules: what they write to the client
+ * is collected in sent, what goes out with session_send() in the out
+ * buffer of the session, and the tty writes in to_tty. The clock only
+ * moves when a test sets now_usec, timers fire when a test calls them.
+ */
+extern char sent[];
+extern size_t sent_len;
+extern char to_tty[];
+extern size_t to_tty_len;
+extern int tty_updates;
+extern int tty_losses;
+extern uint64_t now_usec;
+extern ev_handle *ev_added;     /* the last handle given to ev_add() */
+
+void sent_clear();
+/* the client data of s as a string, emptied */
+const char *session_sent(session *s);
+/* a session on a closed tty of dev */
+void stub_session(session *s, device *dev);
+
+#endif /*__STUBS_H__*/
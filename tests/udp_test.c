@@ -0,0 +1,142 @@
+/**************************************************************
+        udp_test - commands in datagrams, retransmits answered
+        from the history of the peer
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/nexbridge.h"
+#include "../src/mux.h"
+#include "../src/udp.h"
+#include "stubs.h"
+#include "check.h"
+
+#ifdef HAVE_EVLOOP
+
+static device dev;
+static int client;
+
+/* seq and cmd to the bridge, which reads it at once */
+static void send_cmd(uint32_t seq, const char *cmd) {
+	char buf[UDP_SEQ_LEN + NEX_CMD_MAX];
+	uint32_t n = htonl(seq);
+
+	memcpy(buf, &n, UDP_SEQ_LEN);
+	memcpy(buf + UDP_SEQ_LEN, cmd, strlen(cmd));
+	CHECK(send(client, buf, UDP_SEQ_LEN + strlen(cmd), 0) == UDP_SEQ_LEN + (ssize_t)strlen(cmd));
+	ev_added->cb(ev_added, EV_READ);
+}
+
+/* the next reply datagram is seq and reply, 0 if there is none */
+static int got(uint32_t seq, const char *reply) {
+	char buf[UDP_SEQ_LEN + NEX_REPLY_MAX];
+	uint32_t n = htonl(seq);
+	ssize_t r;
+
+	r = recv(client, buf, sizeof(buf), MSG_DONTWAIT);
+	if (reply == NULL) return r < 0;
+	return r == UDP_SEQ_LEN + (ssize_t)strlen(reply) && !memcmp(buf, &n, UDP_SEQ_LEN) &&
+	       !memcmp(buf + UDP_SEQ_LEN, reply, strlen(reply));
+}
+
+/* what went to the tty is cmd, emptied */
+static int tty_is(const char *cmd) {
+	int r = to_tty_len == strlen(cmd) && !memcmp(to_tty, cmd, to_tty_len);
+
+	to_tty_len = 0;
+	return r;
+}
+
+int main() {
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	session s;
+	int sock, i;
+
+	conf.mux = 1;
+	stub_session(&s, &dev);
+	dev.tty.fd = open("/dev/null", O_RDWR);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	client = socket(AF_INET, SOCK_DGRAM, 0);
+	CHECK(sock >= 0 && client >= 0);
+	CHECK(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+	CHECK(getsockname(sock, (struct sockaddr *)&addr, &len) == 0);
+	CHECK(connect(client, (struct sockaddr *)&addr, len) == 0);
+	CHECK(udp_start(&dev, &sock, 1) == 0);
+	CHECK(ev_added != NULL);
+	if (ev_added == NULL) return CHECK_RESULT;
+
+	/* a command runs once, a retransmit while it runs is not answered */
+	send_cmd(1, "Kx");
+	CHECK(tty_is("Kx"));
+	send_cmd(1, "Kx");
+	CHECK(tty_is(""));
+	CHECK(got(1, NULL));
+	mux_tty_input(&dev, "x#", 2);
+	CHECK(got(1, "x#"));
+	CHECK(got(1, NULL));
+
+	/* a retransmit after the reply gets the kept one */
+	send_cmd(1, "Kx");
+	CHECK(tty_is(""));
+	CHECK(got(1, "x#"));
+
+	/* not one complete command, dropped */
+	send_cmd(2, "K");
+	send_cmd(2, "KxKy");
+	CHECK(tty_is(""));
+	CHECK(got(2, NULL));
+
+	/* a timeout is answered with the error reply */
+	send_cmd(2, "E");
+	CHECK(tty_is("E"));
+	mux_tty_input(&dev, "34AB", 4);
+	CHECK(dev.tr_timer.armed);
+	dev.tr_timer.armed = 0;
+	dev.tr_timer.cb(&dev.tr_timer);
+	CHECK(got(2, TTY_ERROR_REPLY));
+	dev.gap = 0;  /* no pacing after the error */
+
+	/* the history keeps the last UDP_HISTORY commands of the peer */
+	for (i = 0; i < UDP_HISTORY; i++) {
+		send_cmd(10 + i, "V");
+		mux_tty_input(&dev, "\x04\x0a#", 3);
+		CHECK(got(10 + i, "\x04\x0a#"));
+	}
+	CHECK(tty_is("VVVVVVVV"));
+	send_cmd(10, "V");
+	CHECK(got(10, "\x04\x0a#") && tty_is(""));
+	send_cmd(1, "Kx");
+	CHECK(tty_is("Kx"));  /* forgotten, runs again */
+	mux_tty_input(&dev, "x#", 2);
+	CHECK(got(1, "x#"));
+
+	/* without the tty it is answered at once */
+	close(dev.tty.fd);
+	dev.tty.fd = -1;
+	send_cmd(30, "E");
+	CHECK(tty_is(""));
+	CHECK(got(30, TTY_ERROR_REPLY));
+
+	udp_stop(&dev);
+	close(client);
+	return CHECK_RESULT;
+}
+
+#else
+
+int main() {
+	return 77;  /* skipped, no event loop on this system */
+}
+
+#endif /* HAVE_EVLOOP */
@@ -0,0 +1,186 @@
+/**************************************************************
+        websocket_test - the upgrade handshake, its SHA-1 and
+        base64 and the frames both ways
+
+        (C)2013-2016 by Rumen G.Bogdanovski
+***************************************************************/
+#include <stdio.h>
+#include <string.h>
+
+#include "../src/nexbridge.h"
+#include "../src/websocket.h"
+#include "stubs.h"
+#include "check.h"
+
+#ifdef HAVE_EVLOOP
+
+/* RFC 6455 section 1.3 */
+#define KEY "dGhlIHNhbXBsZSBub25jZQ=="
+#define ACCEPT "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n"
+/* with the GUID it is one SHA-1 block and the padding another */
+#define KEY_64 "AAAAAAAAAAAAAAAAAAAAAAAAAAA="
+#define ACCEPT_64 "Sec-WebSocket-Accept: UWrVbbSA8CwQ2KbqU4597jO0leU=\r\n"
+
+static session s;
+static device dev;
+
+static void ws_session() {
+	if (s.ws) ws_close(&s);
+	stub_session(&s, &dev);
+	s.ws = ws_open(&s);
+}
+
+static void request_key(char *buf, size_t size, const char *key, const char *version, const char *origin) {
+	snprintf(buf, size, "GET /mount HTTP/1.1\r\nHost: mount.local:10000\r\nUpgrade: websocket\r\n"
+	         "Connection: keep-alive, Upgrade\r\nSec-WebSocket-Key: %s\r\n%s%s%s%s%s\r\n", key,
+	         version ? "Sec-WebSocket-Version: " : "", version ? version : "", version ? "\r\n" : "",
+	         origin ? origin : "", origin ? "\r\n" : "");
+}
+
+static void request(char *buf, size_t size, const char *version, const char *origin) {
+	request_key(buf, size, KEY, version, origin);
+}
+
+/* the status line of the answer to the request */
+static int status(const char *version, const char *origin) {
+	const char *data;
+	char req[512];
+	int code = 0;
+
+	ws_session();
+	request(req, sizeof(req), version, origin);
+	ws_input(&s, req, strlen(req));
+	ws_next(&s, &data);
+	sent[sent_len < 64 ? sent_len : 63] = '\0';
+	sscanf(sent, "HTTP/1.1 %d", &code);
+	return code;
+}
+
+/* a client frame, masked as it has to be */
+static size_t frame(char *out, int op, const char *data, size_t len, int mask) {
+	static const unsigned char key[4] = { 0x12, 0x34, 0x56, 0x78 };
+	size_t i, n = 2;
+
+	out[0] = 0x80 | op;
+	if (len < 126) {
+		out[1] = len;
+	} else {
+		out[1] = 126;
+		out[2] = len >> 8;
+		out[3] = len;
+		n = 4;
+	}
+	if (mask) {
+		out[1] |= 0x80;
+		memcpy(out + n, key, 4);
+		n += 4;
+	}
+	for (i = 0; i < len; i++) out[n + i] = mask ? data[i] ^ key[i % 4] : data[i];
+	return n + len;
+}
+
+int main() {
+	char req[512], buf[1024], big[300];
+	const char *data;
+	size_t i, n;
+
+	/* the handshake, split anywhere */
+	ws_session();
+	request(req, sizeof(req), "13", NULL);
+	for (i = 0; i + 1 < strlen(req); i++) {
+		CHECK(ws_input(&s, req + i, 1) == 0);
+		CHECK(ws_next(&s, &data) == 0);
+	}
+	buf[0] = req[i];  /* the last byte of the request and a frame */
+	n = 1 + frame(buf + 1, 2, "Kx", 2, 1);
+	CHECK(ws_input(&s, buf, n) == 0);
+	CHECK(ws_next(&s, &data) == 2 && memcmp(data, "Kx", 2) == 0);
+	CHECK(sent_len > 12 && memcmp(sent, "HTTP/1.1 101 ", 13) == 0);
+	sent[sent_len] = '\0';
+	CHECK(strstr(sent, ACCEPT) != NULL);  /* SHA-1 and base64 of the key */
+	CHECK(ws_next(&s, &data) == 0);
+
+	ws_session();
+	request_key(req, sizeof(req), KEY_64, "13", NULL);
+	CHECK(ws_input(&s, req, strlen(req)) == 0);
+	CHECK(ws_next(&s, &data) == 0);
+	sent[sent_len] = '\0';
+	CHECK(strstr(sent, ACCEPT_64) != NULL);
+	sent_clear();
+
+	/* ping gets a pong with its payload, text frames are data too */
+	n = frame(buf, 9, "hi", 2, 1);
+	n += frame(buf + n, 1, "e", 1, 1);
+	CHECK(ws_input(&s, buf, n) == 0);
+	CHECK(ws_next(&s, &data) == 1 && data[0] == 'e');
+	CHECK(sent_len == 4 && memcmp(sent, "\x8a\x02hi", 4) == 0);
+	sent_clear();
+
+	/* 16 bit lengths */
+	memset(big, 'z', sizeof(big));
+	n = frame(buf, 2, big, sizeof(big), 1);
+	CHECK(ws_input(&s, buf, n - 1) == 0);
+	CHECK(ws_next(&s, &data) == 0);
+	CHECK(ws_input(&s, buf + n - 1, 1) == 0);
+	CHECK(ws_next(&s, &data) == (int)sizeof(big) && memcmp(data, big, sizeof(big)) == 0);
+
+	/* replies go out in binary frames */
+	CHECK(ws_send(&s, "x#", 2) == 0);
+	CHECK(sent_len == 4 && memcmp(sent, "\x82\x02x#", 4) == 0);
+	sent_clear();
+	CHECK(ws_send(&s, big, sizeof(big)) == 0);
+	CHECK(sent_len == 4 + sizeof(big) && memcmp(sent, "\x82\x7e\x01\x2c", 4) == 0);
+	sent_clear();
+
+	/* close is echoed and ends the session */
+	n = frame(buf, 8, "\x03\xe8", 2, 1);
+	CHECK(ws_input(&s, buf, n) == 0);
+	CHECK(ws_next(&s, &data) < 0);
+	CHECK(sent_len == 4 && memcmp(sent, "\x88\x02\x03\xe8", 4) == 0);
+
+	/* so does an unmasked frame, with a protocol error */
+	ws_session();
+	request(req, sizeof(req), "13", NULL);
+	n = strlen(req);
+	memcpy(buf, req, n);
+	n += frame(buf + n, 2, "Kx", 2, 0);
+	CHECK(ws_input(&s, buf, n) == 0);
+	CHECK(ws_next(&s, &data) < 0);
+	CHECK(sent_len > 4 && memcmp(sent + sent_len - 4, "\x88\x02\x03\xea", 4) == 0);
+
+	/* requests which are not taken */
+	CHECK(status("13", NULL) == 101);
+	CHECK(status("8", NULL) == 426);
+	CHECK(strstr(sent, "Sec-WebSocket-Version: 13\r\n") != NULL);
+	CHECK(status(NULL, NULL) == 426);
+	ws_session();
+	ws_input(&s, "GET / HTTP/1.1\r\nHost: x\r\n\r\n", 27);
+	CHECK(ws_next(&s, &data) < 0);
+	CHECK(sent_len > 12 && memcmp(sent, "HTTP/1.1 400 ", 13) == 0);
+
+	/* browsers only from the pages of the host or of -O */
+	CHECK(status("13", "Origin: http://mount.local:10000") == 101);
+	CHECK(status("13", "Origin: http://mount.local") == 101);     /* the same host on port 80 */
+	CHECK(status("13", "Origin: https://MOUNT.local:8443") == 101);
+	CHECK(status("13", "Origin: http://mount.localhost") == 403);
+	CHECK(status("13", "Origin: http://mount") == 403);
+	CHECK(status("13", "Origin: null") == 403);
+	CHECK(status("13", "Origin: http://evil.example") == 403);
+	snprintf(conf.ws_origins, sizeof(conf.ws_origins), "http://planetarium:8080,http://evil.example");
+	CHECK(status("13", "Origin: http://evil.example") == 101);
+	CHECK(status("13", "Origin: http://mount.local:10000") == 101);
+	CHECK(status("13", "Origin: http://other.example") == 403);
+	strcpy(conf.ws_origins, "*");
+	CHECK(status("13", "Origin: http://other.example") == 101);
+
+	ws_close(&s);
+	return CHECK_RESULT;
+}
+
+#else
+
+int main() {
+	return 77;  /* skipped, no event loop on this system */
+}
+
+#endif /* HAVE_EVLOOP */